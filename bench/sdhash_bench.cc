@@ -0,0 +1,650 @@
+/**
+ * sdhash_bench: timings of the sdbf kernels, and of hashing and comparing
+ * whole synthetic corpora, written as JSON for tracking across builds.
+ */
+
+#include "../sdbf/sdbf_class.h"
+#include "../sdbf/sdbf_defines.h"
+#include "../sdbf/sdbf_set.h"
+#include "../sdbf/bloom_filter.h"
+#include "../base64/modp_b64.h"
+#include "../sdhash-src/version.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "boost/program_options.hpp"
+
+namespace po = boost::program_options;
+using namespace std;
+
+// bytes of each synthetic corpus for the kernels, and for the pipelines
+#define KERNEL_BYTES    (1*MB)
+#define CORPUS_BYTES    (8*MB)
+// files in the all-pairs comparison, and bytes of each
+#define COMPARE_FILES   24
+#define COMPARE_BYTES   (256*KB)
+// features hashed into bloom filter indexes
+#define INDEX_FEATURES  (1024*1024)
+
+// one benchmark's timing
+typedef struct {
+    string   name;
+    string   group;       // kernel or pipeline
+    string   variant;     // corpus or layout used, or empty
+    uint64_t iterations;  // runs of the body per repetition
+    double   ns_median;   // ns per run, median of the repetitions
+    double   ns_min;      // ns per run, fastest repetition
+    uint64_t bytes;       // bytes processed per run, 0 if not meaningful
+    uint64_t ops;         // operations per run
+} bench_result_t;
+
+// the body of a benchmark: one run, on its argument
+typedef void (*bench_fn)(void *arg);
+
+// keeps results from being optimized away
+static volatile uint64_t sink;
+
+static double
+now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+    Deterministic generator for the corpora: xorshift64*, so the data,
+    and the work done on it, are the same in every build.
+*/
+class corpus_rng {
+public:
+    corpus_rng(uint64_t seed) { state = seed ? seed : 1; }
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+private:
+    uint64_t state;
+};
+
+/**
+    Fills buf with a synthetic corpus.
+    \param kind random, text, sparse or repetitive
+    \param buf buffer
+    \param len its length
+    \param seed generator seed; corpora with the same seed share content
+*/
+static void
+make_corpus(const string &kind, uint8_t *buf, uint64_t len, uint64_t seed) {
+    corpus_rng rng(seed);
+    if (kind == "random") {
+        for (uint64_t i = 0; i < len; i++)
+            buf[i] = rng.next() >> 56;
+    } else if (kind == "text") {
+        // words from a small vocabulary, Zipf-like: short words common
+        static const char *words[] = { "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+            "with", "was", "on", "be", "by", "this", "are", "from", "which", "or", "digest", "filter",
+            "similarity", "feature", "entropy", "forensic", "evidence", "fragment", "bloom", "hash",
+            "segment", "comparison", "threshold", "directory", "between", "software", "memory" };
+        const uint32_t nwords = sizeof(words) / sizeof(words[0]);
+        uint64_t i = 0;
+        while (i < len) {
+            uint64_t r = rng.next();
+            uint32_t w = (uint32_t)((r >> 32) % nwords) * ((r >> 8) & 1) + (uint32_t)((r >> 16) % 10) * !((r >> 8) & 1);
+            const char *word = words[w % nwords];
+            for (const char *c = word; *c && i < len; c++)
+                buf[i++] = *c;
+            if (i < len)
+                buf[i++] = (r & 0xF) == 0 ? '\n' : ((r & 0x3F) == 1 ? '.' : ' ');
+        }
+    } else if (kind == "sparse") {
+        // mostly zero, with a random 512-byte run in one block of 16
+        memset(buf, 0, len);
+        for (uint64_t at = 0; at + 512 <= len; at += 8*KB) {
+            if (rng.next() % 16 == 0) {
+                for (uint32_t i = 0; i < 512; i++)
+                    buf[at + i] = rng.next() >> 56;
+            }
+        }
+    } else {
+        // a 4KB pattern over and over, with one byte in 1024 changed
+        uint8_t pattern[4*KB];
+        for (uint32_t i = 0; i < sizeof(pattern); i++)
+            pattern[i] = rng.next() >> 56;
+        for (uint64_t i = 0; i < len; i++)
+            buf[i] = pattern[i % sizeof(pattern)];
+        for (uint64_t i = 0; i < len / 1024; i++)
+            buf[rng.next() % len] = rng.next() >> 56;
+    }
+}
+
+/**
+    sdbf_bench: runs the benchmarks.  A friend of sdbf, so the core
+    kernels can be timed on their own.
+*/
+class sdbf_bench {
+
+public:
+    sdbf_bench(double min_time, uint32_t reps, const string &filter);
+    ~sdbf_bench();
+
+    /// run everything whose name contains the filter
+    void run_all();
+    /// results as JSON
+    string json() const;
+
+private:
+    void run(const string &name, const string &group, const string &variant, bench_fn fn, void *arg,
+             uint64_t bytes, uint64_t ops);
+    uint8_t *corpus(const string &kind, uint64_t len, uint64_t seed);
+
+    // kernel and pipeline bodies, with their state
+    struct kernel_arg {
+        uint8_t  *data;
+        uint64_t  len;
+        uint16_t *ranks;
+        uint16_t *scores;
+        uint32_t (*sha1)[5];
+        uint32_t  count;
+        uint8_t  *filters;
+        char     *text;
+        uint64_t  text_len;
+        sdbf     *digest;
+        bloom_filter *index;
+        sdbf_set *set;
+        index_info *info;
+        uint32_t  block_size;
+    };
+    static void chunk_ranks(void *arg);
+    static void chunk_scores(void *arg);
+    static void sha1_features(void *arg);
+    static void sha1_insert(void *arg);
+    static void bitcount_cut(void *arg);
+    static void bitcount_cut_asm(void *arg);
+    static void hamming(void *arg);
+    static void b64_encode(void *arg);
+    static void b64_decode(void *arg);
+    static void b64_decode_into(void *arg);
+    static void parse_stream(void *arg);
+    static void parse_block(void *arg);
+    static void index_insert(void *arg);
+    static void index_query(void *arg);
+    static void index_query_batch(void *arg);
+    static void hash_buffer(void *arg);
+    static void compare_all(void *arg);
+
+    double min_time;
+    uint32_t reps;
+    string filter;
+    index_info info;                    // no indexes: plain hashing
+    vector<bench_result_t> results;
+    vector<uint8_t*> buffers;           // corpora, freed at the end
+};
+
+sdbf_bench::sdbf_bench(double min_time, uint32_t reps, const string &filter) {
+    this->min_time = min_time;
+    this->reps = reps < 1 ? 1 : reps;
+    this->filter = filter;
+    memset(&info, 0, sizeof(info));
+}
+
+sdbf_bench::~sdbf_bench() {
+    for (uint32_t i = 0; i < buffers.size(); i++)
+        free(buffers[i]);
+}
+
+uint8_t *
+sdbf_bench::corpus(const string &kind, uint64_t len, uint64_t seed) {
+    uint8_t *buf = (uint8_t*)alloc_check(ALLOC_ONLY, len, "sdbf_bench", "corpus", ERROR_EXIT);
+    make_corpus(kind, buf, len, seed);
+    buffers.push_back(buf);
+    return buf;
+}
+
+/**
+    Times one benchmark: doubles the iterations until a repetition takes
+    min_time, then takes reps repetitions.
+    \param name benchmark name
+    \param group kernel or pipeline
+    \param variant corpus kind, layout or mode, or empty
+    \param fn body, run once per iteration
+    \param arg argument for fn
+    \param bytes bytes processed per iteration, 0 if not meaningful
+    \param ops operations per iteration
+*/
+void
+sdbf_bench::run(const string &name, const string &group, const string &variant, bench_fn fn, void *arg,
+                uint64_t bytes, uint64_t ops) {
+    string full = variant.empty() ? name : name + "/" + variant;
+    if (!filter.empty() && full.find(filter) == string::npos)
+        return;
+    // warm up, and find the iterations that fill min_time
+    uint64_t iterations = 1;
+    for (;;) {
+        double start = now();
+        for (uint64_t i = 0; i < iterations; i++)
+            fn(arg);
+        if (now() - start >= min_time || iterations >= (1ULL << 30))
+            break;
+        iterations *= 2;
+    }
+    vector<double> times;
+    for (uint32_t r = 0; r < reps; r++) {
+        double start = now();
+        for (uint64_t i = 0; i < iterations; i++)
+            fn(arg);
+        times.push_back((now() - start) * 1e9 / iterations);
+    }
+    sort(times.begin(), times.end());
+    bench_result_t res;
+    res.name = full;
+    res.group = group;
+    res.variant = variant;
+    res.iterations = iterations;
+    res.ns_median = times[times.size() / 2];
+    res.ns_min = times[0];
+    res.bytes = bytes;
+    res.ops = ops;
+    results.push_back(res);
+    cerr << "sdhash-bench: " << full << " " << res.ns_median / 1e3 << " us" << endl;
+}
+
+void
+sdbf_bench::chunk_ranks(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    sdbf::gen_chunk_ranks(k->data, k->len, k->ranks, 0);
+    sink += k->ranks[k->len / 2];
+}
+
+void
+sdbf_bench::chunk_scores(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    int32_t histo[66];
+    memset(histo, 0, sizeof(histo));
+    sdbf::gen_chunk_scores(k->ranks, k->len, k->scores, histo);
+    sink += histo[1];
+}
+
+void
+sdbf_bench::sha1_features(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    uint32_t pop_win = sdbf::config->pop_win_size;
+    for (uint32_t i = 0; i < k->count; i++)
+        SHA1(k->data + i, pop_win, (uint8_t*)k->sha1[i]);
+    sink += k->sha1[0][0];
+}
+
+void
+sdbf_bench::sha1_insert(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    // as while hashing: a new 256-byte filter every max_elem features
+    uint32_t max_elem = sdbf::config->max_elem;
+    memset(k->filters, 0, (k->count / max_elem + 1) * BF_SIZE);
+    uint32_t set = 0;
+    for (uint32_t i = 0; i < k->count; i++)
+        set += bf_sha1_insert(k->filters + (i / max_elem) * BF_SIZE, 0, k->sha1[i]);
+    sink += set;
+}
+
+void
+sdbf_bench::bitcount_cut(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i + 1 < k->count; i++)
+        total += bf_bitcount_cut_256(k->filters + i * BF_SIZE, k->filters + (i + 1) * BF_SIZE, 0, 0);
+    sink += total;
+}
+
+void
+sdbf_bench::bitcount_cut_asm(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i + 1 < k->count; i++)
+        total += bf_bitcount_cut_256_asm(k->filters + i * BF_SIZE, k->filters + (i + 1) * BF_SIZE, 0, 0);
+    sink += total;
+}
+
+void
+sdbf_bench::hamming(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    // compute_hamming() allocates the weights afresh
+    free(k->digest->hamming);
+    k->digest->compute_hamming();
+    sink += k->digest->hamming[0];
+}
+
+void
+sdbf_bench::b64_encode(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    int len = modp_b64_encode(k->text, (const char*)k->data, k->len);
+    sink += len;
+}
+
+void
+sdbf_bench::b64_decode(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    int len = 0;
+    char *out = b64decode(k->text, k->text_len, &len);
+    sink += len;
+    free(out);
+}
+
+void
+sdbf_bench::b64_decode_into(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    // as for block-mode digests: one 256-byte filter at a time
+    uint64_t total = 0;
+    for (uint64_t at = 0; at + 344 <= k->text_len; at += 344)
+        total += b64decode_into((const uint8_t*)k->text + at, 344, k->filters);
+    sink += total;
+}
+
+void
+sdbf_bench::parse_stream(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    sdbf_set *set = new sdbf_set(k->text, k->text_len);
+    sink += set->size();
+    sdbf_set::destory(set);
+}
+
+void
+sdbf_bench::parse_block(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    // block-mode digests are read as from a set file
+    FILE *in = fmemopen(k->text, k->text_len, "r");
+    uint64_t count = 0;
+    for (;;) {
+        try {
+            sdbf *digest = new sdbf(in);
+            count++;
+            delete digest;
+            if (getc(in) == EOF)
+                break;
+        } catch (int e) {
+            break;
+        }
+    }
+    fclose(in);
+    sink += count;
+}
+
+void
+sdbf_bench::index_insert(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    uint64_t inserted = 0;
+    for (uint32_t i = 0; i < k->count; i += BF_BATCH)
+        k->index->insert_batch(k->sha1 + i, std::min((uint32_t)BF_BATCH, k->count - i), &inserted);
+    sink += inserted;
+}
+
+void
+sdbf_bench::index_query(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < k->count; i++)
+        found += k->index->query_sha1(k->sha1[i]);
+    sink += found;
+}
+
+void
+sdbf_bench::index_query_batch(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    uint64_t found = 0;
+    for (uint32_t i = 0; i < k->count; i += BF_BATCH)
+        k->index->query_batch(k->sha1 + i, std::min((uint32_t)BF_BATCH, k->count - i), &found);
+    sink += found;
+}
+
+void
+sdbf_bench::hash_buffer(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    try {
+        sdbf *digest = new sdbf("bench", (char*)k->data, k->block_size, k->len, k->info);
+        sink += digest->filter_count();
+        delete digest;
+    } catch (int e) {
+    }
+}
+
+void
+sdbf_bench::compare_all(void *arg) {
+    kernel_arg *k = (kernel_arg*)arg;
+    string out = k->set->compare_all(-1);
+    sink += out.size();
+}
+
+/**
+    Runs every benchmark: kernels on KERNEL_BYTES of each corpus, then
+    hashing and all-pairs comparison of each corpus.
+*/
+void
+sdbf_bench::run_all() {
+    const char *kinds[] = { "random", "text", "sparse", "repetitive" };
+    const uint32_t nkinds = 4;
+    uint32_t pop_win = sdbf::config->pop_win_size;
+
+    for (uint32_t c = 0; c < nkinds; c++) {
+        kernel_arg k;
+        memset(&k, 0, sizeof(k));
+        k.data = corpus(kinds[c], KERNEL_BYTES, c + 1);
+        k.len = KERNEL_BYTES;
+        k.ranks = (uint16_t*)alloc_check(ALLOC_ZERO, k.len * sizeof(uint16_t), "sdbf_bench", "ranks", ERROR_EXIT);
+        k.scores = (uint16_t*)alloc_check(ALLOC_ZERO, k.len * sizeof(uint16_t), "sdbf_bench", "scores", ERROR_EXIT);
+        run("gen_chunk_ranks", "kernel", kinds[c], chunk_ranks, &k, k.len, k.len);
+        sdbf::gen_chunk_ranks(k.data, k.len, k.ranks, 0);
+        run("gen_chunk_scores", "kernel", kinds[c], chunk_scores, &k, k.len, k.len);
+        free(k.ranks);
+        free(k.scores);
+    }
+
+    // features and filters: from the random corpus
+    kernel_arg k;
+    memset(&k, 0, sizeof(k));
+    k.data = corpus("random", KERNEL_BYTES + 64, 1);
+    k.len = KERNEL_BYTES;
+    k.count = 64*KB;
+    k.sha1 = (uint32_t (*)[5])alloc_check(ALLOC_ZERO, INDEX_FEATURES * 20, "sdbf_bench", "features", ERROR_EXIT);
+    k.filters = (uint8_t*)alloc_check(ALLOC_ZERO, (k.count / sdbf::config->max_elem + 2) * BF_SIZE, "sdbf_bench", "filters", ERROR_EXIT);
+    run("sha1_features", "kernel", "", sha1_features, &k, (uint64_t)k.count * pop_win, k.count);
+    for (uint32_t i = 0; i < INDEX_FEATURES; i++)
+        SHA1(k.data + i % KERNEL_BYTES, pop_win, (uint8_t*)k.sha1[i]);
+    run("bf_sha1_insert", "kernel", "", sha1_insert, &k, 0, k.count);
+    free(k.filters);
+
+    // filter pairs: as full as filters get, 4096 of them
+    k.count = 4096;
+    k.filters = (uint8_t*)alloc_check(ALLOC_ZERO, k.count * BF_SIZE, "sdbf_bench", "filters", ERROR_EXIT);
+    for (uint32_t i = 0; i < k.count * sdbf::config->max_elem; i++)
+        bf_sha1_insert(k.filters + (i / sdbf::config->max_elem) * BF_SIZE, 0, k.sha1[i % INDEX_FEATURES]);
+    run("bf_bitcount_cut_256", "kernel", "", bitcount_cut, &k, 0, k.count - 1);
+    run("bf_bitcount_cut_256_asm", "kernel", "", bitcount_cut_asm, &k, 0, k.count - 1);
+
+    // a block-mode digest of 16MB: 1024 filters
+    uint8_t *big = corpus("random", 16*MB, 5);
+    k.digest = new sdbf("bench", (char*)big, 16*KB, 16*MB, &info);
+    run("compute_hamming", "kernel", "", hamming, &k, 0, k.digest->filter_count());
+    delete k.digest;
+
+    // base64 of the filters, as in encoded digests
+    k.data = k.filters;
+    k.len = k.count * BF_SIZE;
+    // room for the filters encoded one at a time, padded: 344 characters each
+    k.text = (char*)alloc_check(ALLOC_ZERO, k.count * 344 + 1, "sdbf_bench", "text", ERROR_EXIT);
+    run("base64_encode", "kernel", "", b64_encode, &k, k.len, k.count);
+    // b64decode_into takes 344 characters (256 bytes) at a time
+    string encoded;
+    for (uint32_t i = 0; i < k.count; i++) {
+        char field[400];
+        int len = modp_b64_encode(field, (const char*)k.filters + i * BF_SIZE, BF_SIZE);
+        encoded.append(field, len);
+    }
+    memcpy(k.text, encoded.data(), encoded.size());
+    k.text_len = encoded.size();
+    run("base64_decode_into", "kernel", "", b64_decode_into, &k, k.len, k.count);
+    k.text_len = modp_b64_encode(k.text, (const char*)k.filters, k.len);
+    run("base64_decode", "kernel", "", b64_decode, &k, k.len, k.count);
+    free(k.text);
+    k.text = NULL;
+
+    // parsing encoded digests of the text corpus
+    uint8_t *text = corpus("text", CORPUS_BYTES, 2);
+    for (uint32_t mode = 0; mode < 2; mode++) {
+        string digests;
+        for (uint32_t f = 0; f < CORPUS_BYTES / COMPARE_BYTES; f++) {
+            sdbf *digest = new sdbf("bench", (char*)text + f * COMPARE_BYTES, mode ? 16*KB : 0, COMPARE_BYTES, &info);
+            digest->encode(digests);
+            delete digest;
+        }
+        k.text = (char*)digests.data();
+        k.text_len = digests.size();
+        if (mode)
+            run("parse_text", "kernel", "block", parse_block, &k, k.text_len, CORPUS_BYTES / COMPARE_BYTES);
+        else
+            run("parse_text", "kernel", "stream", parse_stream, &k, k.text_len, CORPUS_BYTES / COMPARE_BYTES);
+    }
+    k.text = NULL;
+
+    // bloom filter indexes: 1M features into 16MB, either layout
+    k.count = INDEX_FEATURES;
+    for (uint32_t blocked = 0; blocked < 2; blocked++) {
+        uint32_t layout = (blocked ? BF_LAYOUT_BLOCKED : BF_LAYOUT_STANDARD) | BF_LAYOUT_HASH64;
+        k.index = new bloom_filter(16*MB, 5, 0, 0.01, layout);
+        const char *name = blocked ? "blocked" : "standard";
+        run("bloom_filter_insert", "kernel", name, index_insert, &k, 0, k.count);
+        run("bloom_filter_query", "kernel", name, index_query, &k, 0, k.count);
+        run("bloom_filter_query_batch", "kernel", name, index_query_batch, &k, 0, k.count);
+        delete k.index;
+    }
+    free(k.filters);
+    free(k.sha1);
+
+    // pipelines: hashing each corpus whole, and comparing its files all-pairs
+    for (uint32_t c = 0; c < nkinds; c++) {
+        kernel_arg p;
+        memset(&p, 0, sizeof(p));
+        p.data = corpus(kinds[c], CORPUS_BYTES, c + 11);
+        p.len = CORPUS_BYTES;
+        p.info = &info;
+        p.block_size = 0;
+        run("hash_stream", "pipeline", kinds[c], hash_buffer, &p, p.len, 1);
+        p.block_size = 16*KB;
+        run("hash_block", "pipeline", kinds[c], hash_buffer, &p, p.len, 1);
+        // overlapping windows, so related files score above zero
+        // digests keep a pointer to their name
+        static char names[COMPARE_FILES][16];
+        p.set = new sdbf_set();
+        for (uint32_t f = 0; f < COMPARE_FILES; f++) {
+            snprintf(names[f], sizeof(names[f]), "file%02u", f);
+            uint64_t at = (uint64_t)f * (CORPUS_BYTES - COMPARE_BYTES) / COMPARE_FILES;
+            try {
+                p.set->add(new sdbf(names[f], (char*)p.data + at, 0, COMPARE_BYTES, &info));
+            } catch (int e) {
+            }
+        }
+        run("compare_all", "pipeline", kinds[c], compare_all, &p, 0, (uint64_t)p.set->size() * (p.set->size() - 1) / 2);
+        sdbf_set::destory(p.set);
+    }
+}
+
+// JSON string, escaped
+static string
+quote(const string &s) {
+    string out = "\"";
+    for (uint32_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\')
+            out += '\\';
+        out += s[i];
+    }
+    return out + "\"";
+}
+
+/**
+    Results as a JSON document: the build, the settings, and one object
+    per benchmark with its time per run and throughput.
+*/
+string
+sdbf_bench::json() const {
+    ostringstream out;
+    out.precision(6);
+    out << "{\n  \"revision\": " << quote(REVISION) << ",\n";
+    out << "  \"compiler\": " << quote(__VERSION__) << ",\n";
+    out << "  \"timestamp\": " << (uint64_t)time(NULL) << ",\n";
+    out << "  \"min_time\": " << min_time << ",\n";
+    out << "  \"repetitions\": " << reps << ",\n";
+    out << "  \"benchmarks\": [";
+    for (uint32_t i = 0; i < results.size(); i++) {
+        const bench_result_t &r = results[i];
+        out << (i ? ",\n" : "\n") << "    { \"name\": " << quote(r.name) << ", \"group\": " << quote(r.group);
+        if (!r.variant.empty())
+            out << ", \"variant\": " << quote(r.variant);
+        out << fixed << ", \"iterations\": " << r.iterations << ", \"ns_per_run\": " << r.ns_median;
+        out << ", \"ns_per_run_min\": " << r.ns_min;
+        out << ", \"ns_per_op\": " << r.ns_median / r.ops;
+        if (r.bytes)
+            out << ", \"mb_per_s\": " << r.bytes / (r.ns_median / 1e9) / MB;
+        out << " }";
+        out.unsetf(ios::fixed);
+    }
+    out << "\n  ]\n}\n";
+    return out.str();
+}
+
+/** sdhash-bench main
+*/
+int main(int argc, char **argv) {
+    double min_time = 0.2;
+    uint32_t reps = 3;
+    string filter;
+    string output;
+    po::variables_map vm;
+    po::options_description options("Options");
+    options.add_options()
+        ("min-time",po::value<double>(&min_time),"seconds each repetition of a benchmark runs for, at least (default 0.2)")
+        ("repetitions",po::value<uint32_t>(&reps),"repetitions of each benchmark; the median is reported (default 3)")
+        ("filter",po::value<std::string>(&filter),"run only benchmarks whose name contains this")
+        ("output,o",po::value<std::string>(&output),"write JSON results to this file, not stdout")
+        ("quick","short runs, for checking that everything works")
+        ("help,h","produce help message")
+        ;
+    try {
+        store(po::parse_command_line(argc, argv, options), vm);
+        notify(vm);
+    } catch (std::exception &e) {
+        cerr << "sdhash-bench: ERROR: " << e.what() << endl;
+        return -1;
+    }
+    if (vm.count("help")) {
+        cout << "Usage: sdhash-bench <options>" << endl;
+        cout << options << endl;
+        return 0;
+    }
+    if (vm.count("quick")) {
+        min_time = 0.01;
+        reps = 1;
+    }
+    sdbf_bench bench(min_time, reps, filter);
+    bench.run_all();
+    if (output.empty()) {
+        cout << bench.json();
+    } else {
+        ofstream out(output.c_str());
+        out << bench.json();
+        if (!out) {
+            cerr << "sdhash-bench: ERROR cannot write to file " << output << endl;
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -170,6 +170,30 @@ bf_bitcount_cut_256_asm( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_of
     //}
     return result;
 }   
+/**
+ * Which short circuit of bf_bitcount_cut_256 gives up on a pair of 256-byte
+ * filters: 1 to 3, or 0 if none does.  For statistics; it repeats the
+ * partial counts, so is not used when scoring.
+ */
+uint32_t bf_cut_level( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack) {
+    uint64_t *f1_64 = (uint64_t *)bfilter_1;
+    uint64_t *f2_64 = (uint64_t *)bfilter_2;
+    uint32_t i, level, result=0, word=0;
+    if( cut_off == 0)
+        return 0;
+    // the cuts are after 4, 8 and 16 of the 32 words, at 8, 4 and 2 times the count
+    for( level=1; level<=3; level++) {
+        for( ; word < (4u << (level-1)); word++) {
+            uint64_t both = f1_64[word] & f2_64[word];
+            for( i=0; i<4; i++)
+                result += sdbf::config->bit_count_16[(both >> (16*i)) & 0xFFFF];
+        }
+        if( ((16u >> level)*result + slack) < cut_off)
+            return level;
+    }
+    return 0;
+}
+
     /**
      * Computer the number of common bits (dot product) b/w two filters--conditional optimized version for 256-byte BFs.
      * The conditional looks first at the dot product of the first 32/64/128 bytes; if it is less than the threshold,
@@ -0,0 +1,264 @@
+// bit_sliced_index.cc
+// transposed bloom filter indexes for multi-set feature lookup
+
+#include "bit_sliced_index.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+
+/**
+    Builds a bit-sliced index from a list of bloom filter indexes.
+    The rows are as large as the smallest index; larger ones are folded.
+    \param indexes indexes to slice, hashing alike (see compatible()), and
+           kept by the caller while this is used
+    \param names name of each index's set, used to match a persisted copy
+    \throws -1 if the indexes are empty or not compatible
+*/
+bit_sliced_index::bit_sliced_index(const std::vector<bloom_filter*> &indexes, const std::vector<std::string> &names) {
+    if (indexes.empty() || !compatible(indexes))
+        throw -1;
+    bf_size = indexes[0]->size();
+    for (uint32_t i = 1; i < indexes.size(); i++) {
+        if (indexes[i]->size() < bf_size)
+            bf_size = indexes[i]->size();
+    }
+    bit_mask = 8*bf_size - 1;
+    hash_count = indexes[0]->hash_functions();
+    layout = indexes[0]->layout();
+    sets = indexes.size();
+    row_words = (sets + 63) / 64;
+    rows = (uint64_t*)alloc_check(ALLOC_ZERO, 8*bf_size*row_words*sizeof(uint64_t), "bit_sliced_index", "rows", ERROR_EXIT);
+    for (uint32_t s = 0; s < sets; s++) {
+        set_filter(s, indexes[s]->data(), indexes[s]->size());
+        set_names.push_back(s < names.size() ? names[s] : indexes[s]->name());
+        set_elems.push_back(indexes[s]->elem_count());
+        slot_map.push_back(s);
+        folded.push_back(indexes[s]->size() > bf_size ? indexes[s] : NULL);
+    }
+}
+
+/**
+    Creates an empty bit-sliced index, to be filled with set_filter().
+    Slots are unnamed, so the index cannot be written out.
+    \param bf_size bytes per filter, a power of two
+    \param hash_count bits set per element
+    \param count number of slots
+*/
+bit_sliced_index::bit_sliced_index(uint64_t bf_size, uint16_t hash_count, uint32_t count) {
+    this->bf_size = bf_size;
+    this->hash_count = hash_count;
+    bit_mask = bf_size*8 - 1;
+    layout = BF_LAYOUT_STANDARD;
+    sets = count;
+    row_words = (sets + 63) / 64;
+    rows = (uint64_t*)alloc_check(ALLOC_ZERO, 8*bf_size*row_words*sizeof(uint64_t), "bit_sliced_index", "rows", ERROR_EXIT);
+    slot_map.resize(sets);
+    for (uint32_t s = 0; s < sets; s++)
+        slot_map[s] = s;
+    folded.assign(sets, (bloom_filter*)NULL);
+}
+
+/**
+    Reads a bit-sliced index written by write_out().
+    \param fname file to read
+    \throws -1 if it cannot be read, -2 if the format is invalid
+*/
+bit_sliced_index::bit_sliced_index(const char *fname) {
+    FILE *in = fopen(fname, "rb");
+    if (in == NULL)
+        throw -1;
+    char magic[16];
+    unsigned long long size, mask;
+    unsigned int hashes, lay, count, version;
+    rows = NULL;
+    if (fscanf(in, "%15[^:]:%u:%llu:%u:%u:%llx:%u\n", magic, &version, &size, &hashes, &lay, &mask, &count) != 7 ||
+        strcmp(magic, MAGIC_BSI) || version != BSI_VERSION || count == 0) {
+        fclose(in);
+        throw -2;
+    }
+    bf_size = size;
+    bit_mask = mask;
+    hash_count = hashes;
+    layout = lay;
+    sets = count;
+    row_words = (sets + 63) / 64;
+    char name[FILENAME_MAX+1];
+    unsigned long long elems;
+    for (uint32_t s = 0; s < sets; s++) {
+        if (fscanf(in, "%llu:", &elems) != 1 || !fgets(name, sizeof(name), in)) {
+            fclose(in);
+            throw -2;
+        }
+        name[strcspn(name, "\n")] = 0;
+        set_names.push_back(name);
+        set_elems.push_back(elems);
+        slot_map.push_back(s);
+        folded.push_back(NULL);
+    }
+    uint64_t words = 8*bf_size*row_words;
+    rows = (uint64_t*)alloc_check(ALLOC_ONLY, words*sizeof(uint64_t), "bit_sliced_index", "rows", ERROR_EXIT);
+    if (fread(rows, sizeof(uint64_t), words, in) != words) {
+        free(rows);
+        fclose(in);
+        throw -2;
+    }
+    fclose(in);
+}
+
+bit_sliced_index::~bit_sliced_index() {
+    if (rows)
+        free(rows);
+}
+
+/**
+    Writes this index to a file: a text header line, one line per set
+    (element count of its index and its name), then the raw rows.
+    \param fname file to write
+    \returns 0 if successful, -1 if slots are unnamed, -2 if cannot write
+*/
+int
+bit_sliced_index::write_out(const char *fname) {
+    if (set_names.size() != sets)
+        return -1;
+    FILE *out = fopen(fname, "wb");
+    if (out == NULL)
+        return -2;
+    int status = 0;
+    fprintf(out, "%s:%d:%llu:%u:%u:%llx:%u\n", MAGIC_BSI, BSI_VERSION, (unsigned long long)bf_size,
+            hash_count, layout, (unsigned long long)bit_mask, sets);
+    for (uint32_t s = 0; s < sets; s++)
+        fprintf(out, "%llu:%s\n", (unsigned long long)set_elems[s], set_names[s].c_str());
+    uint64_t words = 8*bf_size*row_words;
+    if (fwrite(rows, sizeof(uint64_t), words, out) != words)
+        status = -2;
+    if (fclose(out))
+        status = -2;
+    return status;
+}
+
+/**
+    ORs a filter into one slot: bit p of the filter becomes bit slot of row p.
+    A larger filter is folded: its bit p goes to row p & bit_mask, which
+    is where a probe masked to this size looks for it.
+    \param slot slot to fill
+    \param filter filter bits, 8-byte aligned
+    \param size bytes of filter, a power of two at least bf_size, or 0 for bf_size
+*/
+void
+bit_sliced_index::set_filter(uint32_t slot, const uint8_t *filter, uint64_t size) {
+    const uint64_t *bits = (const uint64_t*)filter;
+    uint64_t set_bit = 1ULL << (slot & 63);
+    uint32_t set_word = slot >> 6;
+    if (size == 0)
+        size = bf_size;
+    for (uint64_t w = 0; w < size/8; w++) {
+        uint64_t v = bits[w];
+        while (v) {
+            uint64_t p = (w*64 + __builtin_ctzll(v)) & bit_mask;
+            rows[p*row_words + set_word] |= set_bit;
+            v &= v - 1;
+        }
+    }
+}
+
+/**
+    Looks up one feature in every set at once.
+    \param sha1 feature hash
+    \param matches per-set hit counts, indexed by position in set list
+    \returns number of sets which may contain the feature
+*/
+uint32_t
+bit_sliced_index::query(const uint32_t *sha1, std::vector<uint32_t> *matches) const {
+    uint64_t pos[BF_MAX_PROBES];
+    const uint64_t *row[BF_MAX_PROBES];
+    uint32_t k = bloom_filter::probe_positions(sha1, bit_mask, hash_count, layout, pos);
+    for (uint32_t i = 0; i < k; i++) {
+        row[i] = rows + pos[i]*row_words;
+        __builtin_prefetch(row[i]);
+    }
+    uint32_t hits = 0;
+    for (uint32_t w = 0; w < row_words; w++) {
+        uint64_t v = row[0][w];
+        for (uint32_t i = 1; i < k && v; i++)
+            v &= row[i][w];
+        while (v) {
+            uint32_t slot = w*64 + __builtin_ctzll(v);
+            v &= v - 1;
+            // a folded slot passes more than its index does
+            if (folded[slot] && !folded[slot]->query_sha1((uint32_t*)sha1))
+                continue;
+            matches->at(slot_map[slot])++;
+            hits++;
+        }
+    }
+    return hits;
+}
+
+uint32_t
+bit_sliced_index::set_count() const {
+    return sets;
+}
+
+const std::vector<std::string> &
+bit_sliced_index::names() const {
+    return set_names;
+}
+
+/**
+    Maps this index's slots onto the caller's set list by name, so a
+    persisted index can be used whatever order the sets were loaded in.
+    Also checks the indexes still match what was sliced, and takes those
+    that were folded, to confirm hits in.
+    \param order set names in the caller's order
+    \param indexes the sets' indexes, same order, kept by the caller
+    \returns false if the sets or their indexes differ
+*/
+bool
+bit_sliced_index::map_slots(const std::vector<std::string> &order, const std::vector<bloom_filter*> &indexes) {
+    if (order.size() != sets || indexes.size() != sets)
+        return false;
+    std::map<std::string,uint32_t> position;
+    for (uint32_t j = 0; j < order.size(); j++)
+        position[order[j]] = j;
+    std::vector<uint32_t> mapped(sets);
+    std::vector<bloom_filter*> larger(sets);
+    for (uint32_t s = 0; s < sets; s++) {
+        std::map<std::string,uint32_t>::iterator it = position.find(set_names[s]);
+        if (it == position.end())
+            return false;
+        bloom_filter *index = indexes[it->second];
+        if (index->elem_count() != set_elems[s] || index->size() < bf_size || index->partitions() > 1 ||
+            index->hash_functions() != hash_count || index->layout() != layout)
+            return false;
+        mapped[s] = it->second;
+        larger[s] = index->size() > bf_size ? index : NULL;
+    }
+    slot_map.swap(mapped);
+    folded.swap(larger);
+    return true;
+}
+
+/**
+    Checks that indexes share hash count and layout, and have not grown
+    extra partitions.  Sizes may differ, being powers of two: the larger
+    are folded.
+    \param indexes indexes to check
+    \returns true if they can be sliced together
+*/
+bool
+bit_sliced_index::compatible(const std::vector<bloom_filter*> &indexes) {
+    for (uint32_t i = 0; i < indexes.size(); i++) {
+        if (indexes[i]->partitions() > 1)
+            return false;
+    }
+    for (uint32_t i = 1; i < indexes.size(); i++) {
+        if (indexes[i]->hash_functions() != indexes[0]->hash_functions() ||
+            indexes[i]->layout() != indexes[0]->layout())
+            return false;
+    }
+    return true;
+}
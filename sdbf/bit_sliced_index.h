@@ -0,0 +1,73 @@
+// Header file for bit_sliced_index object
+//
+#ifndef _BIT_SLICED_INDEX_H
+#define _BIT_SLICED_INDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "bloom_filter.h"
+
+#define MAGIC_BSI   "sdbf-bsi"
+#define BSI_VERSION 1
+
+/**
+    bit_sliced_index: many bloom filter indexes stored transposed.  Row p
+    holds bit p of every index, one bit per set, so a feature lookup ANDs
+    hash_count rows and yields the bitmap of every set that may contain
+    it.  The cost is a handful of row reads however many sets are loaded,
+    instead of one filter query per set.  Indexes larger than the
+    smallest are folded down to its size, as index_tree unions are; a
+    hit in a folded slot is confirmed in the set's own index, so counts
+    are those of querying each index.
+    Slots need not be whole-set indexes: sdbf_set also slices the small
+    filters of its digests this way, to find which file matched.
+*/
+/// bit_sliced_index class
+class bit_sliced_index {
+
+public:
+    /// builds from indexes, which must share hash count and layout
+    bit_sliced_index(const std::vector<bloom_filter*> &indexes, const std::vector<std::string> &names);
+    /// empty index of count slots, for standard-layout filters of bf_size bytes
+    bit_sliced_index(uint64_t bf_size, uint16_t hash_count, uint32_t count);
+    /// reads a persisted index
+    bit_sliced_index(const char *fname);
+    /// destructor
+    ~bit_sliced_index();
+
+    /// write to file
+    int write_out(const char *fname);
+
+    /// copy a filter's bits into a slot, folding a larger filter down
+    void set_filter(uint32_t slot, const uint8_t *filter, uint64_t size=0);
+
+    /// count feature hits per set: matches[slot_map[s]]++ for each set s containing sha1
+    uint32_t query(const uint32_t *sha1, std::vector<uint32_t> *matches) const;
+
+    /// number of sets
+    uint32_t set_count() const;
+    /// names of sets, in slot order
+    const std::vector<std::string> &names() const;
+    /// map slots to positions in the caller's set list; false if sets have changed
+    bool map_slots(const std::vector<std::string> &order, const std::vector<bloom_filter*> &indexes);
+
+    /// true if all indexes hash alike, so they can be sliced together
+    static bool compatible(const std::vector<bloom_filter*> &indexes);
+
+private:
+    uint64_t bf_size;        // bytes per source filter
+    uint64_t bit_mask;
+    uint16_t hash_count;
+    uint32_t layout;
+    uint32_t sets;
+    uint32_t row_words;      // 64-bit words per row
+    uint64_t *rows;          // 8*bf_size rows of row_words
+    std::vector<std::string> set_names;
+    std::vector<uint64_t> set_elems;  // element count of each set's index
+    std::vector<uint32_t> slot_map;   // slot -> position in caller's set list
+    std::vector<bloom_filter*> folded; // slot -> its index if larger than bf_size, else NULL
+};
+
+#endif
@@ -3,6 +3,11 @@
 
 #include "bloom_filter.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -27,69 +32,211 @@ bloom_filter::BIT_MASKS_32[] = {
    Create new empty bloom filter
    \param size of bloom filter
    \param hash_count number of hashes for each insertion or query
-   \param max_elem max element size (0 ok)
+   \param max_elem max element size (0 ok).  If set, inserts beyond it go
+          to a new partition, max_elem*BF_GROWTH elements at max_fp*BF_TIGHTEN.
    \param max_fp max false positive rate (0 ok)
+   \param layout BF_LAYOUT_STANDARD, or BF_LAYOUT_BLOCKED for one cache line per query,
+          either with BF_LAYOUT_HASH64 for filters over 512MB or more than 5 hashes
+*/
+bloom_filter::bloom_filter( uint64_t size, uint16_t hash_count, uint64_t max_elem, double max_fp, uint32_t layout) {
+    init(size, hash_count, max_elem, max_fp, layout);
+}
+
+/**
+   Create new empty scalable bloom filter, sized for an expected number
+   of elements.  When a partition fills, a larger one with a lower false
+   positive rate is chained after it, so the overall rate stays under
+   max_fp however many elements are inserted.
+   \param expected_elem expected number of elements
+   \param max_fp overall false positive rate wanted
+   \param layout BF_LAYOUT_*
+   \param hash_count number of hashes for each insertion or query
+*/
+bloom_filter::bloom_filter( uint64_t expected_elem, double max_fp, uint32_t layout, uint16_t hash_count) {
+    if (expected_elem == 0 || max_fp <= 0 || max_fp >= 1)
+        throw -1;
+    // rates of successive partitions form a geometric series summing to max_fp
+    double first_fp = max_fp*(1 - BF_TIGHTEN);
+    init(size_for(expected_elem, first_fp, hash_count, layout), hash_count, expected_elem, first_fp, layout);
+}
+
+/**
+   \internal
+   Empty partition, filled in by read_record()
+*/
+bloom_filter::bloom_filter() {
+    bf = NULL;
+    bf_size = 0;
+    bf_elem_count = 0;
+    max_elem = 0;
+    max_fp = 0;
+    created = true;
+    mapped = false;
+    stored_raw = false;
+    next = NULL;
+}
+
+/**
+   \internal
+   Sets up an empty filter; see the constructors.
 */
-bloom_filter::bloom_filter( uint64_t size, uint16_t hash_count, uint64_t max_elem, double max_fp) {
+void
+bloom_filter::init( uint64_t size, uint16_t hash_count, uint64_t max_elem, double max_fp, uint32_t layout) {
     this->bf_size = size;
     this->hash_count = hash_count;
+    this->bf_layout = layout;
+    if (!valid_shape(size, hash_count, layout))
+        throw -1; // sizes invalid, or more positions than the hash can give
     this->max_elem = max_elem;
     this->max_fp = max_fp;
-    
-    // Make sure size if a power of 2 and at least 64
-    if( size && !(size & (size - 1)) && size >= 64) {
-        // Find log2(size)
-        uint16_t log_size = 0;
-        for( uint64_t tmp=size; tmp; tmp >>= 1, log_size++);
-        bit_mask = BIT_MASKS_32[log_size+1];
-    } else {
-        throw -1; // sizes invalid
-    } 
+    bit_mask = 8*size - 1;
     bf = (uint8_t*)malloc(size);
     memset( bf, 0, size);
     bf_elem_count = 0;
     created=true;
+    mapped=false;
+    stored_raw=false;
+    next=NULL;
+}
+
+/**
+   Computes the size of a filter holding a number of elements at a given
+   false positive rate, from p = (1-e^(-kn/m))^k, rounded up to a power
+   of two.  The blocked layout does slightly worse than this.
+   \param elems number of elements
+   \param fp false positive rate
+   \param hash_count number of hash functions
+   \param layout BF_LAYOUT_*, which limits the size
+   \returns size in bytes, at least 64 and at most BF_MAX_SIZE (BF_MAX_SIZE_32
+            without BF_LAYOUT_HASH64)
+*/
+uint64_t
+bloom_filter::size_for(uint64_t elems, double fp, uint16_t hash_count, uint32_t layout) {
+    double bits = -(double)hash_count*elems / log(1.0 - pow(fp, 1.0/hash_count));
+    uint64_t most = (layout & BF_LAYOUT_HASH64) ? BF_MAX_SIZE : BF_MAX_SIZE_32;
+    uint64_t size = 64;
+    while (size*8 < bits && size < most)
+        size <<= 1;
+    return size;
+}
+
+/**
+   Checks the shape of a filter: a power of two bytes, at least 64, and
+   no more than 32-bit positions can address unless BF_LAYOUT_HASH64;
+   and no more hashes than the layout can derive from a SHA1.
+   \param size size in bytes
+   \param hash_count number of hash functions
+   \param layout BF_LAYOUT_*
+   \returns true if valid
+*/
+bool
+bloom_filter::valid_shape(uint64_t size, uint16_t hash_count, uint32_t layout) {
+    bool hash64 = (layout & BF_LAYOUT_HASH64) != 0;
+    if (size < 64 || (size & (size - 1)) || size > (hash64 ? BF_MAX_SIZE : BF_MAX_SIZE_32))
+        return false;
+    return hash_count > 0 && hash_count <= (hash64 ? BF_MAX_PROBES : BF_MAX_PROBES_32);
 }
 
 /** 
-    Read bloom filter from a file
+    Read bloom filter from a file.  Compressed filters are inflated into
+    memory; raw ones (compressed size 0) are mapped from the file, so they
+    are paged in as used and shared with other processes reading them.
+    A scalable filter is stored as one record per partition.
     \param indexfilename file to read
 */
 bloom_filter::bloom_filter(string indexfilename){
+    max_elem=0;
+    max_fp=0;
+    mapped=false;
+    stored_raw=false;
+    created=true;
+    next=NULL;
+    bf=NULL;
     ifstream ifs(indexfilename.c_str(),ifstream::in|ios::binary);
-    if (ifs.is_open()) {
-        string process;
-        // headerbit
-        getline(ifs,process,':'); // ignore
-        // bf_size
-        getline(ifs,process,':');
-        bf_size=boost::lexical_cast<uint64_t>(process);
-        // elem_count
-        getline(ifs,process,':');
-        bf_elem_count=boost::lexical_cast<uint64_t>(process);
-        // hash_count
-        getline(ifs,process,':');
-        hash_count=boost::lexical_cast<uint16_t>(process);
-        // bit_mask
+    if (!ifs.is_open()) 
+       throw -1; // failed to read
+    read_record(ifs, indexfilename);
+    bloom_filter *tail=this;
+    while (ifs.peek() != EOF) {
+        bloom_filter *part=new bloom_filter();
+        tail->next=part;
+        tail=part;
+        try {
+            part->read_record(ifs, indexfilename);
+        } catch (int e) {
+            delete next;
+            release();
+            throw;
+        }
+    }
+}
+
+/**
+   \internal
+   Reads one partition of an index file.
+   \param ifs file, positioned at a header line
+   \param indexfilename its name, for mapping raw bits
+   \throws -2 if the record is invalid
+*/
+void
+bloom_filter::read_record(ifstream &ifs, string indexfilename) {
+    string process;
+    // headerbit
+    getline(ifs,process,':'); // ignore
+    // bf_size, or v2 marker followed by layout, or v3 marker followed by
+    // layout and hashing
+    getline(ifs,process,':');
+    bf_layout=BF_LAYOUT_STANDARD;
+    if (process == "v2" || process == "v3") {
+        bool v3 = (process == "v3");
         getline(ifs,process,':');
-        bit_mask=boost::lexical_cast<uint64_t>(process);
-        // compressed_size
+        if (process == "blocked")
+            bf_layout=BF_LAYOUT_BLOCKED;
+        else if (process != "standard")
+            throw -2; // unknown layout
+        if (v3) {
+            getline(ifs,process,':');
+            if (process == "hash64")
+                bf_layout|=BF_LAYOUT_HASH64;
+            else if (process != "hash32")
+                throw -2; // unknown hashing
+        }
         getline(ifs,process,':');
-        uint64_t comp_size=boost::lexical_cast<uint64_t>(process);
-        // setname
-        getline(ifs,setname);
-        // endl
-        // compressed data, size from header
-        char* bf_comp =(char*)malloc(comp_size+1);
-        bf = (uint8_t*) malloc(bf_size);
-        ifs.read((char*)bf_comp,comp_size);
-        // decompress.      
-        int32_t result=this->decompress(bf_comp);
-        free(bf_comp);
-    } else 
-       throw -1; // failed to read
-    created=true;
-    //created=false;
+    }
+    bf_size=boost::lexical_cast<uint64_t>(process);
+    // elem_count
+    getline(ifs,process,':');
+    bf_elem_count=boost::lexical_cast<uint64_t>(process);
+    // hash_count
+    getline(ifs,process,':');
+    hash_count=boost::lexical_cast<uint16_t>(process);
+    // bit_mask
+    getline(ifs,process,':');
+    bit_mask=boost::lexical_cast<uint64_t>(process);
+    if (!valid_shape(bf_size, hash_count, bf_layout) || bit_mask != 8*bf_size-1)
+        throw -2;
+    // compressed_size
+    getline(ifs,process,':');
+    uint64_t comp_size=boost::lexical_cast<uint64_t>(process);
+    // setname
+    getline(ifs,setname);
+    // endl
+    stored_raw=(comp_size == 0);
+    if (comp_size == 0) {
+        // raw bits start on the page after the header
+        uint64_t offset=((uint64_t)ifs.tellg()+BF_PAGE_SIZE-1) & ~(uint64_t)(BF_PAGE_SIZE-1);
+        if (map_raw(indexfilename, offset))
+            throw -2; // truncated
+        ifs.seekg(offset+bf_size);
+        return;
+    }
+    // compressed data, size from header
+    char* bf_comp =(char*)malloc(comp_size+1);
+    bf = (uint8_t*) malloc(bf_size);
+    ifs.read((char*)bf_comp,comp_size);
+    // decompress.      
+    int32_t result=this->decompress(bf_comp);
+    free(bf_comp);
 }
 
 /**
@@ -106,38 +253,200 @@ bloom_filter::bloom_filter(uint8_t* data, uint64_t size) {
     bit_mask=2047;
     bf_size=size;
     hash_count=5;
+    bf_layout=BF_LAYOUT_STANDARD;
     bf_elem_count=192; // could also be 160
     bf=(uint8_t*)malloc(256);
     memcpy(bf,data,256);
     // marker for non-destructive destroy?
     created=true;
+    mapped=false;
+    stored_raw=false;
+    next=NULL;
+    max_elem=0;
+    max_fp=0;
 }
 
 /** 
     Destroys bloom filter and frees buffer 
 */
 bloom_filter::~bloom_filter() {
-    if (created)
+    release();
+    delete next;
+}
+
+/**
+   \internal
+   Frees or unmaps the filter bits.
+*/
+void
+bloom_filter::release() {
+    if (mapped)
+        munmap(bf, bf_size);
+    else if (created)
         free(bf);
 }
 
+/**
+   \internal
+   Maps the raw bits of an index file.  The mapping is private, so the
+   pages stay shared with the page cache until this filter is written
+   to (folded, added to), when the kernel copies just those pages.
+   Falls back to reading the bits if the file cannot be mapped.
+   \param filename index file
+   \param offset start of the bits, page-aligned
+   \returns 0 if successful, -1 if file is short or unreadable
+*/
+int
+bloom_filter::map_raw(string filename, uint64_t offset) {
+    int fd=open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) || (uint64_t)st.st_size < offset+bf_size) {
+        close(fd);
+        return -1;
+    }
+    void *map=mmap(NULL, bf_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, offset);
+    if (map != MAP_FAILED) {
+        // probes are random; read-ahead would only waste memory
+        madvise(map, bf_size, MADV_RANDOM);
+        bf=(uint8_t*)map;
+        mapped=true;
+    } else {
+        bf=(uint8_t*)malloc(bf_size);
+        if (pread(fd, bf, bf_size, offset) != (ssize_t)bf_size) {
+            free(bf);
+            // the destructor frees bf again
+            bf=NULL;
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
 /** 
-    Returns number of elements present in bloom filter
+    Returns number of elements present in bloom filter, all partitions
     \returns number of elements 
 */
-uint64_t bloom_filter::elem_count() { return bf_elem_count;}
+uint64_t bloom_filter::elem_count() { 
+    uint64_t count=0;
+    for (bloom_filter *p=this; p; p=p->next)
+        count+=p->bf_elem_count;
+    return count;
+}
 
 /** 
-    Returns estimated false positive rate (not implemented)
+    Returns estimated false positive rate for the current element count,
+    over all partitions: a query is a false positive if any partition
+    gives one.
     \returns estimate
 */
-double  bloom_filter::est_fp_rate() { return -1.0;}
+double
+bloom_filter::est_fp_rate() {
+    double miss=1.0;
+    for (bloom_filter *p=this; p; p=p->next)
+        miss*=1.0-p->partition_fp_rate();
+    return 1.0-miss;
+}
+
+/**
+    Returns the fraction of this partition's bits that are set.
+    \returns fill ratio, 0 to 1
+*/
+double
+bloom_filter::fill() const {
+    const uint64_t *words=(const uint64_t *)bf;
+    uint64_t set=0;
+    for (uint64_t i=0; i<bf_size/8; i++)
+        set+=__builtin_popcountll(words[i]);
+    return (double)set/(8.0*bf_size);
+}
+
+/**
+    \internal
+    Estimated false positive rate of this partition alone.
+    Standard layout: (1-e^(-kn/m))^k.  Blocked layout: the same formula
+    within one block, averaged over the (Poisson) number of elements
+    that landed in the block.
+    \returns estimate
+*/
+double
+bloom_filter::partition_fp_rate() const {
+    double k = hash_count;
+    if (!(bf_layout & BF_LAYOUT_BLOCKED))
+        return pow(1.0 - exp(-k*bf_elem_count/(8.0*bf_size)), k);
+    double block_bits = 8*BF_BLOCK_SIZE;
+    double lambda = (double)bf_elem_count*BF_BLOCK_SIZE/bf_size;
+    uint64_t last = (uint64_t)(lambda + 10*sqrt(lambda) + 20);
+    double pois = exp(-lambda);   // P(block holds i elements)
+    double fp = 0;
+    for (uint64_t i = 0; i <= last; i++) {
+        if (i > 0)
+            pois *= lambda / i;
+        fp += pois * pow(1.0 - pow(1.0 - 1.0/block_bits, k*i), k);
+    }
+    return fp;
+}
 
 /** 
     Returns bits per element in bloom filter
     \returns estimate
 */
-double bloom_filter::bits_per_elem() { return (double) (bf_size << 3)/bf_elem_count;}
+double bloom_filter::bits_per_elem() { 
+    uint64_t bits=0;
+    for (bloom_filter *p=this; p; p=p->next)
+        bits+=p->bf_size << 3;
+    return (double)bits/elem_count();
+}
+
+/**
+    Returns the number of partitions in this filter
+    \returns 1 unless the filter has grown
+*/
+uint32_t
+bloom_filter::partitions() const {
+    uint32_t count=0;
+    for (const bloom_filter *p=this; p; p=p->next)
+        count++;
+    return count;
+}
+
+/**
+    Returns one partition of this filter
+    \param i partition number, 0 is this one
+    \returns partition, or NULL
+*/
+bloom_filter *
+bloom_filter::partition(uint32_t i) {
+    bloom_filter *p=this;
+    for (; p && i; i--)
+        p=p->next;
+    return p;
+}
+
+/**
+   \internal
+   Returns the partition to insert into, chaining a new one if the last
+   is full.  Threads racing to grow the filter agree through a
+   compare-and-swap on the link; the loser frees its partition.
+*/
+bloom_filter *
+bloom_filter::insert_partition() {
+    bloom_filter *tail=this;
+    while (tail->next)
+        tail=tail->next;
+    if (!tail->max_elem || tail->bf_elem_count < tail->max_elem)
+        return tail;
+    uint64_t elems=tail->max_elem*BF_GROWTH;
+    double fp=tail->max_fp*BF_TIGHTEN;
+    bloom_filter *part=new bloom_filter(size_for(elems, fp, hash_count, bf_layout), hash_count, elems, fp, bf_layout);
+    part->setname=setname;
+    if (!__sync_bool_compare_and_swap(&tail->next, (bloom_filter *)NULL, part))
+        delete part;
+    return tail->next;
+}
 
 /**
    \internal
@@ -145,8 +454,9 @@ double bloom_filter::bits_per_elem() { return (double) (bf_size << 3)/bf_elem_co
 */
 char *
 bloom_filter::compress() {
-    char *dest=(char*)malloc(40*MB);
-    int res = LZ4_compress_limitedOutput((const char*)bf,dest,bf_size,40*MB);
+    int bound=LZ4_compressBound(bf_size);
+    char *dest=(char*)malloc(bound);
+    int res = LZ4_compress_limitedOutput((const char*)bf,dest,bf_size,bound);
     if (res == 0) {
     comp_size = 0;
     free(dest);
@@ -171,28 +481,69 @@ bloom_filter::decompress(char *src) {
 }
 
 /**
-   Writes bloom filter out to a file.
+   Writes bloom filter out to a file, one record per partition.
    \param filename file to be written 
+   \param raw write the bits uncompressed, page-aligned after the header,
+          so that readers can map them instead of inflating them; partitions
+          over BF_COMPRESS_MAX are always written so
    \returns status -1 if compression fails, -2 if cannot open file
 */
 int32_t
-bloom_filter::write_out(string filename) {
-    char *compressed=this->compress();
-    if (compressed==NULL) 
-        return -1;
+bloom_filter::write_out(string filename, bool raw) {
     std::filebuf fb;
     fb.open (filename.c_str(),ios::out|ios::binary);
-    if (fb.is_open()) {
-        std::ostream os(&fb);
-        os << "sdbf-idx:" << bf_size << ":" << bf_elem_count << ":"<< hash_count;
-        os << ":" << bit_mask << ":" << comp_size << ":";
-        os << setname;
-        os << endl;
-        os.write(compressed,comp_size);
-        fb.close();
-    } else {
-        free(compressed);
+    if (!fb.is_open())
         return -2;
+    std::ostream os(&fb);
+    uint64_t pos=0;
+    int32_t status=0;
+    for (bloom_filter *p=this; p && !status; p=p->next)
+        status=p->write_record(os, pos, raw);
+    fb.close();
+    return status;
+}
+
+/**
+   \internal
+   Writes one partition's header line and bits.
+   \param os output stream
+   \param pos bytes written to os so far, updated
+   \param raw write the bits uncompressed and page-aligned
+   \returns status -1 if compression fails
+*/
+int32_t
+bloom_filter::write_record(std::ostream &os, uint64_t &pos, bool raw) {
+    char *compressed=NULL;
+    raw = raw || bf_size > BF_COMPRESS_MAX;
+    if (raw) {
+        comp_size=0;
+    } else {
+        compressed=this->compress();
+        if (compressed==NULL) 
+            return -1;
+    }
+    std::ostringstream header;
+    header << "sdbf-idx:";
+    // 32-bit filters keep the headers older readers know
+    if (bf_layout & BF_LAYOUT_HASH64)
+        header << "v3:" << ((bf_layout & BF_LAYOUT_BLOCKED) ? "blocked" : "standard") << ":hash64:";
+    else if (bf_layout == BF_LAYOUT_BLOCKED)
+        header << "v2:blocked:";
+    header << bf_size << ":" << bf_elem_count << ":"<< hash_count;
+    header << ":" << bit_mask << ":" << comp_size << ":";
+    header << setname;
+    header << endl;
+    os << header.str();
+    pos+=header.str().size();
+    if (raw) {
+        uint64_t pad=BF_PAGE_SIZE - pos % BF_PAGE_SIZE;
+        if (pad < BF_PAGE_SIZE)
+            os << string(pad, '\0');
+        os.write((const char*)bf,bf_size);
+        pos+=pad % BF_PAGE_SIZE + bf_size;
+    } else {
+        os.write(compressed,comp_size);
+        pos+=comp_size;
     }
     free(compressed);
     return 0;
@@ -213,7 +564,8 @@ bloom_filter::name() const{
 */
 void
 bloom_filter::set_name(string name) {
-     setname = name;
+    for (bloom_filter *p=this; p; p=p->next)
+        p->setname = name;
 }
 
 /**
@@ -235,37 +587,120 @@ bloom_filter::fold(uint32_t times){
     if (rsize == 64) 
            break; // also error?
     }
-    bf_size=rsize*8;
-    // recalculate mask
-        // Find log2(size)
-    uint16_t log_size = 0;
-    for( uint64_t tmp=bf_size; tmp; tmp >>= 1, log_size++);
-    bit_mask = BIT_MASKS_32[log_size+1];
-    uint8_t *oldbf=bf;
-    bf = (uint8_t*)malloc(bf_size);
-    memset(bf, 0, bf_size);
+    uint8_t *newbf = (uint8_t*)malloc(rsize*8);
     // copy in
-    memcpy(bf,oldbf,bf_size);
+    memcpy(newbf,bf,rsize*8);
     // delete
-    free(oldbf);
+    release();
+    bf=newbf;
+    mapped=false;
+    created=true;
+    bf_size=rsize*8;
+    // recalculate mask
+    bit_mask = 8*bf_size - 1;
 }
 
 /**
-   Adds another bloom filter to this one
-   \param other bloom filter
-   \return 0 if successful 1 if not the same size
+   Adds another bloom filter to this one.  A larger filter is folded down
+   to this size as it is added, and every partition of a scalable one is
+   added, so the result answers yes for anything the other filter holds.
+   Element counts are summed, which overcounts elements present in both;
+   recount() corrects that.
+   \param other bloom filter, at least this size and probing at least as
+          many bits per element
+   \return 0 if successful 1 if smaller or differently laid out, or if
+           this filter is partitioned
 */
 int
 bloom_filter::add(bloom_filter *other) {
     uint64_t *bf_64 = (uint64_t *)bf;
-    uint64_t *bf2_64 = (uint64_t *)other->bf;
-    if (other->bf_size != bf_size) 
-    return 1; // must add two of same size
-    for (int j=0;j < bf_size/8;j++)
-    bf_64[j]|=bf2_64[j];
+    uint64_t words = bf_size/8;
+    if (next)
+        return 1;
+    for (bloom_filter *p=other; p; p=p->next) {
+        if (p->bf_size < bf_size || p->bf_layout != bf_layout || p->hash_count < hash_count) 
+            return 1;
+    }
+    for (bloom_filter *p=other; p; p=p->next) {
+        uint64_t *bf2_64 = (uint64_t *)p->bf;
+        // sizes are powers of two, so this is folding p down to bf_size
+        for (uint64_t j=0;j < p->bf_size/8;j++)
+            bf_64[j & (words-1)]|=bf2_64[j];
+        bf_elem_count+=p->bf_elem_count;
+    }
+    return 0;
+}
+
+/**
+   Merges another bloom filter into this one without losing accuracy.
+   Each partition of the other is ORed into a partition of this filter
+   of the same size that can hold both sets of elements at max_fp, or
+   else copied onto the end of this filter as a new partition.  A query
+   answers yes for anything either filter holds, and no partition goes
+   over max_fp, unlike add(), which folds everything into one size.
+   \param other bloom filter hashing as this one does; not changed
+   \param max_fp false positive rate a partition may be filled to
+   \return 0 if successful, 1 if hash count or layout differ
+*/
+int
+bloom_filter::merge(bloom_filter *other, double max_fp) {
+    for (bloom_filter *q=other; q; q=q->next) {
+        if (q->bf_layout != bf_layout || q->hash_count != hash_count)
+            return 1;
+    }
+    for (bloom_filter *q=other; q; q=q->next) {
+        bloom_filter *tail=this, *into=NULL;
+        for (bloom_filter *p=this; p; p=p->next) {
+            tail=p;
+            if (!into && p->bf_size == q->bf_size &&
+                size_for(p->bf_elem_count+q->bf_elem_count, max_fp, hash_count, bf_layout) <= p->bf_size)
+                into=p;
+        }
+        if (into == NULL) {
+            into=new bloom_filter(q->bf_size, hash_count, 0, 0, bf_layout);
+            into->setname=setname;
+            tail->next=into;
+        }
+        uint64_t *bf_64=(uint64_t *)into->bf;
+        const uint64_t *bf2_64=(const uint64_t *)q->bf;
+        for (uint64_t j=0; j < q->bf_size/8; j++)
+            bf_64[j]|=bf2_64[j];
+        into->bf_elem_count+=q->bf_elem_count;
+    }
     return 0;
 }
 
+/**
+   Re-estimates the element count of each partition from the bits it
+   has set, as -(m/k)ln(1-x/m) for x of m bits set, taken per block for
+   the blocked layout.  For a filter merged with add() from filters that
+   share elements, whose summed count is too high.  The estimate counts
+   distinct elements, where inserting counts those that set a new bit,
+   so the two can differ by about the false positive rate; a count is
+   only ever lowered.
+*/
+void
+bloom_filter::recount() {
+    for (bloom_filter *p=this; p; p=p->next) {
+        const uint64_t *words=(const uint64_t *)p->bf;
+        // the standard layout is one block of the whole filter
+        uint64_t block_words=(p->bf_layout & BF_LAYOUT_BLOCKED) ? BF_BLOCK_SIZE/8 : p->bf_size/8;
+        double bits=64.0*block_words;
+        double estimate=0;
+        for (uint64_t b=0; b < p->bf_size/8; b+=block_words) {
+            uint64_t set=0;
+            for (uint64_t i=b; i < b+block_words; i++)
+                set+=__builtin_popcountll(words[i]);
+            // a full block gives no estimate; take it as one bit short
+            if (set >= bits)
+                set=bits-1;
+            estimate-=bits/p->hash_count*log(1.0-set/bits);
+        }
+        if ((uint64_t)(estimate+0.5) < p->bf_elem_count)
+            p->bf_elem_count=(uint64_t)(estimate+0.5);
+    }
+}
+
 /** 
    Inserts hash data into this bloom filter
    \param sha1 buffer of sha1 hash values
@@ -273,7 +708,12 @@ bloom_filter::add(bloom_filter *other) {
 */
 bool 
 bloom_filter::insert_sha1(uint32_t *sha1) {
-    return query_and_set(sha1, true);
+    bloom_filter *tail=insert_partition();
+    // present in an earlier partition already
+    for (bloom_filter *p=this; p!=tail; p=p->next)
+        if (p->query_and_set(sha1, false))
+            return false;
+    return tail->query_and_set(sha1, true);
 }
     
 /** 
@@ -283,7 +723,10 @@ bloom_filter::insert_sha1(uint32_t *sha1) {
 */
 bool
 bloom_filter::query_sha1(uint32_t *sha1) {
-    return query_and_set(sha1, false);
+    for (bloom_filter *p=this; p; p=p->next)
+        if (p->query_and_set(sha1, false))
+            return true;
+    return false;
 }
 
 /**
@@ -295,28 +738,259 @@ bloom_filter::query_sha1(uint32_t *sha1) {
 */
 bool
 bloom_filter::query_and_set(uint32_t *sha1, bool mode_set) {
-    
-    uint32_t pos, i, k, bit_cnt=0;
-    for( i=0; i<hash_count; i++) {
-        pos = sha1[i] & bit_mask;
-        k = pos >> 3;
-        // Bit is set
-        if( (bf[k] & BITS[pos & 0x7])) {
-            bit_cnt++;
-        // Bit is not set
-        } else {
-            if( mode_set)
-                bf[k] |= BITS[pos & 0x7];
-            else
-                return false;
-        }        
+    uint64_t probes[BF_MAX_PROBES];
+    probe_positions(sha1, probes);
+    if (!mode_set)
+        return test_at(probes);
+    if (!set_at(probes))
+        return false;
+    __sync_fetch_and_add(&bf_elem_count, 1);
+    return true;
+}
+
+/**
+   \internal
+   Sets the bits of a hash, given its probe positions.  Bits are set with
+   atomic ORs on 64-bit words, so threads may insert into the same filter
+   at once without losing bits.  Bit p of a word is bit p&7 of byte p>>3
+   on little-endian machines, matching the byte-wise layout.  The element
+   count is left to the caller.
+   \param probes hash_count bit positions
+   \returns true if any bit was newly set
+*/
+bool
+bloom_filter::set_at(const uint64_t *probes) {
+    uint64_t *words = (uint64_t *)bf;
+    bool added = false;
+    for (uint32_t i=0; i<hash_count; i++) {
+        uint64_t bit = 1ULL << (probes[i] & 63);
+        if (!(__sync_fetch_and_or(&words[probes[i] >> 6], bit) & bit))
+            added = true;
     }
-    if(mode_set) {
-        if(bit_cnt < hash_count) {
-            bf_elem_count++;
-            return true;
-        } else
+    return added;
+}
+
+/**
+   \internal
+   Tests the bits of a hash, given its probe positions.
+   \param probes hash_count bit positions
+   \returns true if all are set
+*/
+bool
+bloom_filter::test_at(const uint64_t *probes) const {
+    for (uint32_t i=0; i<hash_count; i++) {
+        if (!(bf[probes[i] >> 3] & BITS[probes[i] & 0x7]))
             return false;
-    } else
-        return bit_cnt == hash_count;
+    }
+    return true;
+}
+
+/**
+   \internal
+   Computes probe positions for a batch of hashes and prefetches the
+   bytes they touch, so the cache misses of a whole batch overlap
+   instead of being taken one hash at a time.
+   \param sha1 hashes
+   \param count number of hashes, at most BF_BATCH
+   \param probes filled with the positions of each hash
+   \param for_write prefetch for writing
+*/
+void
+bloom_filter::prefetch_batch(const uint32_t (*sha1)[5], uint32_t count, uint64_t (*probes)[BF_MAX_PROBES], bool for_write) {
+    // the blocked layout keeps all of a hash's probes in one line
+    uint32_t lines = (bf_layout & BF_LAYOUT_BLOCKED) ? 1 : hash_count;
+    for (uint32_t j=0; j<count; j++) {
+        probe_positions(sha1[j], probes[j]);
+        for (uint32_t i=0; i<lines; i++) {
+            if (for_write)
+                __builtin_prefetch(bf + (probes[j][i] >> 3), 1);
+            else
+                __builtin_prefetch(bf + (probes[j][i] >> 3), 0);
+        }
+    }
+}
+
+/**
+   Inserts a batch of hashes.  Same result as calling insert_sha1 on
+   each in turn, but the memory accesses of BF_BATCH hashes at a time
+   are issued together.  Safe to call from several threads at once; new
+   elements are counted per call and added to the total once.
+   \param sha1 hashes
+   \param count number of hashes
+   \param inserted bitmap of (count+63)/64 words, bit j set if hash j was new
+   \returns number of new hashes
+*/
+uint32_t
+bloom_filter::insert_batch(const uint32_t (*sha1)[5], uint32_t count, uint64_t *inserted) {
+    uint32_t total=0;
+    memset(inserted, 0, ((count+63)/64)*sizeof(uint64_t));
+    for (uint32_t start=0; start<count; start+=BF_BATCH) {
+        uint32_t n = (count-start < BF_BATCH) ? count-start : BF_BATCH;
+        bloom_filter *tail=insert_partition();
+        uint64_t skip=0;
+        for (bloom_filter *p=this; p!=tail; p=p->next)
+            skip|=p->query_group(sha1+start, n);
+        uint64_t added=tail->insert_group(sha1+start, n, skip);
+        inserted[start >> 6] |= added << (start & 63);
+        total+=__builtin_popcountll(added);
+    }
+    return total;
+}
+
+/**
+   \internal
+   Inserts up to BF_BATCH hashes into this partition.
+   \param sha1 hashes
+   \param count number of hashes
+   \param skip bit j set if hash j is not to be inserted
+   \returns bit j set if hash j was new
+*/
+uint64_t
+bloom_filter::insert_group(const uint32_t (*sha1)[5], uint32_t count, uint64_t skip) {
+    uint64_t probes[BF_BATCH][BF_MAX_PROBES];
+    uint64_t added=0;
+    prefetch_batch(sha1, count, probes, true);
+    for (uint32_t j=0; j<count; j++) {
+        if (!(skip & (1ULL << j)) && set_at(probes[j]))
+            added |= 1ULL << j;
+    }
+    if (added)
+        __sync_fetch_and_add(&bf_elem_count, __builtin_popcountll(added));
+    return added;
+}
+
+/**
+   \internal
+   Queries up to BF_BATCH hashes in this partition.
+   \param sha1 hashes
+   \param count number of hashes
+   \returns bit j set if hash j is present
+*/
+uint64_t
+bloom_filter::query_group(const uint32_t (*sha1)[5], uint32_t count) {
+    uint64_t probes[BF_BATCH][BF_MAX_PROBES];
+    uint64_t found=0;
+    prefetch_batch(sha1, count, probes, false);
+    for (uint32_t j=0; j<count; j++) {
+        if (test_at(probes[j]))
+            found |= 1ULL << j;
+    }
+    return found;
+}
+
+/**
+   Queries a batch of hashes, as insert_batch but for lookups.
+   \param sha1 hashes
+   \param count number of hashes
+   \param found bitmap of (count+63)/64 words, bit j set if hash j is present
+   \returns number of hashes present
+*/
+uint32_t
+bloom_filter::query_batch(const uint32_t (*sha1)[5], uint32_t count, uint64_t *found) {
+    uint32_t total=0;
+    memset(found, 0, ((count+63)/64)*sizeof(uint64_t));
+    for (uint32_t start=0; start<count; start+=BF_BATCH) {
+        uint32_t n = (count-start < BF_BATCH) ? count-start : BF_BATCH;
+        uint64_t hits=0;
+        for (bloom_filter *p=this; p; p=p->next)
+            hits|=p->query_group(sha1+start, n);
+        found[start >> 6] |= hits << (start & 63);
+        total+=__builtin_popcountll(hits);
+    }
+    return total;
+}
+
+/**
+   Returns the bit layout of this bloom filter
+   \returns BF_LAYOUT_STANDARD or BF_LAYOUT_BLOCKED, with BF_LAYOUT_HASH64
+            if probes are 64-bit
+*/
+uint32_t
+bloom_filter::layout() const {
+    return bf_layout;
+}
+
+/**
+   Tells whether this bloom filter was read from an index file written
+   raw, so that a rewrite can keep its format.
+   \returns true if read from a raw index file
+*/
+bool
+bloom_filter::raw() const {
+    return stored_raw;
+}
+
+uint64_t
+bloom_filter::size() const {
+    return bf_size;
+}
+
+uint16_t
+bloom_filter::hash_functions() const {
+    return hash_count;
+}
+
+uint64_t
+bloom_filter::mask() const {
+    return bit_mask;
+}
+
+const uint8_t *
+bloom_filter::data() const {
+    return bf;
+}
+
+/**
+   Computes the bit positions an insert or query of a SHA1 hash touches.
+   Standard layout uses one 32-bit word of the hash per position.  Blocked
+   layout uses the first word to choose a 64-byte block and 9-bit slices
+   of the other words for positions within it.  With BF_LAYOUT_HASH64,
+   positions are h1 + i*h2 over 64-bit values drawn from the whole hash
+   (Kirsch and Mitzenmacher), h2 odd so they are distinct in any power of
+   two; blocked, h1 picks the block and a 32-bit pair places bits in it.
+   Either way position i does not depend on hash_count, and masking the
+   same value for every size keeps folding valid.
+   \param sha1 buffer of sha1 hash values
+   \param pos filled with hash_count bit positions
+   \returns number of positions (hash_count)
+*/
+uint32_t
+bloom_filter::probe_positions(const uint32_t *sha1, uint64_t *pos) const {
+    return probe_positions(sha1, bit_mask, hash_count, bf_layout, pos);
+}
+
+/**
+   Computes probe positions for a filter of the given shape.  Lets
+   structures that mirror many same-shaped filters share one computation.
+   \param sha1 buffer of sha1 hash values
+   \param bit_mask bit mask of filter
+   \param hash_count number of hash functions
+   \param layout BF_LAYOUT_*
+   \param pos filled with hash_count bit positions
+   \returns number of positions (hash_count)
+*/
+uint32_t
+bloom_filter::probe_positions(const uint32_t *sha1, uint64_t bit_mask, uint16_t hash_count, uint32_t layout, uint64_t *pos) {
+    uint32_t i;
+    if (layout & BF_LAYOUT_HASH64) {
+        uint64_t h1 = ((uint64_t)sha1[1] << 32) | sha1[0];
+        if (layout & BF_LAYOUT_BLOCKED) {
+            uint64_t block = (h1 & (bit_mask >> 9)) << 9;
+            uint32_t g1 = sha1[2] ^ sha1[4], g2 = sha1[3] | 1;
+            for( i=0; i<hash_count; i++)
+                pos[i] = block | ((g1 + i*g2) & 0x1FF);
+        } else {
+            uint64_t h2 = ((((uint64_t)sha1[3] << 32) | sha1[2]) ^ sha1[4]) | 1;
+            for( i=0; i<hash_count; i++)
+                pos[i] = (h1 + i*h2) & bit_mask;
+        }
+    } else if (layout == BF_LAYOUT_BLOCKED) {
+        uint64_t block = (sha1[0] & (bit_mask >> 9)) << 9;
+        for( i=0; i<hash_count; i++)
+            pos[i] = block | ((sha1[1 + (i & 3)] >> (9*(i >> 2))) & 0x1FF);
+    } else {
+        for( i=0; i<hash_count; i++)
+            pos[i] = sha1[i] & bit_mask;
+    }
+    return hash_count;
 }
@@ -5,11 +5,39 @@
 
 
 #include <stdint.h>
+#include <fstream>
 #include <string>
 //#include <strings.h>
 
 using namespace std;
 
+// bit layouts
+#define BF_LAYOUT_STANDARD 0   // each hash sets a bit anywhere in the filter
+#define BF_LAYOUT_BLOCKED  1   // first hash picks a 64-byte block, the rest set bits in it
+// flag or'ed into either layout: probes come from 64-bit double hashing over
+// the whole SHA1, rather than one 32-bit word of it each (v3 index files)
+#define BF_LAYOUT_HASH64   2
+// size of a block in the blocked layout
+#define BF_BLOCK_SIZE      64
+// raw index files keep the filter bits page-aligned, for mapping
+#define BF_PAGE_SIZE       4096
+// most probes per element, any layout; without BF_LAYOUT_HASH64 there is
+// one per word of the SHA1
+#define BF_MAX_PROBES      16
+#define BF_MAX_PROBES_32   5
+// features whose probes are prefetched together in the *_batch calls;
+// must divide 64
+#define BF_BATCH           16
+// largest filter with 32-bit probe positions, and with BF_LAYOUT_HASH64
+#define BF_MAX_SIZE_32     (512*1024*1024ULL)
+#define BF_MAX_SIZE        (1024*1024*1024*1024ULL)
+// filters larger than this are written raw, as LZ4 takes under 2GB at once
+#define BF_COMPRESS_MAX    (1024*1024*1024ULL)
+// each new partition of a scalable filter holds BF_GROWTH times as many
+// elements as the last, at BF_TIGHTEN times its false positive rate
+#define BF_GROWTH          2
+#define BF_TIGHTEN         0.5
+
 /**
 	bloom_filter:  a Bloom filter class.
 */
@@ -18,7 +46,10 @@ class bloom_filter {
 
 public:
     /// base constructor
-    bloom_filter(uint64_t size, uint16_t hash_count, uint64_t max_elem, double max_fp); 
+    bloom_filter(uint64_t size, uint16_t hash_count, uint64_t max_elem, double max_fp, uint32_t layout=BF_LAYOUT_STANDARD); 
+
+    /// scalable filter sized for expected_elem elements at an overall rate of max_fp
+    bloom_filter(uint64_t expected_elem, double max_fp, uint32_t layout, uint16_t hash_count=5);
 
     /// construct from file - not add to master or fold up. 
     bloom_filter(string indexfilename);
@@ -29,18 +60,34 @@ public:
     /// destructor
     ~bloom_filter();
 
-    /// insert SHA1 hash
+    /// insert SHA1 hash; safe to call from several threads at once
     bool insert_sha1(uint32_t *sha1);
     
     /// query SHA1 hash
     bool query_sha1(uint32_t *sha1);
 
-    /// return element count
+    /// insert many SHA1 hashes; bit j of inserted set if hash j was new
+    uint32_t insert_batch(const uint32_t (*sha1)[5], uint32_t count, uint64_t *inserted);
+
+    /// query many SHA1 hashes; bit j of found set if hash j is present
+    uint32_t query_batch(const uint32_t (*sha1)[5], uint32_t count, uint64_t *found);
+
+    /// return element count, all partitions
     uint64_t elem_count();
-    /// return estimate of false positive rate
+    /// return estimate of false positive rate, all partitions
     double est_fp_rate();    
     /// return bits per element
     double bits_per_elem();
+    /// fraction of this partition's bits set
+    double fill() const;
+    /// number of partitions
+    uint32_t partitions() const;
+    /// partition i, or NULL
+    bloom_filter *partition(uint32_t i);
+    /// size in bytes of a filter for elems elements at rate fp
+    static uint64_t size_for(uint64_t elems, double fp, uint16_t hash_count, uint32_t layout);
+    /// true if a filter of this size, hash count and layout can be made
+    static bool valid_shape(uint64_t size, uint16_t hash_count, uint32_t layout);
  
     /// name associated with bloom filter
     string name() const;
@@ -48,14 +95,60 @@ public:
     void set_name(string name);
     /// fold a large bloom filter onto itself
     void fold(uint32_t times);
-    /// add another same-sized bloom filter to this one
+    /// add another bloom filter of this size or larger to this one
     int add(bloom_filter *other);
-    /// write bloom filter to .idx file
-    int write_out(string filename);
+    /// merge another bloom filter in, partition by partition, keeping each under max_fp
+    int merge(bloom_filter *other, double max_fp);
+    /// re-estimate the element count of each partition from its bits
+    void recount();
+    /// write bloom filter to .idx file, compressed or raw
+    int write_out(string filename, bool raw=false);
+
+    /// bit layout, BF_LAYOUT_STANDARD or BF_LAYOUT_BLOCKED, with BF_LAYOUT_HASH64
+    uint32_t layout() const;
+    /// true if read from a raw (--index-raw) index file
+    bool raw() const;
+    /// size in bytes (this accessor and those below describe this partition only)
+    uint64_t size() const;
+    /// number of hash functions
+    uint16_t hash_functions() const;
+    /// bit mask for positions
+    uint64_t mask() const;
+    /// raw filter bits
+    const uint8_t *data() const;
+    /// bit positions probed for a SHA1 hash
+    uint32_t probe_positions(const uint32_t *sha1, uint64_t *pos) const;
+    /// bit positions probed for a SHA1 hash, for any filter of this shape
+    static uint32_t probe_positions(const uint32_t *sha1, uint64_t bit_mask, uint16_t hash_count, uint32_t layout, uint64_t *pos);
 
 private:
+    /// empty partition, for reading
+    bloom_filter();
+    /// common constructor code
+    void init(uint64_t size, uint16_t hash_count, uint64_t max_elem, double max_fp, uint32_t layout);
+    /// read one partition from an index file
+    void read_record(ifstream &ifs, string indexfilename);
+    /// write one partition to an index file
+    int32_t write_record(std::ostream &os, uint64_t &pos, bool raw);
+    /// partition to insert into, growing the filter if full
+    bloom_filter *insert_partition();
+    /// insert/query up to BF_BATCH hashes in this partition
+    uint64_t insert_group(const uint32_t (*sha1)[5], uint32_t count, uint64_t skip);
+    uint64_t query_group(const uint32_t (*sha1)[5], uint32_t count);
+    /// false positive estimate of this partition
+    double partition_fp_rate() const;
     /// actual query/insert function
     bool query_and_set(uint32_t *sha1, bool mode_set);
+    /// set bits at precomputed probe positions, atomically
+    bool set_at(const uint64_t *probes);
+    /// test bits at precomputed probe positions
+    bool test_at(const uint64_t *probes) const;
+    /// probe positions of a batch of hashes, prefetched
+    void prefetch_batch(const uint32_t (*sha1)[5], uint32_t count, uint64_t (*probes)[BF_MAX_PROBES], bool for_write);
+    /// map raw bits of an index file
+    int map_raw(string filename, uint64_t offset);
+    /// free or unmap bits
+    void release();
     /// compress blob
     char* compress() ;
     /// decompress blob and assign to bf
@@ -74,8 +167,14 @@ private:
     uint16_t  hash_count;    // Number of hash functions used (k)
     uint64_t  bit_mask;      // Bit mask
     uint64_t  comp_size;     // size of compressed bf to be read
+    uint32_t  bf_layout;     // BF_LAYOUT_*
     string    setname;       // name associated with bloom filter
     bool      created;       // set if we allocated the bloom filter ourselves
+    bool      mapped;        // set if bf is mapped from a raw index file
+    bool      stored_raw;    // set if read from a raw index file
+    bloom_filter *next;      // next partition of a scalable filter, or NULL
+
+    friend class counting_bloom_filter;
 
 };
 
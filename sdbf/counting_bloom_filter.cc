@@ -0,0 +1,278 @@
+// counting_bloom_filter.cc
+// bloom filter with removable elements
+
+#include "counting_bloom_filter.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lz4/lz4.h"
+
+/**
+    Creates an empty counting filter.
+    \param size bytes of the equivalent bloom filter, a power of two, at least 64;
+           the counters take four times as much
+    \param hash_count number of hashes for each insertion or query
+    \param layout BF_LAYOUT_*
+    \throws -1 if the size or hash count is invalid
+*/
+counting_bloom_filter::counting_bloom_filter(uint64_t size, uint16_t hash_count, uint32_t layout) {
+    init(size, hash_count, layout);
+    counters = (uint8_t*)alloc_check(ALLOC_ZERO, 4*size, "counting_bloom_filter", "counters", ERROR_EXIT);
+}
+
+/**
+    Reads a counting filter written by write_out().
+    \param filename .cidx file
+    \throws -1 if it cannot be read, -2 if the format is invalid
+*/
+counting_bloom_filter::counting_bloom_filter(std::string filename) {
+    FILE *in = fopen(filename.c_str(), "rb");
+    if (in == NULL)
+        throw -1;
+    char magic[16];
+    char name[FILENAME_MAX+1];
+    unsigned int version, hashes, lay;
+    unsigned long long size, count;
+    if (fscanf(in, "%15[^:]:%u:%llu:%llu:%u:%u:", magic, &version, &size, &count, &hashes, &lay) != 6 ||
+        strcmp(magic, MAGIC_CIDX) || version != CIDX_VERSION || !fgets(name, sizeof(name), in)) {
+        fclose(in);
+        throw -2;
+    }
+    name[strcspn(name, "\n")] = 0;
+    try {
+        init(size, hashes, lay);
+    } catch (int e) {
+        fclose(in);
+        throw -2;
+    }
+    elems = count;
+    setname = name;
+    counters = (uint8_t*)alloc_check(ALLOC_ONLY, 4*bf_size, "counting_bloom_filter", "counters", ERROR_EXIT);
+    // frames of up to CIDX_FRAME counter bytes: raw size, compressed size, data
+    char *comp = (char*)alloc_check(ALLOC_ONLY, LZ4_compressBound(CIDX_FRAME), "counting_bloom_filter", "frame", ERROR_EXIT);
+    for (uint64_t at = 0; at < 4*bf_size; ) {
+        uint32_t sizes[2];
+        if (fread(sizes, sizeof(uint32_t), 2, in) != 2 || sizes[0] > CIDX_FRAME || sizes[0] > 4*bf_size - at ||
+            sizes[1] > (uint32_t)LZ4_compressBound(CIDX_FRAME) || fread(comp, 1, sizes[1], in) != sizes[1] ||
+            LZ4_uncompress_unknownOutputSize(comp, (char*)counters + at, sizes[1], sizes[0]) != (int)sizes[0]) {
+            free(comp);
+            free(counters);
+            fclose(in);
+            throw -2;
+        }
+        at += sizes[0];
+    }
+    free(comp);
+    fclose(in);
+}
+
+counting_bloom_filter::~counting_bloom_filter() {
+    free(counters);
+}
+
+/**
+    \internal
+    Sets up shape and mask; see the constructors.
+*/
+void
+counting_bloom_filter::init(uint64_t size, uint16_t hash_count, uint32_t layout) {
+    if (!bloom_filter::valid_shape(size, hash_count, layout))
+        throw -1;
+    bf_size = size;
+    bit_mask = 8*size - 1;
+    this->hash_count = hash_count;
+    bf_layout = layout;
+    elems = 0;
+}
+
+/**
+    \internal
+    Adds one to, or takes one from, a counter, with a compare-and-swap
+    on the byte holding it.  Saturated counters are left alone, as are
+    empty ones when removing.
+    \param p counter position
+    \param delta +1 or -1
+    \returns the counter's value before
+*/
+uint8_t
+counting_bloom_filter::bump(uint64_t p, int delta) {
+    uint8_t *byte = counters + (p >> 1);
+    uint32_t shift = (p & 1) * 4;
+    for (;;) {
+        uint8_t old = *(volatile uint8_t*)byte;
+        uint8_t value = (old >> shift) & 0xF;
+        if (value == CBF_MAX || (delta < 0 && value == 0))
+            return value;
+        uint8_t updated = (old & ~(0xF << shift)) | ((value + delta) << shift);
+        if (__sync_bool_compare_and_swap(byte, old, updated))
+            return value;
+    }
+}
+
+/**
+    Inserts an element.  Every insertion counts, so an element inserted
+    twice must be removed twice.
+    \param sha1 buffer of sha1 hash values
+    \returns true if any of its counters was zero
+*/
+bool
+counting_bloom_filter::insert_sha1(uint32_t *sha1) {
+    uint64_t pos[BF_MAX_PROBES];
+    uint32_t k = bloom_filter::probe_positions(sha1, bit_mask, hash_count, bf_layout, pos);
+    bool added = false;
+    for (uint32_t i = 0; i < k; i++) {
+        if (bump(pos[i], 1) == 0)
+            added = true;
+    }
+    __sync_fetch_and_add(&elems, 1);
+    return added;
+}
+
+/**
+    Queries an element.
+    \param sha1 buffer of sha1 hash values
+    \returns true if all of its counters are non-zero
+*/
+bool
+counting_bloom_filter::query_sha1(uint32_t *sha1) {
+    uint64_t pos[BF_MAX_PROBES];
+    uint32_t k = bloom_filter::probe_positions(sha1, bit_mask, hash_count, bf_layout, pos);
+    for (uint32_t i = 0; i < k; i++) {
+        if (counter(pos[i]) == 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+    Removes an element, if it tests as present.
+    \param sha1 buffer of sha1 hash values
+    \returns true if it was present and has been removed
+*/
+bool
+counting_bloom_filter::remove_sha1(uint32_t *sha1) {
+    uint64_t pos[BF_MAX_PROBES];
+    uint32_t k = bloom_filter::probe_positions(sha1, bit_mask, hash_count, bf_layout, pos);
+    for (uint32_t i = 0; i < k; i++) {
+        if (counter(pos[i]) == 0)
+            return false;
+    }
+    for (uint32_t i = 0; i < k; i++)
+        bump(pos[i], -1);
+    __sync_fetch_and_sub(&elems, 1);
+    return true;
+}
+
+uint32_t
+counting_bloom_filter::insert_batch(const uint32_t (*sha1)[5], uint32_t count) {
+    uint32_t added = 0;
+    for (uint32_t j = 0; j < count; j++)
+        added += insert_sha1((uint32_t*)sha1[j]);
+    return added;
+}
+
+uint32_t
+counting_bloom_filter::remove_batch(const uint32_t (*sha1)[5], uint32_t count) {
+    uint32_t removed = 0;
+    for (uint32_t j = 0; j < count; j++)
+        removed += remove_sha1((uint32_t*)sha1[j]);
+    return removed;
+}
+
+/**
+    Builds the plain bloom filter equivalent to this one: same shape, a
+    bit set wherever a counter is non-zero.  Queries on it answer as
+    query_sha1() does, at an eighth of the memory.
+    \returns new bloom_filter, owned by the caller
+*/
+bloom_filter *
+counting_bloom_filter::snapshot() const {
+    bloom_filter *plain = new bloom_filter(bf_size, hash_count, 0, 0, bf_layout);
+    for (uint64_t b = 0; b < bf_size; b++) {
+        uint8_t bits = 0;
+        for (uint32_t i = 0; i < 8; i++) {
+            if (counter(b*8 + i))
+                bits |= 1 << i;
+        }
+        plain->bf[b] = bits;
+    }
+    plain->bf_elem_count = elems;
+    plain->setname = setname;
+    return plain;
+}
+
+/**
+    Writes the filter to a file: a text header line, then the counters
+    in LZ4-compressed frames.
+    \param filename file to write
+    \returns 0 if successful, -1 if compression fails, -2 if cannot write
+*/
+int
+counting_bloom_filter::write_out(std::string filename) {
+    FILE *out = fopen(filename.c_str(), "wb");
+    if (out == NULL)
+        return -2;
+    int status = 0;
+    fprintf(out, "%s:%d:%llu:%llu:%u:%u:%s\n", MAGIC_CIDX, CIDX_VERSION, (unsigned long long)bf_size,
+            (unsigned long long)elems, hash_count, bf_layout, setname.c_str());
+    char *comp = (char*)alloc_check(ALLOC_ONLY, LZ4_compressBound(CIDX_FRAME), "counting_bloom_filter", "frame", ERROR_EXIT);
+    for (uint64_t at = 0; at < 4*bf_size && !status; at += CIDX_FRAME) {
+        uint32_t sizes[2];
+        sizes[0] = (4*bf_size - at < CIDX_FRAME) ? 4*bf_size - at : CIDX_FRAME;
+        int res = LZ4_compress_limitedOutput((const char*)counters + at, comp, sizes[0], LZ4_compressBound(CIDX_FRAME));
+        if (res == 0) {
+            status = -1;
+            break;
+        }
+        sizes[1] = res;
+        if (fwrite(sizes, sizeof(uint32_t), 2, out) != 2 || fwrite(comp, 1, res, out) != (size_t)res)
+            status = -2;
+    }
+    free(comp);
+    if (fclose(out) && !status)
+        status = -2;
+    return status;
+}
+
+uint64_t
+counting_bloom_filter::elem_count() const {
+    return elems;
+}
+
+uint64_t
+counting_bloom_filter::saturated() const {
+    uint64_t stuck = 0;
+    for (uint64_t p = 0; p < 8*bf_size; p++) {
+        if (counter(p) == CBF_MAX)
+            stuck++;
+    }
+    return stuck;
+}
+
+uint64_t
+counting_bloom_filter::size() const {
+    return bf_size;
+}
+
+uint16_t
+counting_bloom_filter::hash_functions() const {
+    return hash_count;
+}
+
+uint32_t
+counting_bloom_filter::layout() const {
+    return bf_layout;
+}
+
+std::string
+counting_bloom_filter::name() const {
+    return setname;
+}
+
+void
+counting_bloom_filter::set_name(std::string name) {
+    setname = name;
+}
@@ -0,0 +1,92 @@
+// Header file for counting_bloom_filter object
+//
+#ifndef _COUNTING_BLOOM_FILTER_H
+#define _COUNTING_BLOOM_FILTER_H
+
+#include <stdint.h>
+#include <string>
+
+#include "bloom_filter.h"
+
+#define MAGIC_CIDX   "sdbf-cidx"
+#define CIDX_VERSION 1
+// counters stop here, and are never decremented again
+#define CBF_MAX      15
+// bytes of counters per compressed frame on disk
+#define CIDX_FRAME   (16*1024*1024)
+
+/**
+    counting_bloom_filter: a Bloom filter with a 4-bit counter in place of
+    each bit, so elements can be removed as well as inserted.  It probes
+    exactly as a single-partition bloom_filter of the same size, hash
+    count and layout does, and snapshot() gives that bloom_filter: a bit
+    is set where its counter is non-zero.  It cannot grow, so it only
+    mirrors a scalable bloom_filter while that has one partition.  Counters that reach CBF_MAX stay there, so
+    removal never causes false negatives, at worst stale bits.
+    Insertion and removal are safe from several threads at once.
+    Removing an element never inserted, that happens to test as present,
+    takes counts from the elements it collides with, as in any counting
+    filter; remove only what was inserted.
+*/
+/// counting_bloom_filter class
+class counting_bloom_filter {
+
+public:
+    /// empty filter, the counting form of a bloom_filter of size bytes
+    counting_bloom_filter(uint64_t size, uint16_t hash_count, uint32_t layout=BF_LAYOUT_STANDARD);
+    /// read from a .cidx file
+    counting_bloom_filter(std::string filename);
+    /// destructor
+    ~counting_bloom_filter();
+
+    /// insert SHA1 hash
+    bool insert_sha1(uint32_t *sha1);
+    /// query SHA1 hash
+    bool query_sha1(uint32_t *sha1);
+    /// remove SHA1 hash; false if it was not present
+    bool remove_sha1(uint32_t *sha1);
+    /// insert many SHA1 hashes; returns the number that were new
+    uint32_t insert_batch(const uint32_t (*sha1)[5], uint32_t count);
+    /// remove many SHA1 hashes; returns the number that were present
+    uint32_t remove_batch(const uint32_t (*sha1)[5], uint32_t count);
+
+    /// plain bloom filter with the bits of non-zero counters
+    bloom_filter *snapshot() const;
+    /// write to .cidx file
+    int write_out(std::string filename);
+
+    /// elements inserted less those removed
+    uint64_t elem_count() const;
+    /// number of counters stuck at CBF_MAX
+    uint64_t saturated() const;
+    /// size in bytes of the equivalent bloom filter
+    uint64_t size() const;
+    /// number of hash functions
+    uint16_t hash_functions() const;
+    /// bit layout
+    uint32_t layout() const;
+    /// name associated with filter
+    std::string name() const;
+    /// change name associated with filter
+    void set_name(std::string name);
+
+private:
+    /// common constructor code
+    void init(uint64_t size, uint16_t hash_count, uint32_t layout);
+    /// counter at position p
+    uint8_t counter(uint64_t p) const {
+        return (counters[p >> 1] >> ((p & 1) * 4)) & 0xF;
+    }
+    /// add delta to counter p atomically, unless it is 0 (removing) or saturated
+    uint8_t bump(uint64_t p, int delta);
+
+    uint8_t  *counters;      // two 4-bit counters per byte
+    uint64_t  bf_size;       // bytes of the equivalent bloom filter
+    uint64_t  bit_mask;
+    uint16_t  hash_count;
+    uint32_t  bf_layout;
+    uint64_t  elems;
+    std::string setname;
+};
+
+#endif
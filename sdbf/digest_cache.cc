@@ -0,0 +1,374 @@
+// digest_cache.cc
+// digests of earlier runs, keyed on file state
+
+#include "digest_cache.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <smmintrin.h>
+
+using namespace std;
+
+/**
+    Creates cache object.  Nothing is read until open().
+    \param fname cache file name
+*/
+digest_cache::digest_cache(const char *fname) {
+    this->fname = fname;
+    fd = -1;
+    lock_fd = -1;
+}
+
+digest_cache::~digest_cache() {
+    flush();
+    if (fd >= 0)
+        close(fd);
+    unlock();
+}
+
+/**
+    Reads the record headers of the cache file, creating it if absent.
+    A record cut short, as by a crash while appending, is dropped along
+    with anything after it.
+    \returns 0 if successful, -1 if cannot open or create, -2 if format invalid
+*/
+int
+digest_cache::open() {
+    if (lock())
+        return -1;
+    int status = read_locked();
+    unlock();
+    return status;
+}
+
+/**
+    \internal
+    Reads the cache file; the caller holds the lock.
+    \returns 0 if successful, -1 if cannot open or create, -2 if format invalid
+*/
+int
+digest_cache::read_locked() {
+    records.clear();
+    if (fd >= 0)
+        close(fd);
+    fd = ::open(fname.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+    FILE *in = fdopen(dup(fd), "rb");
+    if (in == NULL)
+        return -1;
+    char magic[16];
+    unsigned int version;
+    int status = 0;
+    if (fscanf(in, "%15[^:]:%u\n", magic, &version) != 2) {
+        // empty: new cache
+        struct stat st;
+        if (fstat(fd, &st) || st.st_size != 0) {
+            status = -2;
+        } else {
+            char header[64];
+            int len = snprintf(header, sizeof(header), "%s:%d\n", MAGIC_CACHE, CACHE_VERSION);
+            if (write(fd, header, len) != len)
+                status = -1;
+        }
+        fclose(in);
+        return status;
+    }
+    if (strcmp(magic, MAGIC_CACHE) || version != CACHE_VERSION) {
+        fclose(in);
+        return -2;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        fclose(in);
+        return -1;
+    }
+    off_t valid_end = ftello(in);
+    for (;;) {
+        cache_record_t rec;
+        unsigned long long dev, ino, size, offset, length, digest_len;
+        long long mtime_sec;
+        unsigned int mtime_nsec, block_size, file_len, name_len;
+        char sum[16];
+        if (fscanf(in, "item:%llu:%llu:%llu:%lld:%u:%llu:%llu:%u:%15[^:]:%llu:%u:", &dev, &ino, &size,
+                   &mtime_sec, &mtime_nsec, &offset, &length, &block_size, sum, &digest_len, &file_len) != 11)
+            break;
+        rec.file.resize(file_len);
+        if (file_len && fread(&rec.file[0], 1, file_len, in) != file_len)
+            break;
+        if (fscanf(in, ":%u:", &name_len) != 1)
+            break;
+        rec.name.resize(name_len);
+        if (name_len && fread(&rec.name[0], 1, name_len, in) != name_len)
+            break;
+        if (getc(in) != '\n')
+            break;
+        rec.dev = dev;
+        rec.ino = ino;
+        rec.size = size;
+        rec.mtime_sec = mtime_sec;
+        rec.mtime_nsec = mtime_nsec;
+        rec.offset = offset;
+        rec.length = length;
+        rec.block_size = block_size;
+        rec.has_checksum = strcmp(sum, "-") != 0;
+        rec.checksum = rec.has_checksum ? strtoul(sum, NULL, 16) : 0;
+        rec.digest_at = ftello(in);
+        rec.digest_len = digest_len;
+        // seeking past the end succeeds, so check the digest is all there
+        if ((uint64_t)st.st_size < rec.digest_at + digest_len || fseeko(in, digest_len, SEEK_CUR))
+            break;
+        records[rec.name] = rec;
+        valid_end = ftello(in);
+    }
+    if (st.st_size > valid_end) {
+        if (ftruncate(fd, valid_end))
+            status = -1;
+    }
+    fclose(in);
+    return status;
+}
+
+/**
+    Looks for a record of the same digest name, generated from the same
+    file state, byte range and block size.  A checksum in want is
+    compared too, if both have one.
+    \param want file state and digest name to look for
+    \param found the matching record, if any
+    \returns true if there is one
+*/
+bool
+digest_cache::lookup(const cache_record_t &want, cache_record_t *found) const {
+    map<string,cache_record_t>::const_iterator it = records.find(want.name);
+    if (it == records.end())
+        return false;
+    const cache_record_t &rec = it->second;
+    if (rec.file != want.file || rec.dev != want.dev || rec.ino != want.ino || rec.size != want.size ||
+        rec.mtime_sec != want.mtime_sec || rec.mtime_nsec != want.mtime_nsec ||
+        rec.offset != want.offset || rec.length != want.length || rec.block_size != want.block_size)
+        return false;
+    if (want.has_checksum && (!rec.has_checksum || rec.checksum != want.checksum))
+        return false;
+    *found = rec;
+    return true;
+}
+
+/**
+    Reads the encoded digest of a record found by lookup().  Safe from
+    several threads at once.
+    \param rec record
+    \param out digest, appended
+    \returns 0 if successful, -1 if cannot read
+*/
+int
+digest_cache::read_digest(const cache_record_t &rec, std::string &out) const {
+    size_t at = out.size();
+    out.resize(at + rec.digest_len);
+    uint64_t done = 0;
+    while (done < rec.digest_len) {
+        ssize_t res = pread(fd, &out[at + done], rec.digest_len - done, rec.digest_at + done);
+        if (res <= 0) {
+            out.resize(at);
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+/**
+   \internal
+   Formats the header line of a record.
+*/
+std::string
+digest_cache::record_line(const cache_record_t &rec) {
+    char field[256];
+    char sum[16] = "-";
+    if (rec.has_checksum)
+        snprintf(sum, sizeof(sum), "%08x", rec.checksum);
+    snprintf(field, sizeof(field), "item:%llu:%llu:%llu:%lld:%u:%llu:%llu:%u:%s:%llu:%u:",
+             (unsigned long long)rec.dev, (unsigned long long)rec.ino, (unsigned long long)rec.size,
+             (long long)rec.mtime_sec, rec.mtime_nsec, (unsigned long long)rec.offset,
+             (unsigned long long)rec.length, rec.block_size, sum, (unsigned long long)rec.digest_len,
+             (uint32_t)rec.file.length());
+    string line(field);
+    line += rec.file;
+    snprintf(field, sizeof(field), ":%u:", (uint32_t)rec.name.length());
+    line += field;
+    line += rec.name;
+    line += '\n';
+    return line;
+}
+
+/**
+    Queues a record to be appended to the cache file, appending the
+    queue once it is large.  Safe from several threads at once.
+    \param rec file state and digest name; the digest fields are ignored
+    \param digest encoded digest, empty if the file was too small to hash
+    \returns 0 if successful, -1 if cannot write
+*/
+int
+digest_cache::add(const cache_record_t &rec, const std::string &digest) {
+    cache_record_t out = rec;
+    out.digest_len = digest.length();
+    boost::mutex::scoped_lock guard(pending_lock);
+    pending += record_line(out);
+    pending += digest;
+    if (pending.size() < CACHE_FLUSH_SIZE)
+        return 0;
+    guard.unlock();
+    return flush();
+}
+
+/**
+    Appends queued records to the cache file, in one write under the
+    lock, so records from several processes never interleave.
+    \returns 0 if successful, -1 if cannot write
+*/
+int
+digest_cache::flush() {
+    boost::mutex::scoped_lock guard(pending_lock);
+    if (pending.empty())
+        return 0;
+    if (lock())
+        return -1;
+    int status = 0;
+    // opened again each time, as it may have been replaced by compact()
+    int out = ::open(fname.c_str(), O_WRONLY | O_APPEND);
+    if (out < 0)
+        status = -1;
+    for (size_t done = 0; !status && done < pending.size(); ) {
+        ssize_t res = write(out, pending.data() + done, pending.size() - done);
+        if (res <= 0)
+            status = -1;
+        else
+            done += res;
+    }
+    if (out >= 0 && (fsync(out) || close(out)))
+        status = -1;
+    unlock();
+    pending.clear();
+    return status;
+}
+
+/**
+    Rewrites the cache with the latest record of each digest name whose
+    file is unchanged, dropping those of files changed or gone.  The new
+    cache replaces the old with a rename, so other processes see one or
+    the other; their appends wait for the lock.
+    \returns 0 if successful, -1 if cannot write, -2 if cache invalid
+*/
+int
+digest_cache::compact() {
+    if (flush() || lock())
+        return -1;
+    int status = read_locked();
+    string tmpname = fname + ".tmp";
+    FILE *out = status ? NULL : fopen(tmpname.c_str(), "wb");
+    if (!status && out == NULL)
+        status = -1;
+    if (!status && fprintf(out, "%s:%d\n", MAGIC_CACHE, CACHE_VERSION) < 0)
+        status = -1;
+    map<string,cache_record_t>::iterator it;
+    for (it = records.begin(); !status && it != records.end(); it++) {
+        const cache_record_t &rec = it->second;
+        struct stat st;
+        if (stat(rec.file.c_str(), &st) || (uint64_t)st.st_dev != rec.dev || (uint64_t)st.st_ino != rec.ino ||
+            (uint64_t)st.st_size != rec.size || st.st_mtim.tv_sec != rec.mtime_sec ||
+            (uint32_t)st.st_mtim.tv_nsec != rec.mtime_nsec)
+            continue;
+        string digest;
+        if (read_digest(rec, digest)) {
+            status = -1;
+            break;
+        }
+        string line = record_line(rec);
+        if (fwrite(line.data(), 1, line.size(), out) != line.size() ||
+            fwrite(digest.data(), 1, digest.size(), out) != digest.size())
+            status = -1;
+    }
+    if (out != NULL && (fflush(out) || fsync(fileno(out)) || fclose(out)))
+        status = -1;
+    if (!status && rename(tmpname.c_str(), fname.c_str()))
+        status = -1;
+    if (!status)
+        status = read_locked();
+    else
+        unlink(tmpname.c_str());
+    unlock();
+    return status;
+}
+
+/**
+   \internal
+   Takes the cache's lock file, so that only one process appends or
+   compacts at a time.
+*/
+int
+digest_cache::lock() {
+    if (lock_fd >= 0)
+        return 0;
+    lock_fd = ::open((fname + ".lock").c_str(), O_CREAT | O_RDWR, 0644);
+    if (lock_fd < 0)
+        return -1;
+    if (flock(lock_fd, LOCK_EX)) {
+        ::close(lock_fd);
+        lock_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void
+digest_cache::unlock() {
+    if (lock_fd < 0)
+        return;
+    flock(lock_fd, LOCK_UN);
+    ::close(lock_fd);
+    lock_fd = -1;
+}
+
+uint64_t
+digest_cache::record_count() const {
+    return records.size();
+}
+
+/**
+    Computes the CRC-32C of part of a file.
+    \param fd open file
+    \param offset where to start
+    \param length bytes to read
+    \param sum the checksum
+    \returns 0 if successful, -1 if cannot read
+*/
+int
+digest_cache::checksum(int fd, uint64_t offset, uint64_t length, uint32_t *sum) {
+    const uint32_t chunk = 1024*1024;
+    uint64_t *buffer = (uint64_t*)alloc_check(ALLOC_ONLY, chunk, "digest_cache", "checksum buffer", ERROR_EXIT);
+    uint64_t crc = 0xFFFFFFFF;
+    int status = 0;
+    while (length > 0) {
+        ssize_t res = pread(fd, buffer, length < chunk ? length : chunk, offset);
+        if (res <= 0) {
+            status = -1;
+            break;
+        }
+        size_t words = res / 8;
+        for (size_t i = 0; i < words; i++)
+            crc = _mm_crc32_u64(crc, buffer[i]);
+        const uint8_t *tail = (const uint8_t*)(buffer + words);
+        for (size_t i = 0; i < (size_t)res % 8; i++)
+            crc = _mm_crc32_u8((uint32_t)crc, tail[i]);
+        offset += res;
+        length -= res;
+    }
+    free(buffer);
+    *sum = (uint32_t)crc ^ 0xFFFFFFFF;
+    return status;
+}
@@ -0,0 +1,95 @@
+// Header file for digest_cache object
+//
+#ifndef _DIGEST_CACHE_H
+#define _DIGEST_CACHE_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+#define MAGIC_CACHE   "sdbf-cache"
+#define CACHE_VERSION 1
+// records are appended to the cache file once this much is waiting
+#define CACHE_FLUSH_SIZE (4*1024*1024)
+
+// One cached digest: what it was generated from, and where it is
+typedef struct {
+    std::string file;         // file the digest was generated from
+    std::string name;         // digest name: file, or file.NNNNM for a segment
+    uint64_t    dev;          // device, inode, size and modification time of file
+    uint64_t    ino;
+    uint64_t    size;
+    int64_t     mtime_sec;
+    uint32_t    mtime_nsec;
+    uint64_t    offset;       // bytes of file hashed: offset and length
+    uint64_t    length;
+    uint32_t    block_size;   // block size, 0 for stream mode
+    bool        has_checksum; // checksum of the bytes hashed is known
+    uint32_t    checksum;
+    uint64_t    digest_at;    // where the digest is in the cache file
+    uint64_t    digest_len;   // encoded digest length, 0 for a file too small to hash
+} cache_record_t;
+
+/**
+    digest_cache: digests from earlier runs, keyed on the state of the
+    file they came from, so unchanged files need not be read again.  A
+    record matches when its name, device, inode, size, modification time,
+    byte range and block size all do; a checksum of the bytes can be kept
+    too, for callers that want to confirm a match by reading the file.
+    The cache file is a log: a header line, then records, each a header
+    line followed by the encoded digest.  Later records supersede earlier
+    ones of the same name.  Records are appended in batches under a lock
+    file, so several processes can share a cache; compact() keeps the
+    latest record of each file that is still unchanged, replacing the
+    cache atomically.  Only the record headers are held in memory;
+    digests are read from the file as they are used.
+
+    Record header line:
+      item:<dev>:<ino>:<size>:<mtime s>:<mtime ns>:<offset>:<length>:<block size>:
+      <checksum, hex or ->:<digest length>:<file length>:<file>:<name length>:<name>
+*/
+/// digest_cache class
+class digest_cache {
+
+public:
+    /// cache object for file fname
+    digest_cache(const char *fname);
+    /// destructor: appends anything waiting
+    ~digest_cache();
+
+    /// read the record headers, creating an empty cache if none exists
+    int open();
+    /// record matching want, if any, into found
+    bool lookup(const cache_record_t &want, cache_record_t *found) const;
+    /// read the digest of a record
+    int read_digest(const cache_record_t &rec, std::string &out) const;
+    /// queue a record with its encoded digest to be appended
+    int add(const cache_record_t &rec, const std::string &digest);
+    /// append queued records to the cache file
+    int flush();
+    /// rewrite with only the latest record of each unchanged file
+    int compact();
+
+    /// number of records read
+    uint64_t record_count() const;
+
+    /// checksum of length bytes of open file fd from offset
+    static int checksum(int fd, uint64_t offset, uint64_t length, uint32_t *sum);
+
+private:
+    int read_locked();
+    int lock();
+    void unlock();
+    static std::string record_line(const cache_record_t &rec);
+
+    std::string fname;
+    std::map<std::string,cache_record_t> records;  // by digest name
+    int fd;                  // cache file as read, for digests
+    int lock_fd;
+    boost::mutex pending_lock;
+    std::string pending;     // records waiting to be appended
+};
+
+#endif
@@ -0,0 +1,70 @@
+// filter_table.cc
+// content-addressed bloom filter storage for deduplicated sets
+
+#include "filter_table.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+    Creates an empty filter table.
+    \param bf_size size of each filter in bytes
+*/
+filter_table::filter_table(uint32_t bf_size) {
+    this->bf_size = bf_size;
+    ref_count = 0;
+}
+
+filter_table::~filter_table() {
+    for (uint32_t i = 0; i < blocks.size(); i++)
+        free(blocks[i]);
+}
+
+/**
+    Looks up a filter by content and element count, adding it if new.
+    \param filter filter contents, bf_size bytes
+    \param elem_count number of elements in filter
+    \param hamming hamming weight of filter
+    \returns id of the stored filter
+*/
+uint32_t
+filter_table::intern(const uint8_t *filter, uint16_t elem_count, uint16_t hamming) {
+    // FNV-1a over the contents, with the element count folded in
+    uint64_t key = 14695981039346656037ULL;
+    for (uint32_t i = 0; i < bf_size; i++)
+        key = (key ^ filter[i]) * 1099511628211ULL;
+    key = (key ^ elem_count) * 1099511628211ULL;
+    ref_count++;
+    std::pair<std::multimap<uint64_t,uint32_t>::iterator,std::multimap<uint64_t,uint32_t>::iterator> range = lookup.equal_range(key);
+    for (std::multimap<uint64_t,uint32_t>::iterator it = range.first; it != range.second; ++it) {
+        if (elems[it->second] == elem_count && !memcmp(this->filter(it->second), filter, bf_size))
+            return it->second;
+    }
+    uint32_t id = elems.size();
+    if (id % FILTER_TABLE_BLOCK == 0)
+        blocks.push_back((uint8_t*)alloc_check(ALLOC_ONLY, (uint64_t)FILTER_TABLE_BLOCK*bf_size, "filter_table", "block", ERROR_EXIT));
+    memcpy(blocks.back() + (uint64_t)(id % FILTER_TABLE_BLOCK)*bf_size, filter, bf_size);
+    elems.push_back(elem_count);
+    weights.push_back(hamming);
+    lookup.insert(std::make_pair(key, id));
+    return id;
+}
+
+uint64_t
+filter_table::size() const {
+    return elems.size();
+}
+
+uint64_t
+filter_table::refs() const {
+    return ref_count;
+}
+
+score_cache::score_cache() {
+    entries = (entry_t*)alloc_check(ALLOC_ZERO, SCORE_CACHE_SIZE*sizeof(entry_t), "score_cache", "entries", ERROR_EXIT);
+}
+
+score_cache::~score_cache() {
+    free(entries);
+}
@@ -0,0 +1,95 @@
+// Header file for filter_table object
+//
+#ifndef _FILTER_TABLE_H
+#define _FILTER_TABLE_H
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+// filters per storage block; blocks never move once allocated
+#define FILTER_TABLE_BLOCK 4096
+
+/**
+    filter_table: content-addressed store of unique bloom filters.  Digests
+    in deduplicated sets keep filter ids into a shared table instead of
+    their own copies, so identical filters (empty ones, repeated files in
+    disk images) are stored, and compared, once.  A filter's identity is
+    its contents plus its element count, since both affect scoring.
+    Not thread-safe for intern(); lookups are safe once filled.
+*/
+/// filter_table class
+class filter_table {
+
+public:
+    /// creates empty table for filters of bf_size bytes
+    filter_table(uint32_t bf_size);
+    /// destructor
+    ~filter_table();
+
+    /// returns id of filter, adding it if not present
+    uint32_t intern(const uint8_t *filter, uint16_t elem_count, uint16_t hamming);
+
+    /// filter contents
+    const uint8_t *filter(uint32_t id) const {
+        return blocks[id / FILTER_TABLE_BLOCK] + (uint64_t)(id % FILTER_TABLE_BLOCK)*bf_size;
+    }
+    /// element count of filter
+    uint16_t elem_count(uint32_t id) const { return elems[id]; }
+    /// hamming weight of filter
+    uint16_t hamming(uint32_t id) const { return weights[id]; }
+
+    /// number of unique filters
+    uint64_t size() const;
+    /// number of filters interned, including duplicates
+    uint64_t refs() const;
+
+private:
+    uint32_t bf_size;
+    uint64_t ref_count;
+    std::vector<uint8_t*> blocks;
+    std::vector<uint16_t> elems;
+    std::vector<uint16_t> weights;
+    std::multimap<uint64_t,uint32_t> lookup;   // content hash -> id
+};
+
+// entries in a score_cache
+#define SCORE_CACHE_SIZE (64*1024)
+
+/**
+    score_cache: small direct-mapped cache of filter pair scores, keyed by
+    filter_table ids.  One per comparing thread; entries are simply
+    overwritten on collision.
+*/
+class score_cache {
+
+public:
+    score_cache();
+    ~score_cache();
+
+    /// look up score of filter pair (ref, tgt)
+    bool find(uint32_t ref, uint32_t tgt, double *score) const {
+        uint64_t key = ((uint64_t)ref << 32 | tgt) + 1;
+        const entry_t *e = &entries[(key * 0x9E3779B97F4A7C15ULL) >> 48];  // top 16 bits: SCORE_CACHE_SIZE slots
+        if (e->key != key)
+            return false;
+        *score = e->score;
+        return true;
+    }
+    /// remember score of filter pair (ref, tgt)
+    void store(uint32_t ref, uint32_t tgt, double score) {
+        uint64_t key = ((uint64_t)ref << 32 | tgt) + 1;
+        entry_t *e = &entries[(key * 0x9E3779B97F4A7C15ULL) >> 48];
+        e->key = key;
+        e->score = score;
+    }
+
+private:
+    typedef struct {
+        uint64_t key;    // 0 is empty
+        double   score;
+    } entry_t;
+    entry_t *entries;
+};
+
+#endif
@@ -6,6 +6,10 @@
 #ifndef INDEX_INFO
 #define INDEX_INFO
 
+class bit_sliced_index;
+class index_tree;
+class counting_bloom_filter;
+
 typedef struct {
      bloom_filter *index;
      std::vector<bloom_filter *> *indexlist;
@@ -13,6 +17,10 @@ typedef struct {
      bool search_deep;
      bool search_first;
      bool basename;
+     bit_sliced_index *sliced;  // all of setlist's indexes, transposed, or NULL
+     index_tree *tree;          // all of setlist's indexes, under union filters, or NULL
+     counting_bloom_filter *counting;  // counting index to add features to, or NULL
+     bool counting_remove;      // take features out of counting instead
 } index_info ;
 
 #endif
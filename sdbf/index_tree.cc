@@ -0,0 +1,362 @@
+// index_tree.cc
+// tree of union bloom filters over reference set indexes
+
+#include "index_tree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+/**
+    Features of a batch which a filter may contain.
+    \param filter filter to query
+    \param sha1 batch of features
+    \param mask features to query, bit j for feature j
+    \returns those of mask the filter may contain
+*/
+static uint64_t
+filter_mask(bloom_filter *filter, const uint32_t (*sha1)[5], uint64_t mask) {
+    uint32_t group[64][5];
+    uint32_t feature[64];
+    uint32_t n = 0;
+    for (uint64_t v = mask; v; v &= v - 1, n++) {
+        feature[n] = __builtin_ctzll(v);
+        memcpy(group[n], sha1[feature[n]], 5*sizeof(uint32_t));
+    }
+    uint64_t found = 0, hits = 0;
+    filter->query_batch(group, n, &found);
+    for (uint32_t i = 0; i < n; i++)
+        if (found & (1ULL << i))
+            hits |= 1ULL << feature[i];
+    return hits;
+}
+
+/**
+    Builds a tree over a list of bloom filter indexes.
+    \param indexes indexes of the sets, all the same layout (see compatible())
+    \param names name of each index's set, used to match a persisted copy
+    \param fanout sets or nodes per node
+    \throws -1 if the indexes are empty or not compatible
+*/
+index_tree::index_tree(const std::vector<bloom_filter*> &indexes, const std::vector<std::string> &names, uint32_t fanout) {
+    if (indexes.empty() || fanout < 2 || !compatible(indexes))
+        throw -1;
+    this->fanout = fanout;
+    layout = indexes[0]->layout();
+    hash_count = BF_MAX_PROBES;
+    // smallest partition of each, which bounds the size of unions over it
+    std::vector<std::pair<uint64_t,uint32_t> > order;
+    for (uint32_t s = 0; s < indexes.size(); s++) {
+        uint64_t smallest = indexes[s]->size();
+        for (uint32_t i = 0; i < indexes[s]->partitions(); i++) {
+            smallest = std::min(smallest, indexes[s]->partition(i)->size());
+            hash_count = std::min(hash_count, indexes[s]->partition(i)->hash_functions());
+        }
+        order.push_back(std::make_pair(smallest, s));
+    }
+    std::sort(order.begin(), order.end());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        uint32_t s = order[i].second;
+        set_names.push_back(s < names.size() ? names[s] : indexes[s]->name());
+        set_elems.push_back(indexes[s]->elem_count());
+        leaves.push_back(indexes[s]);
+        slot_map.push_back(s);
+    }
+    // bottom level, over the sets
+    uint32_t sets = leaves.size();
+    for (uint32_t first = 0; first < sets; first += fanout) {
+        node_t node;
+        node.first = first;
+        node.count = std::min(fanout, sets - first);
+        node.level = 0;
+        node.elems = 0;
+        std::vector<bloom_filter*> below;
+        for (uint32_t s = first; s < first + node.count; s++) {
+            below.push_back(leaves[s]);
+            node.elems += set_elems[s];
+        }
+        node.filter = make_union(below);
+        nodes.push_back(node);
+    }
+    // then over the level below, until one node is left
+    uint32_t begin = 0;
+    for (uint32_t level = 1; nodes.size() - begin > 1; level++) {
+        uint32_t end = nodes.size();
+        for (uint32_t first = begin; first < end; first += fanout) {
+            node_t node;
+            node.first = first;
+            node.count = std::min(fanout, end - first);
+            node.level = level;
+            node.elems = 0;
+            std::vector<bloom_filter*> below;
+            for (uint32_t c = first; c < first + node.count; c++) {
+                below.push_back(nodes[c].filter);
+                node.elems += nodes[c].elems;
+            }
+            node.filter = make_union(below);
+            nodes.push_back(node);
+        }
+        begin = end;
+    }
+}
+
+/**
+    Reads a tree written by write_out().  Until map_slots() is called it
+    has no set indexes to search.
+    \param fname file to read
+    \throws -1 if it cannot be read, -2 if the format is invalid
+*/
+index_tree::index_tree(const char *fname) {
+    FILE *in = fopen(fname, "rb");
+    if (in == NULL)
+        throw -1;
+    char magic[16];
+    unsigned int version, fan, lay, hashes, sets, count;
+    if (fscanf(in, "%15[^:]:%u:%u:%u:%u:%u:%u\n", magic, &version, &fan, &lay, &hashes, &sets, &count) != 7 ||
+        strcmp(magic, MAGIC_TREE) || version != TREE_VERSION || sets == 0 || count == 0) {
+        fclose(in);
+        throw -2;
+    }
+    fanout = fan;
+    layout = lay;
+    hash_count = hashes;
+    char name[FILENAME_MAX+1];
+    unsigned long long elems, size;
+    for (uint32_t s = 0; s < sets; s++) {
+        if (fscanf(in, "%llu:", &elems) != 1 || !fgets(name, sizeof(name), in)) {
+            fclose(in);
+            throw -2;
+        }
+        name[strcspn(name, "\n")] = 0;
+        set_names.push_back(name);
+        set_elems.push_back(elems);
+        leaves.push_back(NULL);
+        slot_map.push_back(s);
+    }
+    std::vector<uint64_t> sizes;
+    for (uint32_t n = 0; n < count; n++) {
+        node_t node;
+        unsigned int level, first, children;
+        if (fscanf(in, "%u:%u:%u:%llu:%llu\n", &level, &first, &children, &elems, &size) != 5 ||
+            first + children > (level ? n : sets)) {
+            fclose(in);
+            throw -2;
+        }
+        node.level = level;
+        node.first = first;
+        node.count = children;
+        node.elems = elems;
+        node.filter = NULL;
+        nodes.push_back(node);
+        sizes.push_back(size);
+    }
+    for (uint32_t n = 0; n < count; n++) {
+        if (sizes[n] == 0)
+            continue;
+        try {
+            nodes[n].filter = new bloom_filter(sizes[n], hash_count, 0, 0, layout);
+        } catch (int e) {
+            nodes[n].filter = NULL;
+        }
+        // a fresh filter, filled in place
+        if (nodes[n].filter == NULL ||
+            fread(const_cast<uint8_t*>(nodes[n].filter->data()), 1, sizes[n], in) != sizes[n]) {
+            for (uint32_t m = 0; m <= n; m++)
+                delete nodes[m].filter;
+            fclose(in);
+            throw -2;
+        }
+    }
+    fclose(in);
+}
+
+index_tree::~index_tree() {
+    for (uint32_t n = 0; n < nodes.size(); n++)
+        delete nodes[n].filter;
+}
+
+/**
+    Writes this tree to a file: a text header line, one line per set
+    (element count of its index and its name), one line per node, then
+    the bits of each node's union filter.  Set indexes are not included.
+    \param fname file to write
+    \returns 0 if successful, -2 if cannot write
+*/
+int
+index_tree::write_out(const char *fname) {
+    FILE *out = fopen(fname, "wb");
+    if (out == NULL)
+        return -2;
+    int status = 0;
+    fprintf(out, "%s:%d:%u:%u:%u:%u:%u\n", MAGIC_TREE, TREE_VERSION, fanout, layout, hash_count,
+            (uint32_t)set_names.size(), (uint32_t)nodes.size());
+    for (uint32_t s = 0; s < set_names.size(); s++)
+        fprintf(out, "%llu:%s\n", (unsigned long long)set_elems[s], set_names[s].c_str());
+    for (uint32_t n = 0; n < nodes.size(); n++)
+        fprintf(out, "%u:%u:%u:%llu:%llu\n", nodes[n].level, nodes[n].first, nodes[n].count,
+                (unsigned long long)nodes[n].elems,
+                (unsigned long long)(nodes[n].filter ? nodes[n].filter->size() : 0));
+    for (uint32_t n = 0; n < nodes.size(); n++) {
+        bloom_filter *filter = nodes[n].filter;
+        if (filter && fwrite(filter->data(), 1, filter->size(), out) != filter->size())
+            status = -2;
+    }
+    if (fclose(out))
+        status = -2;
+    return status;
+}
+
+/**
+    Builds the union of some filters, at the size of the smallest, then
+    folds it in half while the result stays under TREE_FOLD_FILL.
+    \param filters filters to join, NULL for a node without a filter
+    \returns the union, or NULL if it would pass nearly everything
+*/
+bloom_filter *
+index_tree::make_union(const std::vector<bloom_filter*> &filters) {
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < filters.size(); i++) {
+        if (filters[i] == NULL)
+            return NULL;
+        for (uint32_t p = 0; p < filters[i]->partitions(); p++) {
+            if (size == 0 || filters[i]->partition(p)->size() < size)
+                size = filters[i]->partition(p)->size();
+        }
+    }
+    bloom_filter *joined = new bloom_filter(size, hash_count, 0, 0, layout);
+    for (uint32_t i = 0; i < filters.size(); i++)
+        joined->add(filters[i]);
+    double fill = joined->fill();
+    // folding in half takes a fill of f to about 1-(1-f)^2
+    while (joined->size() > 512 && 1 - (1 - fill)*(1 - fill) <= TREE_FOLD_FILL) {
+        joined->fold(1);
+        fill = joined->fill();
+    }
+    if (fill > TREE_MAX_FILL) {
+        delete joined;
+        return NULL;
+    }
+    return joined;
+}
+
+/**
+    Looks up a batch of features in every set, descending only where the
+    union filters match.  Hit counts are the same as querying each set's
+    index directly.
+    \param sha1 features, at most 64
+    \param count number of features
+    \param matches per-set hit counts, indexed by position in set list
+    \param any bit j set if feature j hit any set
+*/
+void
+index_tree::query_batch(const uint32_t (*sha1)[5], uint32_t count, std::vector<uint32_t> *matches, uint64_t *any) const {
+    *any = 0;
+    if (count == 0)
+        return;
+    uint64_t mask = (count >= 64) ? ~0ULL : (1ULL << count) - 1;
+    descend(nodes.size() - 1, sha1, mask, matches, any);
+}
+
+void
+index_tree::descend(uint32_t n, const uint32_t (*sha1)[5], uint64_t mask, std::vector<uint32_t> *matches, uint64_t *any) const {
+    const node_t &node = nodes[n];
+    if (node.filter)
+        mask = filter_mask(node.filter, sha1, mask);
+    if (mask == 0)
+        return;
+    for (uint32_t c = node.first; c < node.first + node.count; c++) {
+        if (node.level > 0) {
+            descend(c, sha1, mask, matches, any);
+        } else {
+            uint64_t hits = filter_mask(leaves[c], sha1, mask);
+            matches->at(slot_map[c]) += __builtin_popcountll(hits);
+            *any |= hits;
+        }
+    }
+}
+
+uint32_t
+index_tree::set_count() const {
+    return set_names.size();
+}
+
+uint32_t
+index_tree::node_count() const {
+    return nodes.size();
+}
+
+uint32_t
+index_tree::depth() const {
+    return nodes.back().level + 1;
+}
+
+uint32_t
+index_tree::filtered_count() const {
+    uint32_t filtered = 0;
+    for (uint32_t n = 0; n < nodes.size(); n++)
+        if (nodes[n].filter)
+            filtered++;
+    return filtered;
+}
+
+uint64_t
+index_tree::size() const {
+    uint64_t total = 0;
+    for (uint32_t n = 0; n < nodes.size(); n++)
+        if (nodes[n].filter)
+            total += nodes[n].filter->size();
+    return total;
+}
+
+/**
+    Maps this tree's sets onto the caller's set list by name, so a
+    persisted tree can be used whatever order the sets were loaded in,
+    and takes their indexes for the bottom of the tree.  Also checks the
+    indexes still match what the tree was built from.
+    \param order set names in the caller's order
+    \param indexes the sets' indexes, same order
+    \returns false if the sets or their indexes differ
+*/
+bool
+index_tree::map_slots(const std::vector<std::string> &order, const std::vector<bloom_filter*> &indexes) {
+    uint32_t sets = set_names.size();
+    if (order.size() != sets || indexes.size() != sets)
+        return false;
+    std::map<std::string,uint32_t> position;
+    for (uint32_t j = 0; j < order.size(); j++)
+        position[order[j]] = j;
+    std::vector<uint32_t> mapped(sets);
+    std::vector<bloom_filter*> found(sets);
+    for (uint32_t s = 0; s < sets; s++) {
+        std::map<std::string,uint32_t>::iterator it = position.find(set_names[s]);
+        if (it == position.end())
+            return false;
+        bloom_filter *index = indexes[it->second];
+        if (index->elem_count() != set_elems[s] || index->layout() != layout ||
+            index->hash_functions() < hash_count)
+            return false;
+        mapped[s] = it->second;
+        found[s] = index;
+    }
+    slot_map.swap(mapped);
+    leaves.swap(found);
+    return true;
+}
+
+/**
+    Checks that indexes share a layout.  Sizes may differ, as unions are
+    folded down to their smallest member.
+    \param indexes indexes to check
+    \returns true if they can be grouped into a tree
+*/
+bool
+index_tree::compatible(const std::vector<bloom_filter*> &indexes) {
+    for (uint32_t i = 1; i < indexes.size(); i++) {
+        if (indexes[i]->layout() != indexes[0]->layout())
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,91 @@
+// Header file for index_tree object
+//
+#ifndef _INDEX_TREE_H
+#define _INDEX_TREE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "bloom_filter.h"
+
+#define MAGIC_TREE   "sdbf-tree"
+#define TREE_VERSION 1
+// sets or nodes grouped under each node
+#define TREE_FANOUT  4
+// union filters are folded while they stay sparser than this, so unions
+// over them stay useful too
+#define TREE_FOLD_FILL 0.2
+// union filters fuller than this are dropped, as they would pass too much
+// (0.7 of bits set passes 17% of features with 5 probes)
+#define TREE_MAX_FILL 0.7
+
+/**
+    index_tree: the indexes of many reference sets, grouped into buckets
+    of up to fanout, each bucket under a node holding the union of their
+    filters, folded down as far as it stays sparse.  Nodes are grouped the
+    same way, level by level, up to a single root.  A feature lookup
+    descends only into nodes whose filter matches, so with a few matching
+    sets its cost grows with the depth of the tree rather than the number
+    of sets.
+    Sets are ordered by index size before grouping, so unions are of
+    filters of about the same size and fold well.
+*/
+/// index_tree class
+class index_tree {
+
+public:
+    /// builds over indexes, which must share a layout
+    index_tree(const std::vector<bloom_filter*> &indexes, const std::vector<std::string> &names, uint32_t fanout=TREE_FANOUT);
+    /// reads a persisted tree; map_slots() must be called before searching
+    index_tree(const char *fname);
+    /// destructor
+    ~index_tree();
+
+    /// write to file
+    int write_out(const char *fname);
+
+    /// look up a batch of features: matches[set]++ for each set containing each
+    void query_batch(const uint32_t (*sha1)[5], uint32_t count, std::vector<uint32_t> *matches, uint64_t *any) const;
+
+    /// number of sets
+    uint32_t set_count() const;
+    /// number of union nodes
+    uint32_t node_count() const;
+    /// levels of union nodes
+    uint32_t depth() const;
+    /// bytes of union filters
+    uint64_t size() const;
+    /// number of nodes with a union filter, the rest always descend
+    uint32_t filtered_count() const;
+    /// map sets to positions in the caller's set list; false if sets have changed
+    bool map_slots(const std::vector<std::string> &order, const std::vector<bloom_filter*> &indexes);
+
+    /// true if all indexes have the same layout, so they can be grouped
+    static bool compatible(const std::vector<bloom_filter*> &indexes);
+
+private:
+    typedef struct {
+        bloom_filter *filter;   // union of everything below, or NULL to always descend
+        uint64_t elems;         // elements summed over everything below
+        uint32_t first;         // first child node, or first slot on the bottom level
+        uint32_t count;         // number of children
+        uint32_t level;         // 0 for nodes over sets
+    } node_t;
+
+    /// union of filters, folded while it stays sparse
+    bloom_filter *make_union(const std::vector<bloom_filter*> &filters);
+    /// descend from node n with the features in mask
+    void descend(uint32_t n, const uint32_t (*sha1)[5], uint64_t mask, std::vector<uint32_t> *matches, uint64_t *any) const;
+
+    uint32_t fanout;
+    uint32_t layout;
+    uint16_t hash_count;              // fewest probes of any set's index
+    std::vector<node_t> nodes;        // level by level, root last
+    std::vector<std::string> set_names;  // in slot order
+    std::vector<uint64_t> set_elems;  // element count of each set's index
+    std::vector<bloom_filter*> leaves;   // each slot's index, once mapped
+    std::vector<uint32_t> slot_map;   // slot -> position in caller's set list
+};
+
+#endif
@@ -9,6 +9,7 @@
 #include <fstream>
 
 #include "util.h"
+#include "sdbf_stats.h"
 
 #include "boost/filesystem.hpp"
 
@@ -41,8 +42,11 @@ processed_file_t *process_file(const char *fname, int64_t min_file_size, uint32_
     is->open(fname,ios::binary);
 
     mfile->buffer = (uint8_t*)alloc_check(ALLOC_ZERO,sizeof(uint8_t)*file_stat.st_size, "read_file", "mfile", ERROR_EXIT);
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
     is->read((char*)mfile->buffer,file_stat.st_size);
     int res=is->gcount();
+    stats_lap(stats, STAT_READ, &since);
     //mfile->buffer = (uint8_t*)process( 0, file_stat.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, mfile->fd, 0);
     if( res != file_stat.st_size) {
         fprintf( stderr, "read failed: %s.\n", strerror( errno));
@@ -0,0 +1,306 @@
+// result_sink.cc
+// formatting comparison results as they are produced
+
+#include "result_sink.h"
+#include "sdbf_class.h"
+#include "sdbf_set.h"
+#include "sdbf_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+    Creates a sink that keeps what it formats, for take().
+    \param format RESULT_TEXT, RESULT_JSON or RESULT_BINARY
+*/
+result_sink::result_sink(uint32_t format) {
+    this->format = format;
+    file = NULL;
+    added = 0;
+    flushed = 0;
+    finished = false;
+    failed = false;
+    target_base = 0;
+    if (format == RESULT_BINARY)
+        out.append(MAGIC_RESULTS, 8);
+}
+
+/**
+    Creates a sink that writes to a file as results come.
+    \param format RESULT_TEXT, RESULT_JSON or RESULT_BINARY
+    \param file open file, left open
+*/
+result_sink::result_sink(uint32_t format, FILE *file) {
+    this->format = format;
+    this->file = file;
+    added = 0;
+    flushed = time(NULL);
+    finished = false;
+    failed = false;
+    target_base = 0;
+    if (format == RESULT_BINARY)
+        out.append(MAGIC_RESULTS, 8);
+}
+
+result_sink::~result_sink() {
+    finish();
+}
+
+// appends s as a JSON string
+static void
+append_quoted(std::string &out, const char *s) {
+    out += '"';
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            out += '\\';
+            out += *s;
+        } else if ((unsigned char)*s < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*s);
+            out += esc;
+        } else {
+            out += *s;
+        }
+    }
+    out += '"';
+}
+
+// appends v as 4 little-endian bytes
+static void
+append_u32(std::string &out, uint32_t v) {
+    for (uint32_t i = 0; i < 4; i++)
+        out += (char)((v >> (8*i)) & 0xff);
+}
+
+// reads 4 little-endian bytes
+static uint32_t
+get_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+    Formats one result, writing out what is waiting if the sink has a
+    file and enough has built up, or it has waited long enough.
+    \param result result to add
+*/
+void
+result_sink::add(const compare_result_t *result) {
+    if (format == RESULT_BINARY)
+        add_named(NULL, NULL, result->query_id, target_base + result->target_id, result->score);
+    else
+        add_named(result->query->name(), result->target->name(), result->query_id, result->target_id, result->score);
+}
+
+/**
+   \internal
+   add(), for a result named directly; binary output needs only the ids,
+   text and JSON only the names.
+*/
+void
+result_sink::add_named(const char *query, const char *target, uint32_t query_id, uint32_t target_id, int32_t score) {
+    char num[16];
+    if (format == RESULT_BINARY) {
+        append_u32(out, query_id);
+        append_u32(out, target_id);
+        out += (char)(score < 0 ? 0xff : score);
+    } else if (format == RESULT_JSON) {
+        out += "{\"query\":";
+        append_quoted(out, query);
+        out += ",\"target\":";
+        append_quoted(out, target);
+        snprintf(num, sizeof(num), ",\"score\":%d}\n", score);
+        out += num;
+    } else {
+        out += query;
+        out += '|';
+        out += target;
+        out += '|';
+        // three wide, zero filled on the left, as setw(3) always printed
+        snprintf(num, sizeof(num), "%d", score);
+        for (int pad = 3 - (int)strlen(num); pad > 0; pad--)
+            out += '0';
+        out += num;
+        out += '\n';
+    }
+    added++;
+    if (file != NULL && (out.size() >= RESULT_FLUSH_SIZE || time(NULL) - flushed >= RESULT_FLUSH_SECONDS))
+        flush();
+}
+
+void
+result_sink::emit(const compare_result_t *result, void *context) {
+    ((result_sink*)context)->add(result);
+}
+
+/**
+    Takes the names of the query set, by position.  Only a score file
+    keeps them.
+    \param set query set
+*/
+void
+result_sink::query_names(sdbf_set *set) {
+    if (format != RESULT_BINARY)
+        return;
+    for (uint32_t n = 0; n < set->size(); n++)
+        queries.push_back(set->at(n)->name());
+}
+
+/**
+    Takes the names of a target set, by position.  Results that follow
+    have target ids counted on from the sets named before, so a target
+    compared a batch at a time numbers its digests as one set.  Without
+    target names, the targets of a score file are the queries, as when a
+    set is compared to itself.
+    \param set target set
+*/
+void
+result_sink::target_names(sdbf_set *set) {
+    if (format != RESULT_BINARY)
+        return;
+    target_base = targets.size();
+    for (uint32_t n = 0; n < set->size(); n++)
+        targets.push_back(set->at(n)->name());
+}
+
+/**
+    Writes what is waiting to the file, timed as output for --stats.
+    \returns 0 if successful or there is no file, -1 if this or an
+            earlier write failed
+*/
+int
+result_sink::flush() {
+    if (file == NULL || out.empty())
+        return failed ? -1 : 0;
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
+    size_t wrote = fwrite(out.data(), 1, out.size(), file);
+    if (wrote != out.size() || fflush(file))
+        failed = true;
+    out.clear();
+    flushed = time(NULL);
+    stats_lap(stats, STAT_OUTPUT, &since);
+    return failed ? -1 : 0;
+}
+
+/**
+    Ends the output.  A score file gets its name tables and footer; no
+    results may be added after.  Called by the destructor if need be.
+    \returns 0 if successful, -1 if the file cannot be written
+*/
+int
+result_sink::finish() {
+    if (finished)
+        return failed ? -1 : 0;
+    finished = true;
+    if (format == RESULT_BINARY) {
+        result_footer_t footer;
+        memset(&footer, 0, sizeof(footer));
+        footer.record_count = added;
+        footer.names_offset = 8 + added*RESULT_RECORD_SIZE;
+        footer.query_count = queries.size();
+        footer.target_count = targets.size();
+        footer.version = RESULTS_VERSION;
+        memcpy(footer.magic, MAGIC_RESULTS, 8);
+        for (int table = 0; table < 2; table++) {
+            std::vector<std::string> &names = table ? targets : queries;
+            for (uint32_t n = 0; n < names.size(); n++) {
+                append_u32(out, names[n].size());
+                out += names[n];
+                if (file != NULL && out.size() >= RESULT_FLUSH_SIZE)
+                    flush();
+            }
+        }
+        out.append((const char*)&footer, sizeof(footer));
+    }
+    return flush();
+}
+
+std::string
+result_sink::take() {
+    std::string taken;
+    taken.swap(out);
+    return taken;
+}
+
+uint64_t
+result_sink::count() const {
+    return added;
+}
+
+// reads count names from in
+static int
+read_names(FILE *in, uint32_t count, std::vector<std::string> &names) {
+    uint8_t len[4];
+    for (uint32_t n = 0; n < count; n++) {
+        if (fread(len, 1, 4, in) != 4)
+            return -1;
+        std::string name(get_u32(len), '\0');
+        if (name.size() && fread(&name[0], 1, name.size(), in) != name.size())
+            return -1;
+        names.push_back(name);
+    }
+    return 0;
+}
+
+/**
+    Writes the results in a score file out in the classic text format,
+    or as JSON, a buffer of records at a time.
+    \param fname score file
+    \param out file to write to
+    \param format RESULT_TEXT or RESULT_JSON
+    \returns 0 if successful, -1 if fname is not a readable score file,
+            -2 if it is damaged, -3 if out cannot be written
+*/
+int
+result_sink::convert(const char *fname, FILE *out, uint32_t format) {
+    FILE *in = fopen(fname, "rb");
+    if (in == NULL)
+        return -1;
+    result_footer_t footer;
+    char magic[8];
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, MAGIC_RESULTS, 8) ||
+        fseeko(in, -(off_t)sizeof(footer), SEEK_END) ||
+        fread(&footer, sizeof(footer), 1, in) != 1 ||
+        memcmp(footer.magic, MAGIC_RESULTS, 8) || footer.version != RESULTS_VERSION) {
+        fclose(in);
+        return -1;
+    }
+    std::vector<std::string> queries, targets;
+    if (fseeko(in, footer.names_offset, SEEK_SET) ||
+        read_names(in, footer.query_count, queries) ||
+        read_names(in, footer.target_count, targets) ||
+        fseeko(in, 8, SEEK_SET)) {
+        fclose(in);
+        return -2;
+    }
+    const std::vector<std::string> &target_table = footer.target_count ? targets : queries;
+    result_sink sink(format, out);
+    // whole records at a time
+    std::vector<uint8_t> buf((RESULT_FLUSH_SIZE / RESULT_RECORD_SIZE) * RESULT_RECORD_SIZE);
+    uint64_t left = footer.record_count;
+    int status = 0;
+    while (left > 0 && status == 0) {
+        uint64_t count = buf.size() / RESULT_RECORD_SIZE;
+        if (count > left)
+            count = left;
+        if (fread(&buf[0], RESULT_RECORD_SIZE, count, in) != count) {
+            status = -2;
+            break;
+        }
+        for (uint64_t r = 0; r < count; r++) {
+            const uint8_t *rec = &buf[r*RESULT_RECORD_SIZE];
+            uint32_t query_id = get_u32(rec), target_id = get_u32(rec + 4);
+            int32_t score = rec[8] == 0xff ? -1 : rec[8];
+            if (query_id >= queries.size() || target_id >= target_table.size()) {
+                status = -2;
+                break;
+            }
+            sink.add_named(queries[query_id].c_str(), target_table[target_id].c_str(), query_id, target_id, score);
+        }
+        left -= count;
+    }
+    fclose(in);
+    if (sink.finish())
+        return -3;
+    return status;
+}
@@ -0,0 +1,116 @@
+// Header file for result_sink: where comparison results go
+//
+#ifndef _RESULT_SINK_H
+#define _RESULT_SINK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+// result formats
+#define RESULT_TEXT    0   // query|target|score lines
+#define RESULT_JSON    1   // one JSON object per line
+#define RESULT_BINARY  2   // score file: records of set positions, then names
+
+#define MAGIC_RESULTS   "SDBFRES1"
+#define RESULTS_VERSION 1
+
+// a sink with a file writes once this much is waiting
+#define RESULT_FLUSH_SIZE (1024*1024)
+// or once results have been waiting this long
+#define RESULT_FLUSH_SECONDS 1
+// bytes of a binary record: query id, target id, score
+#define RESULT_RECORD_SIZE 9
+
+// One comparison result
+typedef struct {
+    class sdbf *query;     // query digest
+    class sdbf *target;    // target digest
+    uint32_t query_id;     // position of query in its set
+    uint32_t target_id;    // position of target in its set
+    int32_t  score;        // 0-100, or -1 if the pair could not be scored
+} compare_result_t;
+
+/// receives comparison results: called in output order, one call at a time
+typedef void (*result_fn)(const compare_result_t *result, void *context);
+
+// Score file trailer, the last bytes of the file
+typedef struct {
+    uint64_t  record_count;   // records after the magic
+    uint64_t  names_offset;   // file offset of the name tables
+    uint32_t  query_count;    // query names
+    uint32_t  target_count;   // target names, 0 if targets are the queries
+    uint32_t  version;
+    uint32_t  reserved;
+    char      magic[8];
+} result_footer_t;
+
+/**
+    result_sink: formats comparison results as they are produced, into a
+    string or out to a file, so a long comparison need not hold all of
+    its output.  Pass result_sink::emit and the sink to the sdbf_set
+    compares.  Text is the classic query|target|score line; JSON is one
+    object per line with the names and score.
+
+    Binary is a score file, which names each digest once rather than on
+    every line: the magic, then a record of RESULT_RECORD_SIZE bytes per
+    result -- the query and target positions as little-endian uint32 and
+    the score as a byte, 255 for -1 -- then the query and target name
+    tables, each name a little-endian uint32 length and its bytes, then
+    a result_footer_t.  Names come from the sets given to query_names()
+    and target_names(), and are written by finish(), so results can be
+    streamed out before the last target set is known.  convert() turns a
+    score file back into text or JSON.
+*/
+/// result_sink class
+class result_sink {
+
+public:
+    /// sink formatting into a string, taken with take()
+    result_sink(uint32_t format);
+    /// sink writing to an open file whenever enough is waiting
+    result_sink(uint32_t format, FILE *file);
+    /// destructor, flushes to the file
+    ~result_sink();
+
+    /// format one result
+    void add(const compare_result_t *result);
+    /// result_fn for the sdbf_set compares: context is a result_sink
+    static void emit(const compare_result_t *result, void *context);
+
+    /// names of the query set, for a score file
+    void query_names(class sdbf_set *set);
+    /// names of a target set, for a score file; its ids follow the last target set's
+    void target_names(class sdbf_set *set);
+
+    /// write what is waiting to the file; 0, or -1 if it cannot be written
+    int flush();
+    /// end the output: a score file's names and footer, then flush
+    int finish();
+    /// what has been formatted, for a sink without a file; leaves it empty
+    std::string take();
+    /// results added
+    uint64_t count() const;
+
+    /// write a score file out as text or JSON
+    static int convert(const char *fname, FILE *out, uint32_t format);
+
+private:
+    void add_named(const char *query, const char *target, uint32_t query_id, uint32_t target_id, int32_t score);
+
+    uint32_t format;
+    FILE *file;
+    std::string out;
+    uint64_t added;
+    time_t flushed;       // when the file was last written
+    bool finished;
+    bool failed;          // a write to the file failed
+    // score file name tables; target ids of results are offset by target_base
+    std::vector<std::string> queries;
+    std::vector<std::string> targets;
+    uint32_t target_base;
+};
+
+#endif
@@ -0,0 +1,400 @@
+// sdbf_archive.cc
+// compressed, seekable container for sdbfs
+
+#include "sdbf_archive.h"
+#include "sdbf_defines.h"
+
+#include <unistd.h>
+#include <boost/thread/thread.hpp>
+
+#include "../lz4/lz4.h"
+
+/**
+    Creates an archive object, not yet attached to a file.
+*/
+sdbf_archive::sdbf_archive() {
+    file = NULL;
+    writing = false;
+    frame_digests = ARCHIVE_FRAME_DIGESTS;
+    digest_count = 0;
+    offset = 0;
+    frame_fill = 0;
+}
+
+/**
+    Closes archive, finishing it if it is being written.
+*/
+sdbf_archive::~sdbf_archive() {
+    close();
+}
+
+/**
+    Opens an existing archive and reads its frame index.
+    \param fname archive file name
+    \returns 0 if successful, -1 if cannot open, -2 if format invalid
+*/
+int
+sdbf_archive::open(const char *fname) {
+    archive_footer_t footer;
+    file = fopen(fname, "rb");
+    if (file == NULL)
+        return -1;
+    writing = false;
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, MAGIC_ARCHIVE, 8) ||
+        fseeko(file, -(off_t)sizeof(footer), SEEK_END) ||
+        fread(&footer, sizeof(footer), 1, file) != 1 ||
+        memcmp(footer.magic, MAGIC_ARCHIVE, 8) || footer.version != ARCHIVE_VERSION) {
+        close();
+        return -2;
+    }
+    // the index lies between the frames and the footer: a damaged footer
+    // must not size it past the file
+    off_t file_size = ftello(file);
+    if (footer.index_offset < 8 || footer.index_offset > (uint64_t)file_size ||
+        footer.frame_count > ((uint64_t)file_size - footer.index_offset) / sizeof(archive_frame_t)) {
+        close();
+        return -2;
+    }
+    index.resize(footer.frame_count);
+    if (footer.frame_count > 0 && (fseeko(file, footer.index_offset, SEEK_SET) ||
+        fread(&index[0], sizeof(archive_frame_t), footer.frame_count, file) != footer.frame_count)) {
+        close();
+        return -2;
+    }
+    digest_count = footer.digest_count;
+    frame_digests = footer.frame_digests;
+    return 0;
+}
+
+/**
+    Creates a new archive for writing with append().
+    \param fname archive file name
+    \param frame_digests number of digests per compressed frame
+    \returns 0 if successful, -2 if cannot open file
+*/
+int
+sdbf_archive::create(const char *fname, uint32_t frame_digests) {
+    file = fopen(fname, "wb");
+    if (file == NULL)
+        return -2;
+    writing = true;
+    this->frame_digests = frame_digests ? frame_digests : ARCHIVE_FRAME_DIGESTS;
+    digest_count = 0;
+    frame_fill = 0;
+    frame.clear();
+    index.clear();
+    if (fwrite(MAGIC_ARCHIVE, 1, 8, file) != 8)
+        return -2;
+    offset = 8;
+    return 0;
+}
+
+/**
+    Adds one sdbf to the archive being written.
+    \param hash sdbf to add
+    \returns 0 if successful, -1 if compression fails, -2 if cannot write
+*/
+int
+sdbf_archive::append(const sdbf *hash) {
+    hash->encode_binary(frame);
+    frame_fill++;
+    digest_count++;
+    if (frame_fill >= frame_digests || frame.size() >= ARCHIVE_FRAME_MAX)
+        return flush_frame();
+    return 0;
+}
+
+/**
+   \internal
+   Compresses and writes the current frame, recording it in the index.
+*/
+int
+sdbf_archive::flush_frame() {
+    if (frame_fill == 0)
+        return 0;
+    archive_frame_t entry;
+    char *dest = (char*)alloc_check(ALLOC_ONLY, LZ4_compressBound(frame.size()), "flush_frame", "dest", ERROR_EXIT);
+    int res = LZ4_compress_limitedOutput(frame.data(), dest, frame.size(), LZ4_compressBound(frame.size()));
+    if (res == 0) {
+        free(dest);
+        return -1;
+    }
+    entry.offset = offset;
+    entry.first_digest = digest_count - frame_fill;
+    entry.comp_size = res;
+    entry.raw_size = frame.size();
+    entry.digest_count = frame_fill;
+    entry.reserved = 0;
+    if (fwrite(dest, 1, res, file) != (size_t)res) {
+        free(dest);
+        return -2;
+    }
+    free(dest);
+    offset += res;
+    index.push_back(entry);
+    frame.clear();
+    frame_fill = 0;
+    return 0;
+}
+
+/**
+    Finishes archive: writes the last frame, the frame index, and footer.
+    For archives open for reading, just closes the file.
+    \returns 0 if successful, -1 if compression fails, -2 if cannot write
+*/
+int
+sdbf_archive::close() {
+    int status = 0;
+    if (file == NULL)
+        return 0;
+    if (writing) {
+        status = flush_frame();
+        archive_footer_t footer;
+        footer.index_offset = offset;
+        footer.frame_count = index.size();
+        footer.digest_count = digest_count;
+        footer.frame_digests = frame_digests;
+        footer.version = ARCHIVE_VERSION;
+        memcpy(footer.magic, MAGIC_ARCHIVE, 8);
+        if (index.size() > 0 && fwrite(&index[0], sizeof(archive_frame_t), index.size(), file) != index.size())
+            status = -2;
+        if (fwrite(&footer, sizeof(footer), 1, file) != 1)
+            status = -2;
+        writing = false;
+    }
+    fclose(file);
+    file = NULL;
+    return status;
+}
+
+/**
+    Number of digests in archive
+    \returns uint64_t digest count
+*/
+uint64_t
+sdbf_archive::size() {
+    return digest_count;
+}
+
+/**
+    Number of frames in archive
+    \returns uint64_t frame count
+*/
+uint64_t
+sdbf_archive::frame_count() {
+    return index.size();
+}
+
+/**
+   \internal
+   Reads and decompresses one frame.  Safe to call from several threads.
+   \returns 0 if successful, -2 if read or decompression fails
+*/
+int
+sdbf_archive::read_frame(uint64_t frame, std::string &raw) {
+    archive_frame_t *entry = &index[frame];
+    char *comp = (char*)alloc_check(ALLOC_ONLY, entry->comp_size, "read_frame", "comp", ERROR_EXIT);
+    if (pread(fileno(file), comp, entry->comp_size, entry->offset) != (ssize_t)entry->comp_size) {
+        free(comp);
+        return -2;
+    }
+    raw.resize(entry->raw_size);
+    int res = LZ4_uncompress_unknownOutputSize(comp, &raw[0], entry->comp_size, entry->raw_size);
+    free(comp);
+    if (res != (int)entry->raw_size)
+        return -2;
+    return 0;
+}
+
+/**
+    Reads a single digest, decompressing only the frame holding it.
+    \param pos position 0 to size()
+    \returns new sdbf (owned by caller), or NULL if not valid
+*/
+class sdbf*
+sdbf_archive::at(uint64_t pos) {
+    if (file == NULL || writing || pos >= digest_count)
+        return NULL;
+    // find frame: last one starting at or before pos
+    uint64_t lo = 0, hi = index.size();
+    while (hi - lo > 1) {
+        uint64_t mid = (lo + hi) / 2;
+        if (index[mid].first_digest <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    std::string raw;
+    if (read_frame(lo, raw))
+        return NULL;
+    uint64_t skip = pos - index[lo].first_digest;
+    uint64_t at = 0;
+    sdbf_record_t rec;
+    for (uint64_t i = 0; i < skip; i++) {
+        if (at + sizeof(rec) > raw.size())
+            return NULL;
+        memcpy(&rec, raw.data() + at, sizeof(rec));
+        // a damaged length would land on the wrong digest, or loop
+        if (rec.record_len < sizeof(rec) || rec.record_len > raw.size() - at)
+            return NULL;
+        at += rec.record_len;
+    }
+    uint64_t used;
+    sdbf *hash = new sdbf();
+    if (at >= raw.size() || !hash->load_binary((uint8_t*)raw.data() + at, raw.size() - at, &used)) {
+        delete hash;
+        return NULL;
+    }
+    return hash;
+}
+
+/**
+    Decompresses one frame and decodes its digests.  Frames may be read
+    by several threads at once.
+    \param frame frame number
+    \param out digests, in archive order, are appended here
+    \returns 0 if successful, -1 if not open for reading, -2 if the frame
+            could not be read in full
+*/
+int
+sdbf_archive::load_frame(uint64_t frame, std::vector<sdbf*> &out) {
+    if (file == NULL || writing || frame >= index.size())
+        return -1;
+    std::string raw;
+    if (read_frame(frame, raw))
+        return -2;
+    uint64_t at = 0, used;
+    for (uint32_t i = 0; i < index[frame].digest_count; i++) {
+        sdbf *hash = new sdbf();
+        if (at >= raw.size() || !hash->load_binary((uint8_t*)raw.data() + at, raw.size() - at, &used)) {
+            delete hash;
+            return -2;
+        }
+        out.push_back(hash);
+        at += used;
+    }
+    return 0;
+}
+
+/**
+   \internal
+   Worker for parallel loading: decodes every tcount'th frame.
+*/
+void
+sdbf_archive::thread_load_frames(sdbf_archive *arc, uint32_t tid, uint32_t tcount, std::vector<std::vector<sdbf*> > *frames) {
+    for (uint64_t f = tid; f < arc->index.size(); f += tcount)
+        arc->load_frame(f, frames->at(f));
+}
+
+/**
+    Decompresses all frames in parallel and adds the digests, in archive
+    order, to a set.
+    \param addto set to add digests to
+    \param thread_cnt number of threads to use
+    \returns 0 if successful, -2 if some frames could not be read
+*/
+int
+sdbf_archive::load(sdbf_set *addto, uint32_t thread_cnt) {
+    if (file == NULL || writing)
+        return -1;
+    std::vector<std::vector<sdbf*> > frames(index.size());
+    if (thread_cnt < 1)
+        thread_cnt = 1;
+    if (thread_cnt > MAX_THREADS)
+        thread_cnt = MAX_THREADS;
+    if (thread_cnt == 1) {
+        thread_load_frames(this, 0, 1, &frames);
+    } else {
+        boost::thread_group pool;
+        for (uint32_t t = 0; t < thread_cnt; t++)
+            pool.create_thread(boost::bind(&sdbf_archive::thread_load_frames, this, t, thread_cnt, &frames));
+        pool.join_all();
+    }
+    uint64_t loaded = 0;
+    for (uint64_t f = 0; f < frames.size(); f++) {
+        for (uint64_t i = 0; i < frames[f].size(); i++)
+            addto->add(frames[f][i]);
+        loaded += frames[f].size();
+    }
+    return (loaded == digest_count) ? 0 : -2;
+}
+
+/**
+    Writes every sdbf in a set to a new archive.
+    \param set sdbf_set to write
+    \param fname archive file name
+    \param frame_digests digests per frame
+    \returns 0 if successful, -1 if compression fails, -2 if cannot write;
+            on failure no archive is left behind
+*/
+int
+sdbf_archive::write(sdbf_set *set, const char *fname, uint32_t frame_digests) {
+    sdbf_archive arc;
+    int status = arc.create(fname, frame_digests);
+    // a file that could not be opened is not ours to remove
+    bool opened = (arc.file != NULL);
+    for (uint64_t i = 0; status == 0 && i < set->size(); i++)
+        status = arc.append(set->at(i));
+    int closed = arc.close();
+    if ((status || closed) && opened)
+        unlink(fname);
+    return status ? status : closed;
+}
+
+/**
+    Converts a text sdbf file to an archive, one digest at a time.
+    \param sdbf_file text file of sdbfs
+    \param fname archive file name
+    \param frame_digests digests per frame
+    \returns 0 if successful, -1 if compression fails, -2 if cannot write,
+            -3 if input cannot be read or parsed; on failure no archive is
+            left behind
+*/
+int
+sdbf_archive::convert(const char *sdbf_file, const char *fname, uint32_t frame_digests) {
+    FILE *in = fopen(sdbf_file, "r");
+    if (in == NULL)
+        return -3;
+    sdbf_archive arc;
+    int status = arc.create(fname, frame_digests);
+    bool opened = (arc.file != NULL);
+    int bar = getc(in);
+    if (!feof(in))
+        ungetc(bar, in);
+    while (status == 0 && !feof(in)) {
+        try {
+            sdbf *hash = new sdbf(in);
+            status = arc.append(hash);
+            delete hash;
+        } catch (int e) {
+            status = -3;
+            break;
+        }
+        getc(in);
+        bar = getc(in);
+        if (!feof(in))
+            ungetc(bar, in);
+    }
+    fclose(in);
+    int closed = arc.close();
+    if ((status || closed) && opened)
+        unlink(fname);
+    return status ? status : closed;
+}
+
+/**
+    Checks whether a file starts with the archive magic.
+    \param fname file name
+    \returns true if file is an sdbf archive
+*/
+bool
+sdbf_archive::is_archive(const char *fname) {
+    char magic[8];
+    FILE *in = fopen(fname, "rb");
+    if (in == NULL)
+        return false;
+    bool found = (fread(magic, 1, 8, in) == 8 && !memcmp(magic, MAGIC_ARCHIVE, 8));
+    fclose(in);
+    return found;
+}
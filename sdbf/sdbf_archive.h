@@ -0,0 +1,97 @@
+// Header file for sdbf_archive object
+//
+#ifndef _SDBF_ARCHIVE_H
+#define _SDBF_ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "sdbf_class.h"
+#include "sdbf_set.h"
+
+#define MAGIC_ARCHIVE   "SDBFARC1"
+#define ARCHIVE_VERSION 1
+// default number of digests per compressed frame
+#define ARCHIVE_FRAME_DIGESTS 1024
+// frames are also closed when their raw size reaches this
+#define ARCHIVE_FRAME_MAX   (64*MB)
+
+// Frame index entry, stored at the end of the archive
+typedef struct {
+    uint64_t  offset;         // file offset of compressed frame
+    uint64_t  first_digest;   // ordinal of first digest in frame
+    uint32_t  comp_size;      // compressed size
+    uint32_t  raw_size;       // uncompressed size
+    uint32_t  digest_count;   // digests in frame
+    uint32_t  reserved;
+} archive_frame_t;
+
+// Archive trailer, the last bytes of the file
+typedef struct {
+    uint64_t  index_offset;   // file offset of frame index
+    uint64_t  frame_count;
+    uint64_t  digest_count;
+    uint32_t  frame_digests;  // digests per frame when written
+    uint32_t  version;
+    char      magic[8];
+} archive_footer_t;
+
+/**
+    sdbf_archive: compressed, seekable container for sdbfs.  Digests are
+    stored as binary records in independently LZ4-compressed frames of
+    N digests, with a frame index at the end of the file.
+*/
+/// sdbf_archive class
+class sdbf_archive {
+
+public:
+    /// creates closed archive
+    sdbf_archive();
+    /// destructor, closes archive
+    ~sdbf_archive();
+
+    /// open existing archive for reading
+    int open(const char *fname);
+    /// create new archive for writing
+    int create(const char *fname, uint32_t frame_digests);
+    /// append one sdbf to archive being written
+    int append(const sdbf *hash);
+    /// finish writing (index, footer) or reading
+    int close();
+
+    /// number of digests in archive
+    uint64_t size();
+    /// number of compressed frames in archive
+    uint64_t frame_count();
+    /// read one digest by position
+    class sdbf *at(uint64_t pos);
+    /// decompress one frame, appending its digests to out
+    int load_frame(uint64_t frame, std::vector<class sdbf*> &out);
+    /// decompress all frames, using thread_cnt threads, and add to set
+    int load(sdbf_set *addto, uint32_t thread_cnt);
+
+    /// write a whole set out as an archive
+    static int write(sdbf_set *set, const char *fname, uint32_t frame_digests);
+    /// convert a text sdbf file to an archive
+    static int convert(const char *sdbf_file, const char *fname, uint32_t frame_digests);
+    /// check for archive magic
+    static bool is_archive(const char *fname);
+
+private:
+    int flush_frame();
+    int read_frame(uint64_t frame, std::string &raw);
+    static void thread_load_frames(sdbf_archive *arc, uint32_t tid, uint32_t tcount, std::vector<std::vector<sdbf*> > *frames);
+
+    FILE *file;
+    bool writing;
+    uint32_t frame_digests;
+    uint64_t digest_count;
+    uint64_t offset;          // write position
+    std::string frame;        // frame being written
+    uint32_t frame_fill;      // digests in frame being written
+    std::vector<archive_frame_t> index;
+};
+
+#endif
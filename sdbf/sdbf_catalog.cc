@@ -0,0 +1,407 @@
+// sdbf_catalog.cc
+// append-only sdbf sets with an on-disk catalog
+
+#include "sdbf_class.h"
+#include "sdbf_defines.h"
+#include "sdbf_catalog.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace fs = boost::filesystem;
+using namespace std;
+
+/**
+    Creates catalog object.  Nothing is read until open().
+    \param fname catalog file name.  Segments are written next to it,
+                 named after it without its extension.
+*/
+sdbf_catalog::sdbf_catalog(const char *fname) {
+    this->fname = fname;
+    fs::path p(fname);
+    dirname = p.parent_path().string();
+    basename = p.stem().string();
+    next_id = 0;
+    lock_fd = -1;
+}
+
+sdbf_catalog::~sdbf_catalog() {
+    unlock();
+}
+
+/**
+    Reads the catalog file.
+    \param create create an empty catalog if none exists
+    \returns 0 if successful, -1 if cannot open or create, -2 if format invalid
+*/
+int
+sdbf_catalog::open(bool create) {
+    segments.clear();
+    removed.clear();
+    next_id = 0;
+    ifstream in(fname.c_str());
+    if (!in.is_open()) {
+        if (!create)
+            return -1;
+        return append_line(string(MAGIC_CATALOG) + ":" + boost::lexical_cast<string>(CATALOG_VERSION));
+    }
+    string line;
+    if (!getline(in, line) || line != string(MAGIC_CATALOG) + ":" + boost::lexical_cast<string>(CATALOG_VERSION))
+        return -2;
+    while (getline(in, line)) {
+        if (line.empty())
+            continue;
+        if (parse_line(line))
+            return -2;
+    }
+    return 0;
+}
+
+/**
+   \internal
+   Parses one seg: or del: line.
+   \returns 0 if successful, -2 if line is invalid
+*/
+int
+sdbf_catalog::parse_line(const string &line) {
+    if (!line.compare(0, 4, "seg:")) {
+        catalog_segment_t seg;
+        unsigned long long count;
+        char sdbf_file[FILENAME_MAX+1], idx_file[FILENAME_MAX+1];
+        idx_file[0] = 0;
+        if (sscanf(line.c_str(), "seg:%u:%llu:%[^:]:%[^\n]", &seg.id, &count, sdbf_file, idx_file) < 3)
+            return -2;
+        seg.digest_count = count;
+        seg.sdbf_file = sdbf_file;
+        seg.idx_file = idx_file;
+        segments.push_back(seg);
+        if (seg.id >= next_id)
+            next_id = seg.id + 1;
+    } else if (!line.compare(0, 4, "del:")) {
+        uint32_t name_len;
+        int pos;
+        if (sscanf(line.c_str(), "del:%u:%n", &name_len, &pos) < 1 || pos + name_len != line.size())
+            return -2;
+        removed[line.substr(pos)] = segments.size();
+    } else {
+        return -2;
+    }
+    return 0;
+}
+
+/**
+   \internal
+   Appends a single line to the catalog file and syncs it.
+   \returns 0 if successful, -1 if cannot write
+*/
+int
+sdbf_catalog::append_line(const string &line) {
+    FILE *out = fopen(fname.c_str(), "a");
+    if (out == NULL)
+        return -1;
+    int status = 0;
+    if (fprintf(out, "%s\n", line.c_str()) < 0 || fflush(out) || fsync(fileno(out)))
+        status = -1;
+    fclose(out);
+    return status;
+}
+
+/**
+   \internal
+   Takes the catalog's lock file, so that only one process appends or
+   compacts at a time.  Readers share it, so that segments are not
+   deleted while they are read.
+   \param shared take a reader's lock
+*/
+int
+sdbf_catalog::lock(bool shared) {
+    if (lock_fd >= 0)
+        return 0;
+    lock_fd = ::open((fname + ".lock").c_str(), O_CREAT | O_RDWR, 0644);
+    if (lock_fd < 0 && shared)
+        lock_fd = ::open((fname + ".lock").c_str(), O_RDONLY);
+    if (lock_fd < 0)
+        return -1;
+    if (flock(lock_fd, shared ? LOCK_SH : LOCK_EX)) {
+        ::close(lock_fd);
+        lock_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void
+sdbf_catalog::unlock() {
+    if (lock_fd < 0)
+        return;
+    flock(lock_fd, LOCK_UN);
+    ::close(lock_fd);
+    lock_fd = -1;
+}
+
+string
+sdbf_catalog::path_of(const string &file) {
+    if (dirname.empty())
+        return file;
+    return dirname + "/" + file;
+}
+
+string
+sdbf_catalog::segment_line(const catalog_segment_t &seg) {
+    return "seg:" + boost::lexical_cast<string>(seg.id) + ":" +
+        boost::lexical_cast<string>(seg.digest_count) + ":" + seg.sdbf_file + ":" + seg.idx_file;
+}
+
+/**
+   \internal
+   Writes a set, and optionally its index, as segment files.
+   \returns 0 if successful, -1 if cannot write
+*/
+static int
+write_segment(sdbf_set *set, bloom_filter *index, const string &sdbf_path, const string &idx_path) {
+    std::filebuf fb;
+    fb.open(sdbf_path.c_str(), ios::out|ios::binary);
+    if (!fb.is_open())
+        return -1;
+    std::ostream os(&fb);
+    os << set;
+    fb.close();
+    if (index != NULL) {
+        index->set_name(fs::path(sdbf_path).filename().string());
+        if (index->write_out(idx_path))
+            return -1;
+    }
+    return 0;
+}
+
+/**
+    Writes a set as a new segment and records it in the catalog.  Only
+    the new segment and one catalog line are written.
+    \param set sdbfs to append
+    \param index index of set, or NULL
+    \returns 0 if successful, -1 if cannot write, -2 if catalog invalid
+*/
+int
+sdbf_catalog::append(sdbf_set *set, bloom_filter *index) {
+    if (lock())
+        return -1;
+    // re-read under lock, another process may have appended
+    int status = open(true);
+    if (status) {
+        unlock();
+        return status;
+    }
+    catalog_segment_t seg;
+    seg.id = next_id;
+    seg.digest_count = set->size();
+    seg.sdbf_file = basename + "." + boost::lexical_cast<string>(seg.id) + ".sdbf";
+    if (index != NULL)
+        seg.idx_file = seg.sdbf_file + ".idx";
+    status = write_segment(set, index, path_of(seg.sdbf_file), path_of(seg.idx_file));
+    if (!status)
+        status = append_line(segment_line(seg));
+    if (!status) {
+        segments.push_back(seg);
+        next_id++;
+    }
+    unlock();
+    return status;
+}
+
+/**
+    Marks all digests of a given name in existing segments as removed.
+    \param name digest name
+    \returns 0 if successful, -1 if cannot write
+*/
+int
+sdbf_catalog::remove(const string &name) {
+    if (lock())
+        return -1;
+    int status = open(true);
+    if (!status)
+        status = append_line("del:" + boost::lexical_cast<string>(name.length()) + ":" + name);
+    if (!status)
+        removed[name] = segments.size();
+    unlock();
+    return status;
+}
+
+/**
+   \internal
+   Reads digests of one segment, dropping removed ones.
+*/
+static int
+load_segment(const string &path, uint32_t position, std::map<string,uint32_t> &removed, sdbf_set *addto) {
+    FILE *in = fopen(path.c_str(), "r");
+    if (in == NULL)
+        return -1;
+    int status = 0;
+    int bar = getc(in);
+    if (!feof(in))
+        ungetc(bar, in);
+    while (!feof(in)) {
+        try {
+            class sdbf *hash = new sdbf(in);
+            std::map<string,uint32_t>::iterator it = removed.find(hash->name());
+            if (it != removed.end() && it->second > position)
+                delete hash;
+            else
+                addto->add(hash);
+        } catch (int e) {
+            status = -2;
+            break;
+        }
+        getc(in);
+        bar = getc(in);
+        if (!feof(in))
+            ungetc(bar, in);
+    }
+    fclose(in);
+    return status;
+}
+
+/**
+    Adds all digests not removed to a set, in segment order.  Unless the
+    caller already holds the lock, the catalog is locked shared and read
+    again first, since a compact() since open() may have replaced its
+    segments.  If the lock file cannot be made, as on read-only media,
+    the catalog is read as open() left it.
+    \param addto set to add to
+    \returns 0 if successful, -1 if a segment is missing, -2 if invalid
+*/
+int
+sdbf_catalog::load(sdbf_set *addto) {
+    bool locked = lock_fd < 0 && lock(true) == 0;
+    int status = locked ? open(false) : 0;
+    for (uint32_t i = 0; !status && i < segments.size(); i++)
+        status = load_segment(path_of(segments[i].sdbf_file), i, removed, addto);
+    if (locked)
+        unlock();
+    return status;
+}
+
+/**
+    Merges all segments into one, dropping removed digests, and merges the
+    segment indexes if every segment has a compatible one: segment indexes
+    of a size are ORed together while they stay under index_fp, and the
+    rest become further partitions of the merged index.  The new catalog
+    replaces the old with a rename, so readers see either the old or new
+    segments, never a mix; old segment files are then deleted.
+    \param index_fp false positive rate indexes were sized for
+    \returns 0 if successful, -1 if cannot write, -2 if catalog invalid
+*/
+int
+sdbf_catalog::compact(double index_fp) {
+    if (lock())
+        return -1;
+    int status = open(false);
+    if (status || (segments.size() < 2 && removed.empty())) {
+        unlock();
+        return status;
+    }
+    sdbf_set *merged = new sdbf_set();
+    status = load(merged);
+    bloom_filter *index = NULL;
+    for (uint32_t i = 0; !status && i < segments.size(); i++) {
+        if (segments[i].idx_file.empty() || !fs::is_regular_file(path_of(segments[i].idx_file))) {
+            delete index;
+            index = NULL;
+            break;
+        }
+        bloom_filter *part = new bloom_filter(path_of(segments[i].idx_file));
+        if (index == NULL) {
+            index = part;
+        } else {
+            int res = index->merge(part, index_fp);
+            delete part;
+            if (res) {
+                delete index;
+                index = NULL;
+                break;
+            }
+        }
+    }
+    // features in more than one segment were counted by each
+    if (index != NULL)
+        index->recount();
+    catalog_segment_t seg;
+    seg.id = next_id;
+    seg.digest_count = merged->size();
+    seg.sdbf_file = basename + "." + boost::lexical_cast<string>(seg.id) + ".sdbf";
+    if (index != NULL)
+        seg.idx_file = seg.sdbf_file + ".idx";
+    if (!status)
+        status = write_segment(merged, index, path_of(seg.sdbf_file), path_of(seg.idx_file));
+    string tmpname = fname + ".tmp";
+    if (!status) {
+        FILE *out = fopen(tmpname.c_str(), "w");
+        if (out == NULL ||
+            fprintf(out, "%s:%d\n%s\n", MAGIC_CATALOG, CATALOG_VERSION, segment_line(seg).c_str()) < 0 ||
+            fflush(out) || fsync(fileno(out)))
+            status = -1;
+        if (out != NULL)
+            fclose(out);
+    }
+    if (!status && rename(tmpname.c_str(), fname.c_str()))
+        status = -1;
+    if (!status) {
+        for (uint32_t i = 0; i < segments.size(); i++) {
+            unlink(path_of(segments[i].sdbf_file).c_str());
+            if (!segments[i].idx_file.empty())
+                unlink(path_of(segments[i].idx_file).c_str());
+        }
+        segments.clear();
+        segments.push_back(seg);
+        removed.clear();
+        next_id++;
+    }
+    for (uint64_t n = 0; n < merged->size(); n++)
+        delete merged->at(n);
+    delete merged;
+    delete index;
+    unlock();
+    return status;
+}
+
+uint32_t
+sdbf_catalog::segment_count() {
+    return segments.size();
+}
+
+uint64_t
+sdbf_catalog::digest_count() {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < segments.size(); i++)
+        count += segments[i].digest_count;
+    return count;
+}
+
+uint64_t
+sdbf_catalog::removed_count() {
+    return removed.size();
+}
+
+/**
+    Checks whether a file starts with the catalog magic.
+    \param fname file name
+    \returns true if file is an sdbf catalog
+*/
+bool
+sdbf_catalog::is_catalog(const char *fname) {
+    char magic[sizeof(MAGIC_CATALOG)];
+    FILE *in = fopen(fname, "r");
+    if (in == NULL)
+        return false;
+    bool found = (fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+        !memcmp(magic, MAGIC_CATALOG ":", sizeof(magic)));
+    fclose(in);
+    return found;
+}
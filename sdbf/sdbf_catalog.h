@@ -0,0 +1,90 @@
+// Header file for sdbf_catalog object
+//
+#ifndef _SDBF_CATALOG_H
+#define _SDBF_CATALOG_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sdbf_set.h"
+#include "bloom_filter.h"
+
+#define MAGIC_CATALOG   "sdbf-cat"
+#define CATALOG_VERSION 1
+
+// One appended segment of a catalog set
+typedef struct {
+    uint32_t    id;           // segment number
+    uint64_t    digest_count; // digests written to segment
+    std::string sdbf_file;    // segment sdbf file, relative to catalog
+    std::string idx_file;     // segment index, or empty
+} catalog_segment_t;
+
+/**
+    sdbf_catalog: append-only sdbf set stored as a series of segment files.
+    The catalog file is a line-oriented log of segments (with their .idx
+    files) and tombstones for removed digests.  New digests are written as
+    a new segment plus one appended catalog line; compact() merges all
+    segments, and their indexes, into one and rewrites the catalog,
+    replacing it atomically.
+    Writers hold the catalog's lock file exclusively; load() holds it
+    shared, so it never sees compact() delete segments from under it.
+
+    Catalog lines:
+      sdbf-cat:<version>
+      seg:<id>:<digest count>:<sdbf file>:<idx file>
+      del:<name length>:<digest name>
+*/
+/// sdbf_catalog class
+class sdbf_catalog {
+
+public:
+    /// creates catalog object for file fname
+    sdbf_catalog(const char *fname);
+    /// destructor
+    ~sdbf_catalog();
+
+    /// read catalog file, creating it if requested and absent
+    int open(bool create);
+    /// write set (and optional index) as a new segment
+    int append(sdbf_set *set, bloom_filter *index);
+    /// mark a digest as removed
+    int remove(const std::string &name);
+    /// merge all segments into one, dropping removed digests
+    int compact(double index_fp=0.01);
+
+    /// add all live digests to a set
+    int load(sdbf_set *addto);
+
+    /// number of segments
+    uint32_t segment_count();
+    /// total digests written, including removed ones
+    uint64_t digest_count();
+    /// number of tombstones
+    uint64_t removed_count();
+
+    /// check for catalog magic
+    static bool is_catalog(const char *fname);
+
+private:
+    int parse_line(const std::string &line);
+    int append_line(const std::string &line);
+    int lock(bool shared=false);
+    void unlock();
+    std::string path_of(const std::string &file);
+    std::string segment_line(const catalog_segment_t &seg);
+
+    std::string fname;
+    std::string dirname;     // directory holding catalog and segments
+    std::string basename;    // segment file name prefix
+    std::vector<catalog_segment_t> segments;
+    // removed digest name -> number of segments it applies to (those
+    // appended before the tombstone)
+    std::map<std::string,uint32_t> removed;
+    uint32_t next_id;
+    int lock_fd;
+};
+
+#endif
@@ -4,13 +4,16 @@
 
 #include "sdbf_class.h"
 #include "sdbf_defines.h"
+#include "../base64/modp_b64.h"
 
 #define SDBF_VERSION 3 
 
 #include <stdint.h>
 #include <stdio.h>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <map>
 #include <sstream>
 #include <string>
 #include <iomanip>
@@ -105,21 +108,33 @@ sdbf::sdbf(const char *filename, uint32_t dd_block_size) {
 
 /**
     Generates a new sdbf, with a maximum size read from an open stream.
-    dd_block_size enables block mode.
+    dd_block_size enables block mode.  In block mode the data can be read
+    and hashed a window at a time, to bound memory: blocks are hashed
+    independently, so the digest is the same.
     \param name name of stream
     \param ifs open istream to read raw data from
     \param dd_block_size size of block to divide data with. 0 is off.
     \param msize amount of data to read and process
     \param info block of information about indexes
+    \param threads threads to hash blocks with, 0 for the configured count
+    \param window in block mode, bytes to hold at once, rounded down to
+           whole blocks; 0 to read all of msize at once
 */
-sdbf::sdbf(const char *name, std::istream *ifs, uint32_t dd_block_size, uint64_t msize,index_info *info) { 
+sdbf::sdbf(const char *name, std::istream *ifs, uint32_t dd_block_size, uint64_t msize,index_info *info, uint32_t threads, uint64_t window) { 
     uint64_t chunk_size;
     uint8_t *bufferinput;    
 
-    bufferinput = (uint8_t*)alloc_check(ALLOC_ZERO, sizeof(uint8_t)*msize,"sdbf_hash_stream",
+    if (!dd_block_size || window < dd_block_size || window >= msize)
+        window = msize;
+    else
+        window -= window % dd_block_size;
+    bufferinput = (uint8_t*)alloc_check(ALLOC_ZERO, sizeof(uint8_t)*window,"sdbf_hash_stream",
         "buffer input", ERROR_EXIT);
-    ifs->read((char*)bufferinput,msize);
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
+    ifs->read((char*)bufferinput,window);
     chunk_size = ifs->gcount();
+    stats_lap(stats, STAT_READ, &since);
     if (chunk_size < MIN_FILE_SIZE) {
         free(bufferinput);
         throw -3; // too small
@@ -139,7 +154,25 @@ sdbf::sdbf(const char *name, std::istream *ifs, uint32_t dd_block_size, uint64_t
         this->dd_block_size = dd_block_size;
         this->buffer = (uint8_t *)alloc_check( ALLOC_ZERO, dd_block_cnt*config->bf_size, "sdbf_hash_dd", "this->buffer", ERROR_EXIT);
         this->elem_counts = (uint16_t *)alloc_check( ALLOC_ZERO, sizeof( uint16_t)*dd_block_cnt, "sdbf_hash_dd", "this->elem_counts", ERROR_EXIT);
-        gen_block_sdbf_mt( bufferinput, msize, dd_block_size, config->thread_cnt);
+        uint64_t done = 0;
+        for (;;) {
+            uint64_t len = std::min(window, msize - done);
+            gen_block_sdbf_mt( bufferinput, len, dd_block_size, threads ? threads : config->thread_cnt, done/dd_block_size);
+            done += len;
+            if (done >= msize)
+                break;
+            // a short read leaves zeros, as when read whole
+            len = std::min(window, msize - done);
+            if (stats)
+                since = sdbf_stats::now();
+            ifs->read((char*)bufferinput,len);
+            uint64_t got = ifs->gcount();
+            stats_lap(stats, STAT_READ, &since);
+            if (got < len)
+                memset(bufferinput+got, 0, len-got);
+            chunk_size += got;
+        }
+        this->orig_file_size=chunk_size;
     }
     compute_hamming();
     free(bufferinput);
@@ -399,6 +432,11 @@ sdbf::~sdbf() {
         free(hamming);
     if (elem_counts)
         free(elem_counts);
+    if (filter_ids) {
+        free(filter_ids);
+        free(uniq_ids);
+        free(uniq_index);
+    }
     if (filenamealloc)
 	free(hashname);
 } 
@@ -436,14 +474,39 @@ sdbf::input_size() {
     \param other sdbf* to compare to self
     \param map_on turns on a heat map
     \param sample sets the number of BFs to sample - 0 uses all
+    \param threads threads to score on, 0 for the configured count
     \returns int32_t confidence score
 */
 int32_t
-sdbf::compare( sdbf *other, uint32_t map_on, uint32_t sample) {
+sdbf::compare( sdbf *other, uint32_t map_on, uint32_t sample, uint32_t threads) {
     if (config->warnings)
         cerr << this->name() << " vs " << other->name() << endl;
 
-    return sdbf_score( this, other, map_on, sample);
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
+    int32_t score;
+    if (this->filters && this->filters == other->filters && !sample && map_on != FLAG_ON)
+        score = sdbf_score_dedup( this, other, NULL);
+    else
+        score = sdbf_score( this, other, map_on, sample, threads);
+    stats_lap(stats, STAT_COMPARE, &since);
+    return score;
+}
+
+/**
+    Compares this sdbf to another sharing its filter table.  Each distinct
+    pair of filters is scored once, using cache across calls.
+    \param other sdbf to compare to
+    \param cache filter pair score cache, one per thread
+    \returns int32_t score, same as compare() without sampling
+*/
+int32_t
+sdbf::compare( sdbf *other, score_cache *cache) {
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
+    int32_t score = sdbf_score_dedup( this, other, cache);
+    stats_lap(stats, STAT_COMPARE, &since);
+    return score;
 }
 
 /** 
@@ -468,42 +531,144 @@ ostream& operator<<(ostream& os, const sdbf *s) {
 */
 string
 sdbf::to_string () const { // write self to stream
-    std::stringstream hash;
+    string hash;
+    encode(hash);
+    return hash;
+}
+
+/**
+    Appends the encoded form of this sdbf to a string.  Used by writers
+    which batch many digests into one buffer, without a stringstream.
+    \param out string to append to
+*/
+void
+sdbf::encode(string &out) const {
+    char field[256];
+    size_t name_len = strlen((char*)this->hashname);
+    int len;
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
     // Stream version
     if( !this->elem_counts) {
-        hash.fill('0');
-        hash << MAGIC_STREAM << ":" << setw (2) << SDBF_VERSION << ":";    
-        hash << (int)strlen((char*)this->hashname) << ":" << this->hashname << ":" << this->orig_file_size << ":sha1:";    
-        hash << this->bf_size << ":" << this->hash_count<< ":" << hex << this->mask << ":" << dec;    
-        hash << this->max_elem << ":" << this->bf_count << ":" << this->last_count << ":";    
-        uint64_t qt = this->bf_count/6, rem = this->bf_count % 6;
-        uint64_t i, pos=0, b64_block = 6*this->bf_size;
-        for( i=0,pos=0; i<qt; i++,pos+=b64_block) {
-            char *b64 = b64encode( (char*)this->buffer + pos, b64_block);
-            hash << b64;
-            free( b64);
-        }
-        if( rem>0) {
-            char *b64 = b64encode( (char*)this->buffer + pos, rem*this->bf_size);
-            hash << b64;
-            free( b64);
+        uint64_t data_len = (uint64_t)this->bf_count*this->bf_size;
+        out.reserve( out.size() + name_len + modp_b64_encode_len(data_len) + 128);
+        len = snprintf( field, sizeof(field), "%s:%02d:%d:", MAGIC_STREAM, SDBF_VERSION, (int)name_len);
+        out.append( field, len);
+        out.append( (char*)this->hashname, name_len);
+        len = snprintf( field, sizeof(field), ":%llu:sha1:%u:%u:%x:%u:%u:%u:", (unsigned long long)this->orig_file_size,
+                        this->bf_size, this->hash_count, this->mask, this->max_elem, this->bf_count, this->last_count);
+        out.append( field, len);
+        string data;
+        const char *bfs = (char*)this->buffer;
+        if (this->filter_ids) {
+            for( uint32_t i=0; i<this->bf_count; i++)
+                data.append( (char*)filter_data(i), this->bf_size);
+            bfs = data.data();
         }
+        size_t pos = out.size();
+        out.resize( pos + modp_b64_encode_len(data_len));
+        len = modp_b64_encode( &out[pos], (char*)bfs, data_len);
+        out.resize( pos + len);
     } else { // block version
-        hash.fill('0');
-        hash << MAGIC_DD << ":" << setw (2) << SDBF_VERSION << ":";    
-        hash << (int)strlen((char*)this->hashname) << ":" << this->hashname << ":" << this->orig_file_size << ":sha1:";    
-        hash << this->bf_size << ":" << this->hash_count<< ":" << hex << this->mask << ":" << dec;    
-        hash << this->max_elem << ":" << this->bf_count << ":" << this->dd_block_size ;
-        int i;
-        for( i=0; i<this->bf_count; i++) {
-            char *b64 = b64encode( (char*)this->buffer+i*this->bf_size, this->bf_size);
-            hash << ":" << setw (2) << hex << this->elem_counts[i];
-            hash << ":" << b64;    
-            free(b64);
+        out.reserve( out.size() + name_len + this->bf_count*(modp_b64_encode_len(this->bf_size) + 4) + 128);
+        len = snprintf( field, sizeof(field), "%s:%02d:%d:", MAGIC_DD, SDBF_VERSION, (int)name_len);
+        out.append( field, len);
+        out.append( (char*)this->hashname, name_len);
+        len = snprintf( field, sizeof(field), ":%llu:sha1:%u:%u:%x:%u:%u:%u", (unsigned long long)this->orig_file_size,
+                        this->bf_size, this->hash_count, this->mask, this->max_elem, this->bf_count, this->dd_block_size);
+        out.append( field, len);
+        for( uint32_t i=0; i<this->bf_count; i++) {
+            len = snprintf( field, sizeof(field), ":%02x:", this->elem_counts[i]);
+            out.append( field, len);
+            size_t pos = out.size();
+            out.resize( pos + modp_b64_encode_len(this->bf_size));
+            len = modp_b64_encode( &out[pos], (char*)filter_data(i), this->bf_size);
+            out.resize( pos + len);
         }
     }
-    hash << endl;
-    return hash.str();
+    out.push_back('\n');
+    stats_lap(stats, STAT_ENCODE, &since);
+}
+
+/**
+    Appends the binary record form of this sdbf to a string, as stored
+    in sdbf archives.  Layout: record length, fixed header fields, name,
+    element counts (dd mode only) and the raw bloom filters.
+    \param out string to append to
+*/
+void
+sdbf::encode_binary(string &out) const {
+    uint32_t name_len = strlen((char*)this->hashname);
+    uint64_t data_len = (uint64_t)this->bf_count*this->bf_size;
+    uint32_t counts_len = this->elem_counts ? this->bf_count*sizeof(uint16_t) : 0;
+    sdbf_record_t rec;
+    rec.record_len = sizeof(rec) + name_len + counts_len + data_len;
+    rec.orig_file_size = this->orig_file_size;
+    rec.name_len = name_len;
+    rec.bf_size = this->bf_size;
+    rec.hash_count = this->hash_count;
+    rec.mask = this->mask;
+    rec.max_elem = this->max_elem;
+    rec.bf_count = this->bf_count;
+    rec.last_count = this->last_count;
+    rec.dd_block_size = this->elem_counts ? this->dd_block_size : 0;
+    out.reserve(out.size() + rec.record_len);
+    out.append((char*)&rec, sizeof(rec));
+    out.append((char*)this->hashname, name_len);
+    if (counts_len)
+        out.append((char*)this->elem_counts, counts_len);
+    if (this->filter_ids) {
+        for (uint32_t i = 0; i < this->bf_count; i++)
+            out.append((char*)filter_data(i), this->bf_size);
+    } else {
+        out.append((char*)this->buffer, data_len);
+    }
+}
+
+/**
+    Reads a binary sdbf record from memory, as written by encode_binary.
+    \param record start of record
+    \param length bytes available at record
+    \param used set to the length of the record consumed
+    \returns true if successfully loaded
+*/
+bool
+sdbf::load_binary(const uint8_t *record, uint64_t length, uint64_t *used) {
+    sdbf_record_t rec;
+    if (length < sizeof(rec))
+        return false;
+    memcpy(&rec, record, sizeof(rec));
+    uint64_t data_len = (uint64_t)rec.bf_count*rec.bf_size;
+    uint64_t counts_len = rec.dd_block_size ? rec.bf_count*sizeof(uint16_t) : 0;
+    if (rec.record_len > length || rec.record_len != sizeof(rec) + rec.name_len + counts_len + data_len) {
+        if (config->warnings)
+            fprintf( stderr, "ERROR: Corrupt binary sdbf record.\n");
+        return false;
+    }
+    const uint8_t *pos = record + sizeof(rec);
+    this->filenamealloc = true;
+    this->hashname = (char*)alloc_check( ALLOC_ZERO, rec.name_len+2, "load_binary", "this->hashname", ERROR_EXIT);
+    memcpy(this->hashname, pos, rec.name_len);
+    pos += rec.name_len;
+    this->orig_file_size = rec.orig_file_size;
+    this->bf_size = rec.bf_size;
+    this->hash_count = rec.hash_count;
+    this->mask = rec.mask;
+    this->max_elem = rec.max_elem;
+    this->bf_count = rec.bf_count;
+    this->last_count = rec.last_count;
+    this->dd_block_size = rec.dd_block_size;
+    if (counts_len) {
+        this->elem_counts = (uint16_t *)alloc_check( ALLOC_ONLY, counts_len, "load_binary", "this->elem_counts", ERROR_EXIT);
+        memcpy(this->elem_counts, pos, counts_len);
+        pos += counts_len;
+    }
+    this->buffer = (uint8_t *)alloc_check( ALLOC_ONLY, data_len, "load_binary", "this->buffer", ERROR_EXIT);
+    memcpy(this->buffer, pos, data_len);
+    compute_hamming();
+    this->info=NULL;
+    *used = rec.record_len;
+    return true;
 }
 
 string
@@ -523,7 +688,7 @@ uint8_t*
 sdbf::clone_filter(uint32_t position) {
     if (position < this->bf_count) {
         uint8_t *filter=(uint8_t*)alloc_check(ALLOC_ZERO,bf_size*sizeof(uint8_t),"single_bloom_filter","return buffer",ERROR_EXIT);
-        memcpy(filter,this->buffer + position*bf_size,bf_size);
+        memcpy(filter,filter_data(position),bf_size);
         return filter;    
     } else {
         return NULL;
@@ -553,6 +718,54 @@ sdbf::sdbf_create(const char *name) {
     this->buffer = NULL;
     this->info=NULL;
     this->filenamealloc=false;
+    this->filters=NULL;
+    this->filter_ids=NULL;
+    this->uniq_ids=NULL;
+    this->uniq_index=NULL;
+    this->uniq_count=0;
+}
+
+/**
+    Moves this sdbf's bloom filters into a shared table of unique filters
+    and frees its own copy.  Identical filters, within this sdbf or across
+    every sdbf using the table, are then stored and compared once.
+    \param table filter table to add to
+*/
+void
+sdbf::dedup(filter_table *table) {
+    if (this->filter_ids || !this->buffer)
+        return;
+    if( !this->hamming)
+        compute_hamming();
+    uint32_t *ids = (uint32_t*)alloc_check( ALLOC_ONLY, bf_count*sizeof(uint32_t), "dedup", "filter_ids", ERROR_EXIT);
+    this->uniq_ids = (uint32_t*)alloc_check( ALLOC_ONLY, bf_count*sizeof(uint32_t), "dedup", "uniq_ids", ERROR_EXIT);
+    this->uniq_index = (uint32_t*)alloc_check( ALLOC_ONLY, bf_count*sizeof(uint32_t), "dedup", "uniq_index", ERROR_EXIT);
+    std::map<uint32_t,uint32_t> seen;
+    this->uniq_count = 0;
+    for (uint32_t i = 0; i < bf_count; i++) {
+        ids[i] = table->intern( buffer + (uint64_t)i*bf_size, get_elem_count( this, i), hamming[i]);
+        std::map<uint32_t,uint32_t>::iterator it = seen.find(ids[i]);
+        if (it == seen.end()) {
+            seen[ids[i]] = uniq_count;
+            uniq_ids[uniq_count] = ids[i];
+            uniq_index[i] = uniq_count++;
+        } else {
+            uniq_index[i] = it->second;
+        }
+    }
+    free(this->buffer);
+    this->buffer = NULL;
+    this->filters = table;
+    this->filter_ids = ids;
+}
+
+/**
+    Returns the shared filter table this sdbf uses, if deduplicated.
+    \returns filter_table* or NULL
+*/
+filter_table *
+sdbf::table() const {
+    return this->filters;
 }
 
 
@@ -7,6 +7,8 @@
 #include "sdbf_defines.h"
 #include "sdbf_conf.h"
 #include "bloom_filter.h"
+#include "filter_table.h"
+#include "sdbf_stats.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -24,6 +26,7 @@ class sdbf {
 
     friend std::ostream& operator<<(std::ostream& os, const sdbf& s); ///< output operator
     friend std::ostream& operator<<(std::ostream& os, const sdbf *s); ///< output operator
+    friend class sdbf_bench; ///< benchmark driver, times the core kernels directly
 
     /** \example sdbf_test.cc
     *  A very short example program using sdbf.
@@ -36,8 +39,8 @@ public:
     sdbf(FILE *in); 
     /// to create new from a single file
     sdbf(const char *filename, uint32_t dd_block_size); 
-    /// to create by reading from an open stream
-    sdbf(const char *name, std::istream *ifs, uint32_t dd_block_size, uint64_t msize, index_info *info) ; 
+    /// to create by reading from an open stream, block mode hashed on threads (0: config's), window bytes at a time (0: all)
+    sdbf(const char *name, std::istream *ifs, uint32_t dd_block_size, uint64_t msize, index_info *info, uint32_t threads=0, uint64_t window=0) ; 
     /// to create from a c-string
     sdbf(const char *name, char *str, uint32_t dd_block_size, uint64_t length, index_info *info);
     /// destructor
@@ -55,12 +58,23 @@ public:
     /// source object size
     uint64_t input_size();  
 
-    /// matching algorithm, take other object and run match
-    int32_t compare(sdbf *other, uint32_t map_on, uint32_t sample);
+    /// matching algorithm, take other object and run match, on threads (0: config's)
+    int32_t compare(sdbf *other, uint32_t map_on, uint32_t sample, uint32_t threads=0);
+    /// matching algorithm for sdbfs sharing a filter table, caching filter pair scores
+    int32_t compare(sdbf *other, score_cache *cache);
 
     /// return a string representation of this sdbf
     string to_string() const ; 
 
+    /// append the string representation of this sdbf to out
+    void encode(string &out) const;
+
+    /// append the binary (archive) representation of this sdbf to out
+    void encode_binary(string &out) const;
+
+    /// to read a binary sdbf record from a memory buffer
+    bool load_binary(const uint8_t *record, uint64_t length, uint64_t *used);
+
     /// return results of index search
     string get_index_results() const; 
 
@@ -68,6 +82,11 @@ public:
     uint8_t *clone_filter(uint32_t position);
     uint32_t filter_count();
 
+    /// move this sdbf's filters into a shared table of unique filters
+    void dedup(class filter_table *table);
+    /// the filter table this sdbf references, or NULL
+    class filter_table *table() const;
+
 public:
     /// global configuration object
     static class sdbf_conf *config;  
@@ -75,6 +94,10 @@ public:
 private:
 
     int compute_hamming();
+    /// filter at position i, from own buffer or the shared table
+    const uint8_t *filter_data(uint32_t i) const {
+        return filter_ids ? filters->filter(filter_ids[i]) : buffer + (uint64_t)i*bf_size;
+    }
     void sdbf_create(const char *filename);
     static int32_t get_elem_count(sdbf *mine, uint64_t index) ;
 
@@ -82,19 +105,23 @@ private:
     static void gen_chunk_ranks( uint8_t *file_buffer, const uint64_t chunk_size, uint16_t *chunk_ranks, uint16_t carryover);
     static void gen_chunk_scores( const uint16_t *chunk_ranks, const uint64_t chunk_size, uint16_t *chunk_scores, int32_t *score_histo);
     void gen_chunk_hash( uint8_t *file_buffer, const uint64_t chunk_pos, const uint16_t *chunk_scores, const uint64_t chunk_size);
-    static void gen_block_hash( uint8_t *file_buffer, uint64_t file_size, const uint64_t block_num, const uint16_t *chunk_scores, const uint64_t block_size, class sdbf *hashto,uint32_t rem, uint32_t threshold, int32_t allowed);
+    static void gen_block_hash( uint8_t *file_buffer, uint64_t file_size, const uint64_t block_num, const uint16_t *chunk_scores, const uint64_t block_size, class sdbf *hashto,uint32_t rem, uint32_t threshold, int32_t allowed, uint64_t first_block=0);
     void gen_chunk_sdbf( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size);
-    void gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t block_size, uint32_t thread_cnt);
+    void gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t block_size, uint32_t thread_cnt, uint64_t first_block=0);
 
     static void *thread_gen_block_sdbf( void *task_param);
-    static int     sdbf_score( sdbf *sd_1, sdbf *sd_2, uint32_t map_on, uint32_t sample);
+    static int     sdbf_score( sdbf *sd_1, sdbf *sd_2, uint32_t map_on, uint32_t sample, uint32_t threads=0);
     static double  sdbf_max_score( sdbf_task_t *task, uint32_t map_on);
     static void *thread_sdbf_max_score( void *task_param);
+    static double  filter_score( const uint8_t *bf_1, uint32_t e1_cnt, uint32_t s1, const uint8_t *bf_2, uint32_t e2_cnt, uint32_t s2, uint32_t bf_size, uint32_t hash_count, sdbf_stats_t *stats=NULL);
+    static int     sdbf_score_dedup( sdbf *sd_1, sdbf *sd_2, score_cache *cache);
 
-    void print_smaller_indexes(uint32_t threshold, vector<uint32_t> *matches, vector<bloom_filter *> *indexes,uint64_t pos, bloom_filter *matched,bool basename);
+    void print_smaller_indexes(uint32_t threshold, vector<uint32_t> *matches, class sdbf_set *set,uint64_t pos, bloom_filter *matched,bool basename);
     void reset_indexes(vector<uint32_t> *matches);
-    bool check_indexes(uint32_t* sha1, vector<uint32_t> *matches);
-    uint32_t check_smaller_indexes(uint32_t* sha1, vector<uint32_t> *matches, vector<bloom_filter*> *indexes);
+    void check_indexes(uint32_t (*sha1)[5], uint32_t count, vector<uint32_t> *matches, uint64_t *any);
+    void flush_inserts(uint32_t (*inserts)[5], uint32_t count);
+    void flush_checks(uint32_t (*checks)[5], uint32_t count, vector<uint32_t> *matches, uint32_t (*hashes)[5], uint32_t *hashindex, uint32_t limit);
+    uint32_t check_smaller_indexes(uint32_t* sha1, vector<uint32_t> *matches, class bit_sliced_index *filters);
     bool is_block_null(uint8_t *buffer, uint32_t size);
 
 private:
@@ -117,6 +144,13 @@ private:
     uint64_t orig_file_size; // size of the original file
     bool     filenamealloc;
 
+    // deduplicated storage: filters live in a shared table
+    class filter_table *filters;
+    uint32_t *filter_ids;    // table id of each BF
+    uint32_t *uniq_ids;      // table ids of the distinct BFs, first-seen order
+    uint32_t *uniq_index;    // position in uniq_ids of each BF
+    uint32_t  uniq_count;    // number of distinct BFs
+
 };
 
 #endif
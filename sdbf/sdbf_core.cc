@@ -10,6 +10,9 @@
 #include <vector>
 #include "sdbf_class.h"
 #include "sdbf_defines.h"
+#include "bit_sliced_index.h"
+#include "index_tree.h"
+#include "counting_bloom_filter.h"
 
 #include <boost/filesystem.hpp>
 namespace fs=boost::filesystem;
@@ -96,42 +99,60 @@ sdbf::gen_chunk_hash( uint8_t *file_buffer, const uint64_t chunk_pos, const uint
     num_indexes=this->info->setlist->size();
     uint32_t hashes[161][5];
     uint32_t hashindex = 0;
+    // features waiting to be looked up in, or added to, the indexes
+    uint32_t checks[BF_BATCH][5], inserts[BF_BATCH][5];
+    uint32_t check_cnt = 0, insert_cnt = 0;
     vector<uint32_t> match (num_indexes);
     reset_indexes(&match);
     uint32_t match_total= 0;
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
+    uint64_t index_ns = stats ? stats->ns[STAT_INDEX] : 0;
+    uint64_t features = 0, features_dup = 0;
     for( i=0; i<chunk_size-config->pop_win_size; i++) {
         if( chunk_scores[i] > config->threshold) {
             // ADD to INDEX
         SHA1( file_buffer+chunk_pos+i, config->pop_win_size, (uint8_t *)sha1_hash);
         uint32_t bits_set = bf_sha1_insert( curr_bf, 0, (uint32_t *)sha1_hash);
+        features++;
         // Avoid potentially repetitive features
-        if( !bits_set)
+        if( !bits_set) {
+            features_dup++;
             continue;
+        }
             //if ((i % 4 == 0) && num_indexes) {
         if ((last_count % 4 == 0) && num_indexes) {
-                hashes[hashindex][0]=sha1_hash[0]; hashes[hashindex][1]=sha1_hash[1]; hashes[hashindex][2]=sha1_hash[2]; hashes[hashindex][3]=sha1_hash[3]; hashes[hashindex][4]=sha1_hash[4];
-        bool any=this->check_indexes((uint32_t*)hashes[hashindex],&match);
-        if (any)  {
-           hashindex++;
-        }
-        if (hashindex >=160) 
-           hashindex=160;  // no more than N matches per chunk?
+                memcpy(checks[check_cnt++], sha1_hash, sizeof(sha1_hash));
+                if (check_cnt == BF_BATCH) {
+                    this->flush_checks(checks, check_cnt, &match, hashes, &hashindex, 160);  // no more than N matches per chunk?
+                    check_cnt = 0;
+                }
             } 
-            if (this->info->index) 
-                this->info->index->insert_sha1((uint32_t*)sha1_hash);
+            if (this->info->index || this->info->counting) {
+                memcpy(inserts[insert_cnt++], sha1_hash, sizeof(sha1_hash));
+                if (insert_cnt == BF_BATCH) {
+                    this->flush_inserts(inserts, insert_cnt);
+                    insert_cnt = 0;
+                }
+            }
             last_count++;
             if( last_count == this->max_elem) {
+                if (check_cnt) {
+                    this->flush_checks(checks, check_cnt, &match, hashes, &hashindex, 160);
+                    check_cnt = 0;
+                }
                 curr_bf += this->bf_size;
                 bf_count++;
                 last_count = 0;
                 for (int n=0;n<num_indexes;n++) {
                    if (match.at(n) >= _FP_THRESHOLD) {
-                       vector<uint32_t> match2(this->info->setlist->at(n)->filter_count()+1);
+                       sdbf_set *set=this->info->setlist->at(n);
+                       vector<uint32_t> match2(set->filter_count()+1);
                        this->reset_indexes(&match2);
                        for (int j=0;j<hashindex;j++) {
-                           match_total+=this->check_smaller_indexes((uint32_t*)hashes[j],&match2,this->info->setlist->at(n)->bf_vector);
+                           match_total+=this->check_smaller_indexes((uint32_t*)hashes[j],&match2,set->filter_index);
                        }
-                       print_smaller_indexes(_FP_THRESHOLD,&match2,this->info->setlist->at(n)->bf_vector,bf_count-1,this->info->setlist->at(n)->index,this->info->basename);
+                       print_smaller_indexes(_FP_THRESHOLD,&match2,set,bf_count-1,set->index,this->info->basename);
                        if (this->info->search_first) 
                             break;
                     }
@@ -141,6 +162,18 @@ sdbf::gen_chunk_hash( uint8_t *file_buffer, const uint64_t chunk_pos, const uint
             } 
         }
     }
+    // checks pending here belong to a filter still being filled; like its
+    // match counts they are not carried over to the next chunk
+    if (insert_cnt)
+        this->flush_inserts(inserts, insert_cnt);
+    if (stats) {
+        stats->features += features;
+        stats->features_dup += features_dup;
+        // index time was counted by the flushes
+        index_ns = stats->ns[STAT_INDEX] - index_ns;
+        stats_lap(stats, STAT_HASH, &since);
+        stats->ns[STAT_HASH] -= index_ns;
+    }
     if (config->warnings)
     cerr << this->name() << " " << match_total << " hits" << endl;
     this->bf_count = bf_count;
@@ -149,41 +182,57 @@ sdbf::gen_chunk_hash( uint8_t *file_buffer, const uint64_t chunk_pos, const uint
 
 /**
  * Generate SHA1 hashes and add them to the SDBF--block-aligned version.
+ * block_num is the block's place in file_buffer, and first_block the
+ * place in the digest of the first block of file_buffer.
  */
 void 
 sdbf::gen_block_hash( uint8_t *file_buffer, uint64_t file_size, const uint64_t block_num, const uint16_t *chunk_scores, \
-             const uint64_t block_size, class sdbf *hashto, uint32_t rem, uint32_t threshold, int32_t allowed) {
+             const uint64_t block_size, class sdbf *hashto, uint32_t rem, uint32_t threshold, int32_t allowed, uint64_t first_block) {
 
-    uint8_t  *bf = hashto->buffer + block_num*(hashto->bf_size);  // BF to be filled
+    uint64_t  pos = first_block + block_num;  // Block of the digest
+    uint8_t  *bf = hashto->buffer + pos*(hashto->bf_size);  // BF to be filled
     uint8_t  *data = file_buffer + block_num*block_size;  // Start of data
     uint32_t  i, hash_cnt=0, sha1_hash[5];
     uint32_t  max_offset = (rem > 0) ? rem : block_size;
     uint32_t hashes[193][5];
+    uint32_t checks[BF_BATCH][5], inserts[BF_BATCH][5];
+    uint32_t check_cnt = 0, insert_cnt = 0;
     uint32_t num_indexes= 0;
     if (hashto->info->setlist != NULL) 
     num_indexes=hashto->info->setlist->size();
     vector<uint32_t> match (num_indexes);
     hashto->reset_indexes(&match);
-    int hashindex=0;
+    uint32_t hashindex=0;
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
+    uint64_t index_ns = stats ? stats->ns[STAT_INDEX] : 0;
+    uint64_t features = 0, features_dup = 0;
     for( i=0; i<max_offset-config->pop_win_size && hash_cnt< config->max_elem_dd; i++) {
         if(  chunk_scores[i] > threshold || 
             (chunk_scores[i] == threshold && allowed > 0)) {
                 SHA1( data+i, config->pop_win_size, (uint8_t *)sha1_hash);
                 uint32_t bits_set = bf_sha1_insert( bf, 0, (uint32_t *)sha1_hash);
+                features++;
                 // Avoid potentially repetitive features
-                if( !bits_set)
+                if( !bits_set) {
+                    features_dup++;
                     continue; 
+                }
                 if (num_indexes == 0) {
-                    if (hashto->info->index) 
-                        hashto->info->index->insert_sha1((uint32_t*)sha1_hash);
+                    if (hashto->info->index || hashto->info->counting) {
+                        memcpy(inserts[insert_cnt++], sha1_hash, sizeof(sha1_hash));
+                        if (insert_cnt == BF_BATCH) {
+                            hashto->flush_inserts(inserts, insert_cnt);
+                            insert_cnt = 0;
+                        }
+                    }
                 } else {
                     if (hash_cnt % 4 ==0) {
-                        hashes[hashindex][0]=sha1_hash[0]; hashes[hashindex][1]=sha1_hash[1]; hashes[hashindex][2]=sha1_hash[2]; hashes[hashindex][3]=sha1_hash[3]; hashes[hashindex][4]=sha1_hash[4];
-                        bool any=hashto->check_indexes((uint32_t*)hashes[hashindex], &match);
-                        if (any) 
-                           hashindex++;
-            if (hashindex >=192) 
-               hashindex=192;  // no more than N matches per chunk
+                        memcpy(checks[check_cnt++], sha1_hash, sizeof(sha1_hash));
+                        if (check_cnt == BF_BATCH) {
+                            hashto->flush_checks(checks, check_cnt, &match, hashes, &hashindex, 192);  // no more than N matches per chunk
+                            check_cnt = 0;
+                        }
                     }
                 }
                 hash_cnt++;
@@ -191,25 +240,37 @@ sdbf::gen_block_hash( uint8_t *file_buffer, uint64_t file_size, const uint64_t b
                     allowed--;
         }
     }
+    if (insert_cnt)
+        hashto->flush_inserts(inserts, insert_cnt);
+    if (check_cnt)
+        hashto->flush_checks(checks, check_cnt, &match, hashes, &hashindex, 192);
     // search indexes if necessary
-    uint32_t count=hashto->info->setlist->size();
+    uint32_t count=num_indexes;
     uint32_t tally=0;
     for (int m=0;m<count;m++) {
     if (match.at(m) >=_FP_THRESHOLD) {
-        vector<uint32_t> match2 (hashto->info->setlist->at(m)->bf_vector->size());
+        sdbf_set *set=hashto->info->setlist->at(m);
+        vector<uint32_t> match2 (set->filter_count());
         hashto->reset_indexes(&match2);
         for (int j=0;j<hashindex;j++) {
-        tally+=hashto->check_smaller_indexes((uint32_t*)hashes[j], &match2,hashto->info->setlist->at(m)->bf_vector);
+        tally+=hashto->check_smaller_indexes((uint32_t*)hashes[j], &match2,set->filter_index);
         }
-        hashto->print_smaller_indexes(_FP_THRESHOLD,&match2,hashto->info->setlist->at(m)->bf_vector,block_num,hashto->info->setlist->at(m)->index,hashto->info->basename);
+        hashto->print_smaller_indexes(_FP_THRESHOLD,&match2,set,pos,set->index,hashto->info->basename);
         if (hashto->info->search_first) 
             break;
     }
     }
     if (tally > 0 && config->warnings) 
-    cerr << hashto->name() << "[" << block_num << "] "<<tally<< " hits"<< endl;
+    cerr << hashto->name() << "[" << pos << "] "<<tally<< " hits"<< endl;
     hashto->reset_indexes(&match);
-    hashto->elem_counts[block_num] = hash_cnt; 
+    hashto->elem_counts[pos] = hash_cnt; 
+    if (stats) {
+        stats->features += features;
+        stats->features_dup += features_dup;
+        index_ns = stats->ns[STAT_INDEX] - index_ns;
+        stats_lap(stats, STAT_HASH, &since);
+        stats->ns[STAT_HASH] -= index_ns;
+    }
 }
 
 /**
@@ -232,11 +293,19 @@ sdbf::gen_chunk_sdbf( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_s
     uint64_t chunk_pos = 0;
     uint16_t *chunk_ranks = (uint16_t *)alloc_check( ALLOC_ONLY, (chunk_size)*sizeof( uint16_t), "gen_chunk_sdbf", "chunk_ranks", ERROR_EXIT);
     uint16_t *chunk_scores = (uint16_t *)alloc_check( ALLOC_ZERO, (chunk_size)*sizeof( uint16_t), "gen_chunk_sdbf", "chunk_scores", ERROR_EXIT);
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = 0;
+    if (stats)
+        stats->bytes_in += file_size;
 
     for( i=0; i<qt; i++, chunk_pos+=chunk_size) {
+        if (stats)
+            since = sdbf_stats::now();
         gen_chunk_ranks( file_buffer+chunk_size*i, chunk_size, chunk_ranks, 0);
+        stats_lap( stats, STAT_RANK, &since);
         memset( score_histo, 0, sizeof( score_histo));
         gen_chunk_scores( chunk_ranks, chunk_size, chunk_scores, score_histo);
+        stats_lap( stats, STAT_SCORE, &since);
 
         // Calculate thresholding paremeters
         for( k=65, sum=0; k>=config->threshold; k--) {
@@ -248,8 +317,12 @@ sdbf::gen_chunk_sdbf( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_s
         gen_chunk_hash( file_buffer, chunk_pos, chunk_scores, chunk_size);
     } 
     if( rem > 0) {
+        if (stats)
+            since = sdbf_stats::now();
         gen_chunk_ranks( file_buffer+qt*chunk_size, rem, chunk_ranks, 0);
+        stats_lap( stats, STAT_RANK, &since);
         gen_chunk_scores( chunk_ranks, rem, chunk_scores, 0);
+        stats_lap( stats, STAT_SCORE, &since);
         gen_chunk_hash( file_buffer, chunk_pos, chunk_scores, rem);
     }
 
@@ -285,11 +358,17 @@ sdbf::thread_gen_block_sdbf( void *task_param) {
     uint64_t chunk_pos = 0;
     uint16_t *chunk_ranks = (uint16_t *)alloc_check( ALLOC_ONLY, (block_size)*sizeof( uint16_t), "gen_block_sdbf", "chunk_ranks", ERROR_EXIT);
     uint16_t *chunk_scores = (uint16_t *)alloc_check( ALLOC_ZERO, (block_size)*sizeof( uint16_t), "gen_block_sdbf", "chunk_scores", ERROR_EXIT);
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = 0;
 
     for( i=hashtask->tid; i<qt; i+=hashtask->tcount, chunk_pos+=hashtask->tcount*block_size) {
+        if (stats)
+            since = sdbf_stats::now();
         gen_chunk_ranks( buffer+block_size*i, block_size, chunk_ranks, 0);
+        stats_lap( stats, STAT_RANK, &since);
         memset( score_histo, 0, sizeof( score_histo));
         gen_chunk_scores( chunk_ranks, block_size, chunk_scores, score_histo);
+        stats_lap( stats, STAT_SCORE, &since);
         // Calculate thresholding paremeters
         for( k=65, sum=0; k>=config->threshold; k--) {
             if( (sum <= config->max_elem_dd) && (sum+score_histo[k] > config->max_elem_dd))
@@ -298,7 +377,7 @@ sdbf::thread_gen_block_sdbf( void *task_param) {
         }
         allowed = config->max_elem_dd-sum;
 //cerr << "histo calc sum " << sum << " allowed "<< allowed <<" maxdd" << config->max_elem_dd << endl;
-        gen_block_hash( buffer, file_size, i, chunk_scores, block_size, hashtask->sdbf, 0, k, allowed);
+        gen_block_hash( buffer, file_size, i, chunk_scores, block_size, hashtask->sdbf, 0, k, allowed, hashtask->first_block);
     } 
     free( chunk_ranks);
     free( chunk_scores);
@@ -306,14 +385,19 @@ sdbf::thread_gen_block_sdbf( void *task_param) {
 }
 
 /** 
-    dd-mode hash generation.
+    dd-mode hash generation.  file_buffer holds the digest's blocks from
+    first_block on, so a digest can be made a part of its input at a time.
 */
 void
-sdbf::gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t block_size,  uint32_t thread_cnt) {
+sdbf::gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t block_size,  uint32_t thread_cnt, uint64_t first_block) {
         
     blockhash_task_t *tasks = (blockhash_task_t *) alloc_check( ALLOC_ONLY, thread_cnt*sizeof( blockhash_task_t), "gen_block_sdbf_mt", "tasks", ERROR_EXIT);
     boost::thread *hash_pool[MAX_THREADS];
     int t;
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = 0;
+    if (stats)
+        stats->bytes_in += file_size;
     for( t=0; t<thread_cnt; t++) {
         tasks[t].tid = t;
         tasks[t].tcount = thread_cnt;
@@ -321,6 +405,7 @@ sdbf::gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t bloc
         tasks[t].file_size = file_size;
         tasks[t].block_size = block_size;
         tasks[t].sdbf = this;
+        tasks[t].first_block = first_block;
         hash_pool[t] = new boost::thread(sdbf::thread_gen_block_sdbf,tasks+t);
     }
     for( t=0; t<thread_cnt; t++) {
@@ -334,9 +419,13 @@ sdbf::gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t bloc
         uint16_t *chunk_ranks = (uint16_t *)alloc_check( ALLOC_ONLY, (block_size)*sizeof( uint16_t), "gen_block_sdbf_mt", "chunk_ranks", ERROR_EXIT);
         uint16_t *chunk_scores = (uint16_t *)alloc_check( ALLOC_ZERO, (block_size)*sizeof( uint16_t), "gen_block_sdbf_mt", "chunk_scores", ERROR_EXIT);
 
+        if (stats)
+            since = sdbf_stats::now();
         gen_chunk_ranks( file_buffer+block_size*qt, rem, chunk_ranks, 0);
+        stats_lap( stats, STAT_RANK, &since);
         gen_chunk_scores( chunk_ranks, rem, chunk_scores, NULL);
-        gen_block_hash( file_buffer, file_size, qt, chunk_scores, block_size, this, rem, config->threshold, this->max_elem);     
+        stats_lap( stats, STAT_SCORE, &since);
+        gen_block_hash( file_buffer, file_size, qt, chunk_scores, block_size, this, rem, config->threshold, this->max_elem, first_block);     
 
         free( chunk_ranks);
         free( chunk_scores);
@@ -368,10 +457,10 @@ sdbf::thread_sdbf_max_score( void *task_param) {
  * Calculates the score between two digests
  */
 int 
-sdbf::sdbf_score( sdbf *sdbf_1, sdbf *sdbf_2, uint32_t map_on, uint32_t sample) {
+sdbf::sdbf_score( sdbf *sdbf_1, sdbf *sdbf_2, uint32_t map_on, uint32_t sample, uint32_t threads) {
 
     double max_score, score_sum = -1;
-    uint32_t i, t, thread_cnt = config->thread_cnt;
+    uint32_t i, t, thread_cnt = threads ? threads : config->thread_cnt;
     uint32_t bf_count_1, rand_offset;
     boost::thread *thread_pool[MAX_THREADS];
     sdbf_task_t *tasklist = NULL;
@@ -472,47 +561,25 @@ sdbf::sdbf_max_score( sdbf_task_t *task, uint32_t map_on) {
     assert( task != NULL);
         
     double score, max_score=-1;
-    uint32_t i, s1, s2, min_est, max_est, match, cut_off, slack=48;
+    uint32_t i, s1, s2;
     uint32_t bf_size = task->ref_sdbf->bf_size;
-    uint16_t *bf_1, *bf_2;
+    const uint8_t *bf_1, *bf_2;
 
     s1 = get_elem_count( task->ref_sdbf, task->ref_index);
     // Are there enough elements to even consider comparison?
     if( s1 < MIN_ELEM_COUNT)
         return max_score;
-    bf_1 = (uint16_t *)(task->ref_sdbf->buffer + task->ref_index*bf_size);
+    bf_1 = task->ref_sdbf->filter_data( task->ref_index);
     uint32_t e1_cnt = task->ref_sdbf->hamming[task->ref_index];
     uint32_t comp_cnt = task->tgt_sdbf->bf_count;
+    sdbf_stats_t *stats = sdbf_stats::local();
     for( i=task->tid; i<comp_cnt; i+=task->tcount) {
-        bf_2 = (uint16_t *)(task->tgt_sdbf->buffer + i*bf_size);
+        bf_2 = task->tgt_sdbf->filter_data( i);
         s2 = get_elem_count( task->tgt_sdbf, i);
         if( task->ref_sdbf->bf_count > 1 && s2 < MIN_REF_ELEM_COUNT)
             continue;
         uint32_t e2_cnt = task->tgt_sdbf->hamming[i];
-
-        // Max/min number of matching bits & zero cut off
-        max_est = (e1_cnt < e2_cnt) ? e1_cnt : e2_cnt;
-        min_est = bf_match_est( 8*bf_size, task->ref_sdbf->hash_count, s1, s2, 0);
-        cut_off = boost::math::round( SD_SCORE_SCALE*(double)(max_est-min_est)+(double)min_est);
-        // Max/min number of matching bits & zero cut off
-        max_est = (e1_cnt < e2_cnt) ? e1_cnt : e2_cnt;
-        min_est = bf_match_est( 8*bf_size, task->ref_sdbf->hash_count, s1, s2, 0);
-        cut_off = boost::math::round( SD_SCORE_SCALE*(double)(max_est-min_est)+(double)min_est);
-
-        // Find matching bits
-	    if (config->popcnt) {
-			match = bf_bitcount_cut_256_asm( (uint8_t *)bf_1, (uint8_t *)bf_2, cut_off, slack);
-			if( match > 0) {
-				match = bf_bitcount_cut_256_asm( (uint8_t *)bf_1, (uint8_t *)bf_2, 0, 0);
-			}
-		} else {
-			match = bf_bitcount_cut_256( (uint8_t *)bf_1, (uint8_t *)bf_2, cut_off, slack);
-			if( match > 0) {
-				match = bf_bitcount_cut_256( (uint8_t *)bf_1, (uint8_t *)bf_2, 0, 0);
-			}
-
-	    }
-        score = (match <= cut_off) ? 0 : (double)(match-cut_off)/(max_est-cut_off);
+        score = filter_score( bf_1, e1_cnt, s1, bf_2, e2_cnt, s2, bf_size, task->ref_sdbf->hash_count, stats);
         if( map_on == FLAG_ON && config->thread_cnt == 1) {
             printf( "%s", (score > 0) ? "+" : ".");
         }
@@ -523,9 +590,102 @@ sdbf::sdbf_max_score( sdbf_task_t *task, uint32_t map_on) {
     return max_score;
 }
 
+/**
+ * Scores one BF against another (0-1), given their hamming weights and
+ * element counts.  Counts the pair, and where it was given up on, in
+ * stats unless NULL.
+ */
+double
+sdbf::filter_score( const uint8_t *bf_1, uint32_t e1_cnt, uint32_t s1, const uint8_t *bf_2, uint32_t e2_cnt, uint32_t s2, uint32_t bf_size, uint32_t hash_count, sdbf_stats_t *stats) {
+    uint32_t min_est, max_est, match, cut_off, slack=48;
+
+    // Max/min number of matching bits & zero cut off
+    max_est = (e1_cnt < e2_cnt) ? e1_cnt : e2_cnt;
+    min_est = bf_match_est( 8*bf_size, hash_count, s1, s2, 0);
+    cut_off = boost::math::round( SD_SCORE_SCALE*(double)(max_est-min_est)+(double)min_est);
+
+    // Find matching bits
+    if (config->popcnt) {
+        match = bf_bitcount_cut_256_asm( (uint8_t *)bf_1, (uint8_t *)bf_2, cut_off, slack);
+        if( match > 0) {
+            match = bf_bitcount_cut_256_asm( (uint8_t *)bf_1, (uint8_t *)bf_2, 0, 0);
+        }
+    } else {
+        match = bf_bitcount_cut_256( (uint8_t *)bf_1, (uint8_t *)bf_2, cut_off, slack);
+        if( match > 0) {
+            match = bf_bitcount_cut_256( (uint8_t *)bf_1, (uint8_t *)bf_2, 0, 0);
+        }
+    }
+    if( stats) {
+        stats->filter_pairs++;
+        // found again, rather than slowing the cut functions down
+        uint32_t level = match ? 0 : bf_cut_level( (uint8_t *)bf_1, (uint8_t *)bf_2, cut_off, slack);
+        if( level)
+            stats->cut_exits[level-1]++;
+    }
+    return (match <= cut_off) ? 0 : (double)(match-cut_off)/(max_est-cut_off);
+}
+
+/**
+ * Calculates the score between two digests sharing a filter table.
+ * Each distinct reference BF is scored once against the distinct target
+ * BFs, and filter pair scores are remembered in cache (may be NULL).
+ * Gives the same result as sdbf_score without sampling.
+ */
+int
+sdbf::sdbf_score_dedup( sdbf *sdbf_1, sdbf *sdbf_2, score_cache *cache) {
+    double max_score, score, score_sum = -1;
+    uint32_t i, j, bf_count_1;
+    filter_table *table = sdbf_1->filters;
+
+    if( !sdbf_1->filter_ids || !sdbf_2->filter_ids || sdbf_2->filters != table)
+        return sdbf_score( sdbf_1, sdbf_2, FLAG_OFF, 0);
+    // same ordering rule as sdbf_score
+    bf_count_1 = sdbf_1->bf_count;
+    if( (bf_count_1 > sdbf_2->bf_count) ||
+        (bf_count_1 == sdbf_2->bf_count && 
+            ((get_elem_count( sdbf_1, bf_count_1-1) > get_elem_count( sdbf_2, sdbf_2->bf_count-1)) ||
+              strcmp( (char*)sdbf_1->hashname, (char*)sdbf_2->hashname) > 0 ))) {
+            sdbf *tmp = sdbf_1;
+            sdbf_1 = sdbf_2;
+            sdbf_2 = tmp;
+            bf_count_1 = sdbf_1->bf_count;
+    }
+    // best match of each distinct reference BF
+    std::vector<double> best(sdbf_1->uniq_count);
+    sdbf_stats_t *stats = sdbf_stats::local();
+    for( i=0; i<sdbf_1->uniq_count; i++) {
+        uint32_t ref = sdbf_1->uniq_ids[i];
+        uint32_t s1 = table->elem_count( ref);
+        max_score = -1;
+        if( s1 >= MIN_ELEM_COUNT) {
+            for( j=0; j<sdbf_2->uniq_count; j++) {
+                uint32_t tgt = sdbf_2->uniq_ids[j];
+                uint32_t s2 = table->elem_count( tgt);
+                if( sdbf_1->bf_count > 1 && s2 < MIN_REF_ELEM_COUNT)
+                    continue;
+                if( !cache || !cache->find( ref, tgt, &score)) {
+                    score = filter_score( table->filter( ref), table->hamming( ref), s1,
+                                          table->filter( tgt), table->hamming( tgt), s2, sdbf_1->bf_size, sdbf_1->hash_count, stats);
+                    if( cache)
+                        cache->store( ref, tgt, score);
+                }
+                max_score = (score > max_score) ? score : max_score;
+            }
+        }
+        best[i] = max_score;
+    }
+    // fan back out over all reference BFs, in order
+    for( i=0; i<bf_count_1; i++) {
+        max_score = best[sdbf_1->uniq_index[i]];
+        score_sum = (score_sum < 0) ? max_score : score_sum + max_score;
+    }
+    return (score_sum < 0) ? -1 : boost::math::round( 100.0*score_sum/(bf_count_1));
+}
+
 void
-sdbf::print_smaller_indexes(uint32_t threshold, vector<uint32_t> *matches, vector<bloom_filter*> *indexes, uint64_t pos, bloom_filter *matched, bool basename){
-    uint32_t count=indexes->size();
+sdbf::print_smaller_indexes(uint32_t threshold, vector<uint32_t> *matches, sdbf_set *set, uint64_t pos, bloom_filter *matched, bool basename){
+    uint32_t count=set->filter_index ? set->filter_index->set_count() : 0;
     std::stringstream build;
     bool any=false;
     for (int i=0;i<count;i++) {
@@ -536,9 +696,9 @@ sdbf::print_smaller_indexes(uint32_t threshold, vector<uint32_t> *matches, vecto
             build << this->name();
         build <<" ["<< pos<< "] | " ;
         if (basename)
-            build << fs::path(indexes->at(i)->name()).filename().string();
+            build << fs::path(set->filter_owner(i)->name()).filename().string();
 	else 
-            build << indexes->at(i)->name();
+            build << set->filter_owner(i)->name();
         build << " | " ;
         build << matches->at(i) << endl;
         // note normalize to 0-100 score?
@@ -557,29 +717,89 @@ sdbf::reset_indexes(vector<uint32_t> *matches){
     matches->at(0)=0;
 }
 
-bool
-sdbf::check_indexes(uint32_t* sha1, vector<uint32_t>* matches) {
-    uint32_t count=this->info->setlist->size();
-    bool any=false;
-    for (int i=0;i<count;i++) {
-        if (this->info->setlist->at(i)->index->query_sha1(sha1)) {
-            matches->at(i)++;
-            any=true;
-        }
+/**
+   Looks up a batch of features in every set's index.
+   \param sha1 features, at most BF_BATCH
+   \param count number of features
+   \param matches per-set hit counts
+   \param any bit j set if feature j hit any set
+*/
+void
+sdbf::check_indexes(uint32_t (*sha1)[5], uint32_t count, vector<uint32_t>* matches, uint64_t *any) {
+    *any=0;
+    if (this->info->sliced) {
+        for (uint32_t j=0;j<count;j++)
+            if (this->info->sliced->query(sha1[j], matches))
+                *any|=1ULL << j;
+        return;
+    }
+    if (this->info->tree) {
+        this->info->tree->query_batch(sha1, count, matches, any);
+        return;
+    }
+    uint32_t sets=this->info->setlist->size();
+    uint64_t found;
+    for (uint32_t i=0;i<sets;i++) {
+        matches->at(i)+=this->info->setlist->at(i)->index->query_batch(sha1, count, &found);
+        *any|=found;
     }
-    return any;
 }    
 
-uint32_t
-sdbf::check_smaller_indexes(uint32_t* sha1, vector<uint32_t>* matches, vector<bloom_filter *> *indexes) {
-    uint32_t count=indexes->size();
-    bool any=false;
-    uint32_t tally=0;
-    for (int i=0;i<count;i++) {
-        if (indexes->at(i)->query_sha1(sha1)) {
-            matches->at(i)++;
-            tally++;
-        }
+/**
+   Adds the pending features to the index being built, and to or from
+   the counting index.
+   \param inserts pending features
+   \param count number pending
+*/
+void
+sdbf::flush_inserts(uint32_t (*inserts)[5], uint32_t count) {
+    uint64_t inserted;
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
+    if (info->index)
+        info->index->insert_batch(inserts, count, &inserted);
+    if (info->counting) {
+        if (info->counting_remove)
+            info->counting->remove_batch(inserts, count);
+        else
+            info->counting->insert_batch(inserts, count);
+    }
+    if (stats) {
+        stats->index_inserts += count;
+        stats_lap(stats, STAT_INDEX, &since);
+    }
+}
+
+/**
+   Runs the pending index checks, keeping the features that hit any set
+   for the per-file search, in order, up to a limit.
+   \param checks pending features
+   \param count number pending
+   \param matches per-set hit counts
+   \param hashes features kept
+   \param hashindex number of features kept
+   \param limit most features to keep
+*/
+void
+sdbf::flush_checks(uint32_t (*checks)[5], uint32_t count, vector<uint32_t> *matches, uint32_t (*hashes)[5], uint32_t *hashindex, uint32_t limit) {
+    uint64_t any;
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
+    check_indexes(checks, count, matches, &any);
+    for (uint32_t j=0;j<count && *hashindex<limit;j++)
+        if (any & (1ULL << j))
+            memcpy(hashes[(*hashindex)++], checks[j], 5*sizeof(uint32_t));
+    if (stats) {
+        stats->index_probes += count;
+        for (uint32_t j=0;j<count;j++)
+            stats->index_hits += (any >> j) & 1;
+        stats_lap(stats, STAT_INDEX, &since);
     }
-    return (tally);
+}
+
+uint32_t
+sdbf::check_smaller_indexes(uint32_t* sha1, vector<uint32_t>* matches, bit_sliced_index *filters) {
+    if (filters == NULL)
+        return 0;
+    return filters->query(sha1, matches);
 }    
@@ -70,6 +70,22 @@
 
 #endif
 
+// Fixed part of a binary sdbf record (sdbf archives), followed by the
+// name, elem_counts (dd mode only) and bf_count*bf_size filter bytes
+typedef struct {
+    uint32_t  record_len;     // total length including this header
+    uint32_t  name_len;       // length of name following this header
+    uint64_t  orig_file_size; // size of the original file
+    uint32_t  bf_size;        // BF size in bytes
+    uint32_t  hash_count;     // number of hash functions used
+    uint32_t  mask;           // bit mask used
+    uint32_t  max_elem;       // max number of elements per filter
+    uint32_t  bf_count;       // number of BFs
+    uint32_t  last_count;     // elements in last filter (stream mode)
+    uint32_t  dd_block_size;  // block size, 0 for stream mode
+    uint32_t  reserved;
+} sdbf_record_t;
+
 // P-threading task spesicification structure for matching SDBFs 
 typedef struct {
 	uint32_t  tid;			// Thread id
@@ -90,6 +106,7 @@ typedef struct {
     uint8_t  *buffer;       // File buffer to be hashed 
     uint64_t  file_size;    // File size (for the buffer) 
     uint64_t  block_size;   // Block size
+    uint64_t  first_block;  // Block of the SDBF that buffer starts at
 	class	sdbf   *sdbf;		    // Result SDBF
 } blockhash_task_t; 
 
@@ -111,6 +128,7 @@ typedef struct {
 uint32_t bf_bitcount( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t bf_size);
 uint32_t bf_bitcount_cut_256( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack);
 uint32_t bf_bitcount_cut_256_asm( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack);
+uint32_t bf_cut_level( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack);
 uint32_t bf_sha1_insert( uint8_t *bf, uint8_t bf_class, uint32_t *sha1_hash);
 uint32_t bf_match_est( uint32_t m, uint32_t k, uint32_t s1, uint32_t s2, uint32_t common);
 int32_t  get_elem_count(class sdbf *sdbf, uint64_t index);
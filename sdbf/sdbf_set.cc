@@ -5,13 +5,19 @@
 #include "sdbf_class.h"
 #include "sdbf_defines.h"
 #include "bloom_filter.h"
+#include "bit_sliced_index.h"
 #include "util.h"
 #include "sdbf_set.h"
+#include "sdbf_archive.h"
+#include "sdbf_catalog.h"
+#include "sdbf_conf.h"
+#include "result_sink.h"
 
 #include <boost/regex.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/thread/thread.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -28,7 +34,8 @@ namespace fs = boost::filesystem;
 sdbf_set::sdbf_set() {
     setname="default";    
     index = NULL;
-    bf_vector=new vector<bloom_filter*>();
+    filters = NULL;
+    filter_index = NULL;
 }
 
 /** 
@@ -38,15 +45,39 @@ sdbf_set::sdbf_set() {
 sdbf_set::sdbf_set(bloom_filter *index) {
     setname="default";    
     this->index=index;
-    bf_vector=new vector<bloom_filter*>();
+    filters = NULL;
+    filter_index = NULL;
 }
 
 /** 
-    Loads all sdbfs from a file into a new set
+    Loads all sdbfs from a file into a new set.  Text sdbf files,
+    compressed sdbf archives and set catalogs are accepted.  Throws -2,
+    as the text parser does, if an archive or catalog is damaged or
+    incomplete.
     \param fname name of sdbf file
 */
 sdbf_set::sdbf_set(const char *fname) {
-    if (fs::is_regular_file(fname)) {
+    if (sdbf_archive::is_archive(fname)) {
+        sdbf_archive arc;
+        if (arc.open(fname))
+            throw -2;
+        setname=(string)fname;
+        if (arc.load(this, sdbf::config ? sdbf::config->thread_cnt : 1)) {
+            for (uint32_t n=0; n < items.size(); n++)
+                delete items[n];
+            throw -2;
+        }
+    } else if (sdbf_catalog::is_catalog(fname)) {
+        sdbf_catalog cat(fname);
+        if (cat.open(false))
+            throw -2;
+        setname=(string)fname;
+        if (cat.load(this)) {
+            for (uint32_t n=0; n < items.size(); n++)
+                delete items[n];
+            throw -2;
+        }
+    } else if (fs::is_regular_file(fname)) {
         FILE *in = fopen( fname, "r");
         if (in!=NULL) {  // if fail to open leave set empty
             setname=(string)fname;
@@ -69,9 +100,8 @@ sdbf_set::sdbf_set(const char *fname) {
     // right now we cannot read-in an index.  
     // but we can set one later
     index = NULL;
-    // we can create a bf-ptr-full vector
-    bf_vector=new vector<bloom_filter*>();
-    vector_init();
+    filters = NULL;
+    filter_index = NULL;
 }
 
 /** 
@@ -113,17 +143,12 @@ sdbf_set::sdbf_set(const char *formatted_sdbf_buffer, size_t buffer_length) {
     // right now we cannot read-in an index.  
     // but we can set one later
     index = NULL;
-    // we can create a bf-ptr-full vector
-    bf_vector=new vector<bloom_filter*>();
-    vector_init();
+    filters = NULL;
+    filter_index = NULL;
 }
 
 sdbf_set::~sdbf_set() {
-    if (bf_vector->size() > 0) {
-	for (int i=0;i<bf_vector->size();i++)
-	    delete bf_vector->at(i);
-    }
-    delete bf_vector;
+    delete filter_index;
 }
 
 void sdbf_set::destory(sdbf_set* &set) {
@@ -223,12 +248,11 @@ sdbf_set::index_results() const {
 */
 std::string 
 sdbf_set::to_string() const {
-    std::stringstream builder;
+    std::string builder;
     for (std::vector<sdbf*>::const_iterator it = items.begin(); it!=items.end() ; ++it)  {
-        builder << *it ;    
+        (*it)->encode(builder);
     }
-    //builder << this->index;
-    return builder.str();
+    return builder;
 }
 
 /** 
@@ -271,6 +295,43 @@ sdbf_set::set_name(std::string name) {
     setname=name;
 }
 
+/**
+   \internal
+   result_rows: rows of results made by several threads, passed on in
+   row order.  A thread hands over each row as it finishes it; rows are
+   passed on as soon as every row before them is in, so output flows
+   while later rows are still being compared, one call at a time.
+*/
+class result_rows {
+
+public:
+    result_rows(uint64_t count, result_fn emit, void *context) : rows(count), done(count, false) {
+        this->emit = emit;
+        this->context = context;
+        next = 0;
+    }
+
+    /// hand over row n, leaving row empty
+    void finish(uint64_t n, std::vector<compare_result_t> &row) {
+        boost::mutex::scoped_lock guard(lock);
+        rows[n].swap(row);
+        done[n] = true;
+        for (; next < rows.size() && done[next]; next++) {
+            for (uint64_t k = 0; k < rows[next].size(); k++)
+                emit(&rows[next][k], context);
+            std::vector<compare_result_t>().swap(rows[next]);
+        }
+    }
+
+private:
+    std::vector<std::vector<compare_result_t> > rows;
+    std::vector<bool> done;
+    uint64_t next;            // first row not passed on
+    result_fn emit;
+    void *context;
+    boost::mutex lock;
+};
+
 /**
     Compares each sdbf object in target to every other sdbf object in target
     and returns the results as a list stored in a string 
@@ -280,22 +341,40 @@ sdbf_set::set_name(std::string name) {
 */
 std::string 
 sdbf_set::compare_all(int32_t threshold) { 
-    int32_t score = 0;
+    result_sink sink(RESULT_TEXT);
+    compare_all(threshold, result_sink::emit, &sink);
+    return sink.take();
+}
+
+/**
+    Compares each sdbf object in this set to every later one, passing
+    each result at or over the threshold on as it is made.
+
+    \param threshold output threshold
+    \param emit called with each result, in order
+    \param context passed to emit
+*/
+void
+sdbf_set::compare_all(int32_t threshold, result_fn emit, void *context) {
     uint32_t map_on = 0;
-    std::stringstream out;
-    out.fill('0');
-    int end = this->items.size();
-    for (int i = 0; i < end ; i++) {
-        for (int j = i; j < end ; j++) {
-            if (i == j) continue;
-            score = this->items.at(i)->compare(this->items.at(j),map_on,0);
-            if (score >= threshold)  {
-                out << this->items.at(i)->name() << "|" << this->items.at(j)->name() ;
-                out << "|" << setw (3) << score << std::endl;
+    if (filters) {
+        compare_dedup(this, threshold, emit, context);
+        return;
+    }
+    compare_result_t result;
+    uint32_t end = this->items.size();
+    for (uint32_t i = 0; i < end ; i++) {
+        for (uint32_t j = i+1; j < end ; j++) {
+            result.score = this->items.at(i)->compare(this->items.at(j),map_on,0);
+            if (result.score >= threshold)  {
+                result.query = this->items.at(i);
+                result.target = this->items.at(j);
+                result.query_id = i;
+                result.target_id = j;
+                emit(&result, context);
             }
         }            
     }
-    return out.str();
 }
 
 /**
@@ -310,44 +389,230 @@ sdbf_set::compare_all(int32_t threshold) {
 */
 std::string
 sdbf_set::compare_to(sdbf_set *other,int32_t threshold,uint32_t sample_size) {
-    int32_t score = 0;
+    result_sink sink(RESULT_TEXT);
+    compare_to(other, threshold, sample_size, result_sink::emit, &sink);
+    return sink.take();
+}
+
+/**
+    Compares each sdbf object in other to each object in this set, passing
+    each result at or over the threshold on as it is made.
+
+    \param other set
+    \param threshold output threshold
+    \param sample_size size of bloom filter sample. send 0 for no sampling
+    \param emit called with each result, in order
+    \param context passed to emit
+*/
+void
+sdbf_set::compare_to(sdbf_set *other, int32_t threshold, uint32_t sample_size, result_fn emit, void *context) {
     uint32_t map_on = 0;
-    std::stringstream out;
-    out.fill('0');
-    int tend = other->size();
-    int qend = this->size();
-    for (int i = 0; i < qend ; i++) {
-        for (int j = 0; j < tend ; j++) {
-            score = this->items.at(i)->compare(other->items.at(j),map_on,sample_size);
-            if (score >= threshold) {
-                out << this->items.at(i)->name() << "|" << other->items.at(j)->name() ;
-                out << "|" << setw (3) << score << std::endl;
+    if (filters && filters == other->filters && !sample_size) {
+        compare_dedup(other, threshold, emit, context);
+        return;
+    }
+    compare_result_t result;
+    uint32_t tend = other->size();
+    uint32_t qend = this->size();
+    for (uint32_t i = 0; i < qend ; i++) {
+        for (uint32_t j = 0; j < tend ; j++) {
+            result.score = this->items.at(i)->compare(other->items.at(j),map_on,sample_size);
+            if (result.score >= threshold) {
+                result.query = this->items.at(i);
+                result.target = other->items.at(j);
+                result.query_id = i;
+                result.target_id = j;
+                emit(&result, context);
+            }
+        }
+    }
+}
+
+/**
+    Compares each sdbf object in other to each object in this set, as
+    compare_to() does and with the same output in the same order, but
+    with other split into contiguous slices, one per thread.  Each pair
+    is scored on one thread, so a few query sdbfs against many targets,
+    as when a large set is compared a batch at a time, keep all threads
+    busy.
+
+    \param other set
+    \param threshold output threshold
+    \param sample_size size of bloom filter sample. send 0 for no sampling
+    \param thread_cnt threads to compare on
+    \returns std::string result listing
+*/
+std::string
+sdbf_set::compare_split(sdbf_set *other, int32_t threshold, uint32_t sample_size, uint32_t thread_cnt) {
+    result_sink sink(RESULT_TEXT);
+    compare_split(other, threshold, sample_size, thread_cnt, result_sink::emit, &sink);
+    return sink.take();
+}
+
+/**
+    compare_split(), passing each result on as every result before it
+    is made.
+
+    \param other set
+    \param threshold output threshold
+    \param sample_size size of bloom filter sample. send 0 for no sampling
+    \param thread_cnt threads to compare on
+    \param emit called with each result, in order, one call at a time
+    \param context passed to emit
+*/
+void
+sdbf_set::compare_split(sdbf_set *other, int32_t threshold, uint32_t sample_size, uint32_t thread_cnt, result_fn emit, void *context) {
+    if (thread_cnt < 1)
+        thread_cnt = 1;
+    if (thread_cnt > MAX_THREADS)
+        thread_cnt = MAX_THREADS;
+    // row i*thread_cnt+t: query i against slice t
+    result_rows rows((uint64_t)this->items.size()*thread_cnt, emit, context);
+    if (thread_cnt == 1) {
+        thread_compare_split(this, other, threshold, sample_size, 0, 1, &rows);
+    } else {
+        boost::thread_group pool;
+        for (uint32_t t = 0; t < thread_cnt; t++)
+            pool.create_thread(boost::bind(&sdbf_set::thread_compare_split, this, other, threshold, sample_size, t, thread_cnt, &rows));
+        pool.join_all();
+    }
+}
+
+/**
+   \internal
+   Worker for compare_split: compares every query sdbf to slice tid of
+   the targets, scoring each pair on this thread alone.
+*/
+void
+sdbf_set::thread_compare_split(sdbf_set *query, sdbf_set *target, int32_t threshold, uint32_t sample_size, uint32_t tid, uint32_t tcount, result_rows *rows) {
+    uint32_t tend = target->items.size();
+    uint32_t first = (uint64_t)tend*tid/tcount, last = (uint64_t)tend*(tid+1)/tcount;
+    std::vector<compare_result_t> row;
+    compare_result_t result;
+    for (uint32_t i = 0; i < query->items.size(); i++) {
+        for (uint32_t j = first; j < last; j++) {
+            result.score = query->items.at(i)->compare(target->items.at(j), 0, sample_size, 1);
+            if (result.score >= threshold) {
+                result.query = query->items.at(i);
+                result.target = target->items.at(j);
+                result.query_id = i;
+                result.target_id = j;
+                row.push_back(result);
             }
         }
+        rows->finish((uint64_t)i*tcount+tid, row);
     }
-    return out.str();
+}
+
+/**
+   \internal
+   Compares sets whose sdbfs share a filter table, splitting the query
+   sdbfs across threads.  Each thread keeps its own cache of filter pair
+   scores.  Output is the same, in the same order, as the plain compares.
+*/
+void
+sdbf_set::compare_dedup(sdbf_set *other, int32_t threshold, result_fn emit, void *context) {
+    uint32_t thread_cnt = sdbf::config->thread_cnt;
+    if (thread_cnt < 1)
+        thread_cnt = 1;
+    result_rows rows(this->items.size(), emit, context);
+    if (thread_cnt == 1) {
+        thread_compare_dedup(this, other, threshold, 0, 1, &rows);
+    } else {
+        boost::thread_group pool;
+        for (uint32_t t = 0; t < thread_cnt; t++)
+            pool.create_thread(boost::bind(&sdbf_set::thread_compare_dedup, this, other, threshold, t, thread_cnt, &rows));
+        pool.join_all();
+    }
+}
+
+/**
+   \internal
+   Worker for compare_dedup: handles every tcount'th query sdbf.  When
+   comparing a set to itself, only pairs after the query are scored.
+*/
+void
+sdbf_set::thread_compare_dedup(sdbf_set *query, sdbf_set *target, int32_t threshold, uint32_t tid, uint32_t tcount, result_rows *rows) {
+    score_cache cache;
+    uint32_t qend = query->items.size();
+    uint32_t tend = target->items.size();
+    std::vector<compare_result_t> row;
+    compare_result_t result;
+    for (uint32_t i = tid; i < qend ; i += tcount) {
+        for (uint32_t j = (query == target) ? i+1 : 0; j < tend ; j++) {
+            result.score = query->items.at(i)->compare(target->items.at(j), &cache);
+            if (result.score >= threshold) {
+                result.query = query->items.at(i);
+                result.target = target->items.at(j);
+                result.query_id = i;
+                result.target_id = j;
+                row.push_back(result);
+            }
+        }
+        rows->finish(i, row);
+    }
+}
+
+/**
+    Moves the bloom filters of every sdbf in this set into a shared table
+    of unique filters.  Sets sharing a table compare each distinct pair of
+    filters once.
+    \param table filter table, may be shared with other sets
+*/
+void
+sdbf_set::dedup(filter_table *table) {
+    for (uint64_t i = 0; i < items.size(); i++)
+        items[i]->dedup(table);
+    filters = table;
 }
 
 uint64_t
 sdbf_set::filter_count() {
-    return bf_vector->size();	
+    if (filter_index)
+        return filter_index->set_count();
+    uint64_t count=0;
+    for (uint64_t i=0;i<items.size(); i++)
+        count+=items.at(i)->filter_count();
+    return count;
+}
+
+/**
+   Finds the sdbf a filter_index slot belongs to.
+   \param n slot number
+   \returns sdbf containing filter n
+*/
+class sdbf*
+sdbf_set::filter_owner(uint64_t n) {
+    vector<uint64_t>::iterator it=upper_bound(filter_start.begin(), filter_start.end(), n);
+    return items.at(it - filter_start.begin() - 1);
 }
 
 /**
-   Sets up bloom filter vector for index searching.  
+   Sets up the filter index for index searching: every filter of every
+   sdbf, bit-sliced, so a feature found in the set's index can be traced
+   to the files containing it without testing each filter in turn.
+   Built once, then read-only and shared by all searching threads.
    Should be called by server process when done hashing to a set
 */
 void
 sdbf_set::vector_init() {
-    for (int i=0;i<items.size(); i++)
-        for (int n=0; n< items.at(i)->filter_count() ; n++) {
+    delete filter_index;
+    filter_index=NULL;
+    filter_start.clear();
+    uint64_t count=0;
+    for (uint64_t i=0;i<items.size(); i++) {
+        filter_start.push_back(count);
+        count+=items.at(i)->filter_count();
+    }
+    if (count == 0)
+        return;
+    filter_index=new bit_sliced_index(256, 5, count);
+    uint64_t slot=0;
+    for (uint64_t i=0;i<items.size(); i++)
+        for (uint32_t n=0; n< items.at(i)->filter_count() ; n++) {
 	    uint8_t *data=items.at(i)->clone_filter(n);
-	    bloom_filter *tmp=new bloom_filter(data,256);
-	    string *tmpstr= new string(items.at(i)->name());
-	    tmp->set_name(*tmpstr);
-	    bf_vector->push_back(tmp);
+	    filter_index->set_filter(slot++, data);
 	    free(data);
-	    delete tmpstr;
 	}
 }
 
@@ -7,6 +7,7 @@
 #include <boost/thread/thread.hpp>
 #include "sdbf_class.h"
 #include "bloom_filter.h"
+#include "result_sink.h"
 #include "util.h"
 
 
@@ -50,13 +51,26 @@ public:
     /// Computes the data size of this set
     uint64_t input_size( ) ; 
 
+    /// number of bloom filters in all sdbfs of this set
     uint64_t filter_count();
 
+    /// sdbf holding filter n of this set, in vector_init() order
+    class sdbf *filter_owner(uint64_t n);
+
 	/// Compares all objects in a set to each other
 	std::string compare_all(int32_t threshold); 
+	/// Compares all objects in a set to each other, passing results to emit as they are made
+	void compare_all(int32_t threshold, result_fn emit, void *context);
 
 	///queries one set for the contents of another
 	std::string compare_to(sdbf_set *other,int32_t threshold, uint32_t sample_size); 
+	///queries one set for the contents of another, passing results to emit as they are made
+	void compare_to(sdbf_set *other, int32_t threshold, uint32_t sample_size, result_fn emit, void *context);
+
+	/// compare_to, with the other set split between threads
+	std::string compare_split(sdbf_set *other, int32_t threshold, uint32_t sample_size, uint32_t thread_cnt);
+	/// compare_to, with the other set split between threads, passing results to emit as they are made
+	void compare_split(sdbf_set *other, int32_t threshold, uint32_t sample_size, uint32_t thread_cnt, result_fn emit, void *context);
 
 	/// return a string which contains the output-encoded sdbfs in this set
 	std::string to_string() const;
@@ -74,9 +88,12 @@ public:
 	/// name this set.
 	void set_name(std::string name);
 
-	/// setup bloom filter vector
+	/// build the filter index used to find matching files within this set
 	void vector_init();
 
+	/// store filters of all sdbfs in a shared table of unique filters
+	void dedup(class filter_table *table);
+
     /// Add by weizili
     /// free a sdbf_set
     static void destory(sdbf_set* &set);
@@ -84,14 +101,20 @@ public:
 public:
     /// index for this set 
 	class bloom_filter *index;
-    /// giant bloom filter vector for this set
-	std::vector<class bloom_filter*> *bf_vector;
+    /// all filters of this set, bit-sliced; NULL until vector_init()
+	class bit_sliced_index *filter_index;
 
 private:
 
+	void compare_dedup(sdbf_set *other, int32_t threshold, result_fn emit, void *context);
+	static void thread_compare_dedup(sdbf_set *query, sdbf_set *target, int32_t threshold, uint32_t tid, uint32_t tcount, class result_rows *rows);
+	static void thread_compare_split(sdbf_set *query, sdbf_set *target, int32_t threshold, uint32_t sample_size, uint32_t tid, uint32_t tcount, class result_rows *rows);
+
 	std::vector<class sdbf*> items;
+	std::vector<uint64_t> filter_start;   // first filter_index slot of each item
 	std::string setname;
 	boost::mutex add_hash_mutex;
+	class filter_table *filters;  // shared filter table, if deduplicated
 
 };
 
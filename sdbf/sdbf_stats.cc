@@ -0,0 +1,132 @@
+// sdbf_stats.cc
+// pipeline counters and stage times
+
+#include "sdbf_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+bool sdbf_stats::enabled = false;
+// blocks are kept for the report after their threads end, so never freed here
+boost::thread_specific_ptr<sdbf_stats_t> sdbf_stats::mine(sdbf_stats::keep);
+boost::mutex sdbf_stats::lock;
+std::vector<sdbf_stats_t*> sdbf_stats::all;
+
+static const char *stage_names[STAT_STAGES] = {
+    "read", "rank", "score", "hash", "index", "compare", "encode", "output"
+};
+
+/**
+    This thread's counters, created the first time it counts anything.
+    \returns counters, or NULL if counting is off
+*/
+sdbf_stats_t *
+sdbf_stats::local() {
+    if (!enabled)
+        return NULL;
+    sdbf_stats_t *stats = mine.get();
+    if (stats == NULL) {
+        stats = new sdbf_stats_t;
+        memset(stats, 0, sizeof(sdbf_stats_t));
+        mine.reset(stats);
+        boost::mutex::scoped_lock guard(lock);
+        all.push_back(stats);
+    }
+    return stats;
+}
+
+/**
+   \internal
+   Cleanup for thread exit: the block stays in all.
+*/
+void
+sdbf_stats::keep(sdbf_stats_t * /*stats*/) {
+}
+
+/**
+    Adds up the counters of every thread.  Threads still counting may
+    be part way through a chunk, so call it once work is done.
+    \param sum totals
+*/
+void
+sdbf_stats::total(sdbf_stats_t *sum) {
+    memset(sum, 0, sizeof(sdbf_stats_t));
+    boost::mutex::scoped_lock guard(lock);
+    for (uint32_t n = 0; n < all.size(); n++) {
+        const sdbf_stats_t *s = all[n];
+        sum->bytes_in += s->bytes_in;
+        sum->features += s->features;
+        sum->features_dup += s->features_dup;
+        sum->index_probes += s->index_probes;
+        sum->index_hits += s->index_hits;
+        sum->index_inserts += s->index_inserts;
+        sum->filter_pairs += s->filter_pairs;
+        for (uint32_t c = 0; c < STAT_CUT_LEVELS; c++)
+            sum->cut_exits[c] += s->cut_exits[c];
+        for (uint32_t t = 0; t < STAT_STAGES; t++)
+            sum->ns[t] += s->ns[t];
+    }
+}
+
+uint32_t
+sdbf_stats::threads() {
+    boost::mutex::scoped_lock guard(lock);
+    return all.size();
+}
+
+uint64_t
+sdbf_stats::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/**
+    Formats the totals.  Text is one "name: value" line per counter and
+    stage, stage times in seconds; JSON is one object with the same names.
+    \param json JSON rather than text
+    \returns report
+*/
+std::string
+sdbf_stats::report(bool json) {
+    sdbf_stats_t sum;
+    total(&sum);
+    struct { const char *name; uint64_t value; } counts[] = {
+        { "threads", threads() },
+        { "bytes_in", sum.bytes_in },
+        { "features", sum.features },
+        { "features_dup", sum.features_dup },
+        { "index_probes", sum.index_probes },
+        { "index_hits", sum.index_hits },
+        { "index_inserts", sum.index_inserts },
+        { "filter_pairs", sum.filter_pairs },
+        { "cut_exits_1", sum.cut_exits[0] },
+        { "cut_exits_2", sum.cut_exits[1] },
+        { "cut_exits_3", sum.cut_exits[2] },
+    };
+    const uint32_t ncounts = sizeof(counts)/sizeof(counts[0]);
+    std::string out;
+    char line[128];
+    if (json)
+        out += "{ ";
+    for (uint32_t n = 0; n < ncounts; n++) {
+        if (json)
+            snprintf(line, sizeof(line), "\"%s\": %llu, ", counts[n].name, (unsigned long long)counts[n].value);
+        else
+            snprintf(line, sizeof(line), "stats:%s:%llu\n", counts[n].name, (unsigned long long)counts[n].value);
+        out += line;
+    }
+    if (json)
+        out += "\"seconds\": { ";
+    for (uint32_t t = 0; t < STAT_STAGES; t++) {
+        if (json)
+            snprintf(line, sizeof(line), "%s\"%s\": %.6f", t ? ", " : "", stage_names[t], sum.ns[t] / 1e9);
+        else
+            snprintf(line, sizeof(line), "stats:seconds_%s:%.6f\n", stage_names[t], sum.ns[t] / 1e9);
+        out += line;
+    }
+    if (json)
+        out += " } }\n";
+    return out;
+}
@@ -0,0 +1,88 @@
+// Header file for sdbf_stats: pipeline counters and stage times
+//
+#ifndef _SDBF_STATS_H
+#define _SDBF_STATS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+// stages timed
+#define STAT_READ     0   // reading input
+#define STAT_RANK     1   // entropy ranks
+#define STAT_SCORE    2   // feature scores
+#define STAT_HASH     3   // SHA-1 of features, filter insertion
+#define STAT_INDEX    4   // index lookups and insertions
+#define STAT_COMPARE  5   // digest comparison
+#define STAT_ENCODE   6   // digest encoding
+#define STAT_OUTPUT   7   // writing results
+#define STAT_STAGES   8
+// points at which bf_bitcount_cut_256 can give up on a filter pair
+#define STAT_CUT_LEVELS 3
+
+// One thread's counters
+typedef struct {
+    uint64_t bytes_in;        // bytes hashed
+    uint64_t features;        // features selected by score and hashed
+    uint64_t features_dup;    // of those, dropped for setting no new bits
+    uint64_t index_probes;    // features looked up in indexes
+    uint64_t index_hits;      // of those, found in at least one
+    uint64_t index_inserts;   // features added to indexes being built
+    uint64_t filter_pairs;    // filter pairs scored
+    uint64_t cut_exits[STAT_CUT_LEVELS];   // pairs given up on at each cut
+    uint64_t ns[STAT_STAGES]; // time in each stage
+} sdbf_stats_t;
+
+/**
+    sdbf_stats: counters and stage times, kept per thread so that they
+    cost no locking, and added up for a report at the end.  Nothing is
+    counted unless enabled is set; the instrumented code checks it once
+    per chunk, block or digest pair, and counts into locals in between.
+    Stage times are summed over threads, so may add up to more than the
+    elapsed time; time spent in the index stage is not counted again in
+    the hash stage that calls it.
+*/
+/// sdbf_stats class
+class sdbf_stats {
+
+public:
+    /// counting turned on
+    static bool enabled;
+
+    /// this thread's counters, or NULL if not enabled
+    static sdbf_stats_t *local();
+    /// sum of all threads' counters
+    static void total(sdbf_stats_t *sum);
+    /// threads that have counted anything
+    static uint32_t threads();
+    /// monotonic time, in ns
+    static uint64_t now();
+
+    /// report of the totals, as text lines or a JSON object
+    static std::string report(bool json);
+
+private:
+    static void keep(sdbf_stats_t *stats);
+
+    static boost::thread_specific_ptr<sdbf_stats_t> mine;
+    static boost::mutex lock;
+    static std::vector<sdbf_stats_t*> all;
+};
+
+/**
+    Adds the time since *since to a stage and restarts the clock.  Does
+    nothing if stats is NULL.
+*/
+inline void
+stats_lap(sdbf_stats_t *stats, uint32_t stage, uint64_t *since) {
+    if (stats) {
+        uint64_t t = sdbf_stats::now();
+        stats->ns[stage] += t - *since;
+        *since = t;
+    }
+}
+
+#endif
@@ -0,0 +1,120 @@
+// sdbf_stream.cc
+// reading an sdbf file a batch at a time
+
+#include "sdbf_stream.h"
+#include "sdbf_catalog.h"
+
+#include <vector>
+
+/**
+    Creates a stream over a file; open() reads its header, if any.
+    \param fname text sdbf file, archive or set catalog
+*/
+sdbf_stream::sdbf_stream(const char *fname) {
+    this->fname = fname;
+    in = NULL;
+    arc = NULL;
+    frame = 0;
+    whole = false;
+    read = 0;
+    status = 0;
+}
+
+sdbf_stream::~sdbf_stream() {
+    if (in != NULL)
+        fclose(in);
+    delete arc;
+}
+
+/**
+    Opens the file, working out its kind.
+    \returns 0 if successful, -1 if the file cannot be read
+*/
+int
+sdbf_stream::open() {
+    if (sdbf_archive::is_archive(fname.c_str())) {
+        arc = new sdbf_archive();
+        if (arc->open(fname.c_str())) {
+            delete arc;
+            arc = NULL;
+            return -1;
+        }
+    } else if (sdbf_catalog::is_catalog(fname.c_str())) {
+        whole = true;
+    } else {
+        in = fopen(fname.c_str(), "r");
+        if (in == NULL)
+            return -1;
+        int bar = getc(in);
+        if (!feof(in))
+            ungetc(bar, in);
+    }
+    return 0;
+}
+
+/**
+    Reads the next batch of digests.  Reading stops at the end of the
+    file, or where it cannot be parsed, which error() then reports.
+    \param batch_bytes bytes of filters to read, rounded up to whole
+           digests, or whole frames of an archive
+    \returns new set, or NULL when there are no more digests
+*/
+sdbf_set *
+sdbf_stream::next(uint64_t batch_bytes) {
+    sdbf_set *batch = new sdbf_set();
+    batch->set_name(fname);
+    uint64_t bytes = 0;
+    if (whole) {
+        whole = false;
+        sdbf_catalog cat(fname.c_str());
+        if (cat.open(false) || cat.load(batch))
+            status = -2;
+    } else if (arc != NULL) {
+        std::vector<class sdbf*> digests;
+        while ((bytes < batch_bytes || batch->size() == 0) && frame < arc->frame_count()) {
+            digests.clear();
+            if (arc->load_frame(frame++, digests)) {
+                status = -2;
+                frame = arc->frame_count();
+            }
+            for (uint64_t i = 0; i < digests.size(); i++) {
+                batch->add(digests[i]);
+                bytes += digests[i]->size();
+            }
+        }
+    } else if (in != NULL) {
+        while ((bytes < batch_bytes || batch->size() == 0) && !feof(in)) {
+            class sdbf *sdbfm;
+            try {
+                sdbfm = new sdbf(in);
+            } catch (int e) {
+                status = -2;
+                fclose(in);
+                in = NULL;
+                break;
+            }
+            batch->add(sdbfm);
+            bytes += sdbfm->size();
+            getc(in);
+            int bar = getc(in);
+            if (!feof(in))
+                ungetc(bar, in);
+        }
+    }
+    read += batch->size();
+    if (batch->size() == 0) {
+        delete batch;
+        return NULL;
+    }
+    return batch;
+}
+
+uint64_t
+sdbf_stream::count() const {
+    return read;
+}
+
+int
+sdbf_stream::error() const {
+    return status;
+}
@@ -0,0 +1,56 @@
+// Header file for sdbf_stream: reading an sdbf file a batch at a time
+//
+#ifndef _SDBF_STREAM_H
+#define _SDBF_STREAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include "sdbf_class.h"
+#include "sdbf_set.h"
+#include "sdbf_archive.h"
+#include "util.h"
+
+// default bytes of filters in a batch
+#define STREAM_BATCH (256*(uint64_t)MB)
+
+/**
+    sdbf_stream: reads the digests of a text sdbf file or a compressed
+    archive in file order, a batch at a time, so that a file larger than
+    memory can be scanned once from start to end.  A batch holds whole
+    digests (whole archive frames) up to about the requested bytes of
+    filters, and at least one.  A set catalog, whose segments are spread
+    over several files, is read as one batch.  Batches are new sets, and
+    they and their sdbfs belong to the caller.
+*/
+/// sdbf_stream class
+class sdbf_stream {
+
+public:
+    /// stream over file fname, not yet open
+    sdbf_stream(const char *fname);
+    /// destructor, closes file
+    ~sdbf_stream();
+
+    /// open the file; 0, or -1 if it cannot be read
+    int open();
+    /// next batch of about batch_bytes of filters, or NULL at end of file
+    sdbf_set *next(uint64_t batch_bytes=STREAM_BATCH);
+
+    /// digests read so far
+    uint64_t count() const;
+    /// 0, or -2 if the file could not be parsed past some point
+    int error() const;
+
+private:
+    std::string fname;
+    FILE *in;             // text sdbf file, or NULL
+    sdbf_archive *arc;    // archive, or NULL
+    uint64_t frame;       // next archive frame
+    bool whole;           // catalog, not yet read
+    uint64_t read;        // digests read
+    int status;
+};
+
+#endif
@@ -0,0 +1,158 @@
+// set_loader.cc
+// parallel loading of sdbf sets and their indexes
+
+#include "set_loader.h"
+#include "sdbf_defines.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <exception>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+// size of a file, 0 if it cannot be read
+static uint64_t
+file_bytes(const std::string &fname) {
+    struct stat st;
+    if (fname.empty() || stat(fname.c_str(), &st))
+        return 0;
+    return st.st_size;
+}
+
+/**
+    Creates a loader with nothing queued.
+    \param thread_cnt threads to load with
+    \param budget most bytes of files to be reading at once
+    \param progress called as each item finishes, or NULL
+*/
+set_loader::set_loader(uint32_t thread_cnt, uint64_t budget, progress_fn progress) {
+    if (thread_cnt < 1)
+        thread_cnt = 1;
+    if (thread_cnt > MAX_THREADS)
+        thread_cnt = MAX_THREADS;
+    this->thread_cnt = thread_cnt;
+    this->budget = budget;
+    this->progress = progress;
+    next = done = 0;
+    in_flight = 0;
+}
+
+/**
+    Queues a set file, an index file, or both, to be loaded together;
+    the index is attached to the set.
+    \param set_file sdbf set file, or empty
+    \param index_file index file, or empty
+    \returns position of the item
+*/
+uint32_t
+set_loader::add(const std::string &set_file, const std::string &index_file) {
+    load_item_t item;
+    item.set_file = set_file;
+    item.index_file = index_file;
+    item.bytes = file_bytes(set_file) + file_bytes(index_file);
+    item.set = NULL;
+    item.index = NULL;
+    item.error = 0;
+    item.seconds = 0;
+    items.push_back(item);
+    return items.size() - 1;
+}
+
+/**
+    Loads everything queued, returning when all are done.  Items that
+    fail have a NULL set and index, and error set.
+*/
+void
+set_loader::load() {
+    next = done = 0;
+    in_flight = 0;
+    uint32_t threads = std::min((uint32_t)items.size(), thread_cnt);
+    if (threads <= 1) {
+        thread_load(this);
+    } else {
+        boost::thread_group pool;
+        for (uint32_t t = 0; t < threads; t++)
+            pool.create_thread(boost::bind(&set_loader::thread_load, this));
+        pool.join_all();
+    }
+}
+
+/**
+    Loading thread: takes the next item, once there is room for it in
+    the budget, until none are left.
+*/
+void
+set_loader::thread_load(set_loader *loader) {
+    for (;;) {
+        load_item_t *item;
+        {
+            boost::mutex::scoped_lock guard(loader->lock);
+            if (loader->next >= loader->items.size())
+                return;
+            item = &loader->items[loader->next++];
+            while (loader->in_flight > 0 && loader->in_flight + item->bytes > loader->budget)
+                loader->space.wait(guard);
+            loader->in_flight += item->bytes;
+        }
+        loader->load_item(item);
+        {
+            boost::mutex::scoped_lock guard(loader->lock);
+            loader->in_flight -= item->bytes;
+            loader->done++;
+            if (loader->progress)
+                loader->progress(item, loader->done, loader->items.size());
+        }
+        loader->space.notify_all();
+    }
+}
+
+/**
+    Loads one item: its index, then its set, with the index attached and
+    the set's filter index built.
+*/
+void
+set_loader::load_item(load_item_t *item) {
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    try {
+        if (!item->index_file.empty())
+            item->index = new bloom_filter(item->index_file);
+        if (!item->set_file.empty()) {
+            item->set = new sdbf_set(item->set_file.c_str());
+            item->set->index = item->index;
+            item->set->vector_init();
+        }
+    } catch (int e) {
+        item->error = e;
+    } catch (std::exception &e) {
+        // malformed index headers fail to parse
+        item->error = -2;
+    }
+    if (item->error) {
+        delete item->index;
+        item->index = NULL;
+    }
+    gettimeofday(&end, NULL);
+    item->seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+uint32_t
+set_loader::size() const {
+    return items.size();
+}
+
+load_item_t &
+set_loader::at(uint32_t i) {
+    return items[i];
+}
+
+double
+set_loader::busy_seconds() const {
+    double total = 0;
+    for (uint32_t i = 0; i < items.size(); i++)
+        total += items[i].seconds;
+    return total;
+}
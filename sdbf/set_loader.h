@@ -0,0 +1,80 @@
+// Header file for set_loader object
+//
+#ifndef _SET_LOADER_H
+#define _SET_LOADER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "sdbf_class.h"
+#include "sdbf_set.h"
+#include "bloom_filter.h"
+#include "util.h"
+
+// default bytes of files being loaded at once
+#define LOADER_BUDGET (1024*(uint64_t)MB)
+
+// One set and index to load, and how it went
+typedef struct {
+    std::string   set_file;     // sdbf set file, empty for none
+    std::string   index_file;   // index file, empty for none
+    uint64_t      bytes;        // size of both on disk
+    sdbf_set     *set;          // loaded set, with index attached, or NULL
+    bloom_filter *index;        // loaded index, or NULL
+    int           error;        // 0, or what loading threw: -1 not accessible, -2 invalid, -3 too small
+    double        seconds;      // time taken to load
+} load_item_t;
+
+/**
+    set_loader: loads many sdbf sets and their indexes on a pool of
+    threads, as at startup with a directory of reference sets.  Threads
+    take files in the order they were added, but do not start one while
+    files already being read would go over the memory budget, so the
+    peak of buffers in flight is bounded (a file larger than the budget
+    is loaded on its own).  Results are kept in the order added, so the
+    caller registers sets in the same order however the loads finish.
+    Loaded sets and indexes belong to the caller.
+*/
+/// set_loader class
+class set_loader {
+
+public:
+    /// called under a lock as each item finishes: item, number done, number in all
+    typedef void (*progress_fn)(const load_item_t *item, uint32_t done, uint32_t total);
+
+    /// loader using thread_cnt threads and budget bytes of files in flight
+    set_loader(uint32_t thread_cnt, uint64_t budget=LOADER_BUDGET, progress_fn progress=NULL);
+
+    /// queue a set and/or index to load; returns its position
+    uint32_t add(const std::string &set_file, const std::string &index_file);
+    /// load everything queued
+    void load();
+
+    /// number of items
+    uint32_t size() const;
+    /// item i, in the order added
+    load_item_t &at(uint32_t i);
+    /// total seconds spent loading, all threads
+    double busy_seconds() const;
+
+private:
+    static void thread_load(set_loader *loader);
+    void load_item(load_item_t *item);
+
+    std::vector<load_item_t> items;
+    uint32_t thread_cnt;
+    uint64_t budget;
+    progress_fn progress;
+    // shared by loading threads
+    boost::mutex lock;
+    boost::condition_variable space;   // signalled as bytes in flight drop
+    uint32_t next;                     // next item to start
+    uint32_t done;                     // items finished
+    uint64_t in_flight;                // bytes of items being loaded
+};
+
+#endif
@@ -23,6 +23,7 @@ using namespace  ::sdhash;
 
 using namespace std;
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -37,6 +38,7 @@ using namespace std;
 #include "sdbf_set.h"
 #include "sdhash-srv.h"
 #include "set_list.h"
+#include "set_loader.h"
 
 namespace fs = boost::filesystem;
 
@@ -53,51 +55,64 @@ class sdhashsrvHandler : virtual public sdhashsrvIf {
     /** Handler initialization, starts up server
         \param thread_count number of threads to use for processing
         \param home directory to search for hashsets
+        \param load_budget bytes of files to read at once while loading
     */
-  sdhashsrvHandler(uint32_t thread_count, std::string *home, std::string *sources) {
+  sdhashsrvHandler(uint32_t thread_count, std::string *home, std::string *sources, uint64_t load_budget) {
     sdbf::config = new sdbf_conf(thread_count, 0, _MAX_ELEM_COUNT, _MAX_ELEM_COUNT_DD);
     uint32_t j=0;
     source_directory=*sources; 
     home_directory=*home; 
     processing_thread_count=thread_count;
     rng_init();
-    sdbf_set *tmp_set;
+    // sets and their indexes are loaded in parallel, then registered in
+    // sorted order
+    std::vector<std::string> files;
     if (fs::is_directory(home->c_str())) {
         for (fs::directory_iterator itr(home->c_str()); itr!=fs::directory_iterator(); ++itr) {
-          if (fs::is_regular_file(itr->status())) {
-               try {
-                fprintf(stderr,"-> Loading file %s ..... ",itr->path().string().c_str());
-                tmp_set=new sdbf_set(itr->path().string().c_str());
-                if (!tmp_set->empty()) {
-                    int32_t setid=make_hashsetID();
-                    string setname;
-                    setname=itr->path().stem().string();
-                    add_set(tmp_set,(char*)setname.c_str(),setid);
-                    j++;
-                    fprintf(stderr,"OK\n");
-	            if (fs::exists(itr->path().string()+".idx")) {
-		        bloom_filter *indextest=new bloom_filter(itr->path().string()+".idx");
-		        indexlist.push_back(indextest);
-		        tmp_set->index=indextest;
-                        cerr << "-> Loaded index " <<  itr->path().string() << "..... OK" << endl;
-		    }
-                } else {
-                    fprintf(stderr,"File empty\n",itr->path().string().c_str());
-                }
-            } catch (int e) {
-                if (e==-1) 
-                    fprintf(stderr,"File not accessible\n");
-                if (e==-2) 
-                    fprintf(stderr,"File format invalid\n");
-                if (e==-3) 
-                    fprintf(stderr,"File too small\n");
-
-            }
-          }
+          if (fs::is_regular_file(itr->status()) && itr->path().extension().string() != ".idx")
+              files.push_back(itr->path().string());
         }
     }
- 
-    fprintf(stderr, "sdhash-srv loaded %d sets.\n",j );
+    std::sort(files.begin(), files.end());
+    set_loader loader(thread_count, load_budget, report_load);
+    for (uint32_t n=0; n < files.size(); n++)
+        loader.add(files[n], fs::exists(files[n]+".idx") ? files[n]+".idx" : "");
+    time_t load_start=time(0);
+    loader.load();
+    for (uint32_t n=0; n < loader.size(); n++) {
+        load_item_t &item=loader.at(n);
+        if (item.error || item.set->empty()) {
+            delete item.set;
+            delete item.index;
+            continue;
+        }
+        int32_t setid=make_hashsetID();
+        string setname=fs::path(item.set_file).stem().string();
+        if (item.index)
+            indexlist.push_back(item.index);
+        add_set(item.set,(char*)setname.c_str(),setid);
+        j++;
+    }
+    fprintf(stderr, "sdhash-srv loaded %d sets in %ds.\n",j,(int)(time(0)-load_start));
+  }
+
+  /**
+    Reports each file as the startup loader finishes it.
+  */
+  static void report_load(const load_item_t *item, uint32_t done, uint32_t total) {
+    fprintf(stderr,"-> Loading file %s (%u/%u, %.2fs) ..... ",item->set_file.c_str(),done,total,item->seconds);
+    if (item->error==-1) 
+        fprintf(stderr,"File not accessible\n");
+    else if (item->error==-2) 
+        fprintf(stderr,"File format invalid\n");
+    else if (item->error) 
+        fprintf(stderr,"File too small\n");
+    else if (item->set->empty())
+        fprintf(stderr,"File empty\n");
+    else if (item->index)
+        fprintf(stderr,"OK, with index\n");
+    else
+        fprintf(stderr,"OK\n");
   }
 
       /** 
@@ -329,6 +344,10 @@ class sdhashsrvHandler : virtual public sdhashsrvIf {
   void hashString(const std::string& setname, const std::vector<std::string> & filenames, const int32_t blocksize, const int32_t hashsetID, const int32_t searchIndex) {
     sdbf_set *tmp;
     index_info *info=(index_info*)malloc(sizeof(index_info));
+    info->sliced=NULL;
+    info->tree=NULL;
+    info->counting=NULL;
+    info->counting_remove=false;
     std::cout << "hashString begin request for "<< setname << " ";
     switch (searchIndex) {
         case 1:
@@ -621,7 +640,9 @@ private:
 	if (set->index !=NULL)
 	   setlist.push_back(set);
 	set->set_name((std::string)name);
-	set->vector_init();
+	// sets from the startup loader have it built already
+	if (set->filter_index == NULL)
+	    set->vector_init();
 	return setID;
     }
 
@@ -677,6 +698,10 @@ hash_index_stringlist(const std::vector<std::string> & filenames, string output_
     index_info *info=(index_info*)malloc(sizeof(index_info));
     info->setlist=NULL;
     info->indexlist=NULL;
+    info->sliced=NULL;
+    info->tree=NULL;
+    info->counting=NULL;
+    info->counting_remove=false;
     info->search_deep=false;
     info->search_first=false;
     if (smallct > 0) {
@@ -779,7 +804,7 @@ int main(int argc, char **argv) {
     if (conf==NULL) 
     return 0;
     fprintf(stderr, "sdhash-srv initializing service...\n");
-    boost::shared_ptr<sdhashsrvHandler> handler(new sdhashsrvHandler(conf->thread_cnt,conf->home, conf->sources));
+    boost::shared_ptr<sdhashsrvHandler> handler(new sdhashsrvHandler(conf->thread_cnt,conf->home, conf->sources, conf->load_budget));
     boost::shared_ptr<TProcessor> processor(new sdhashsrvProcessor(handler));
     boost::shared_ptr<TServerTransport> serverTransport(new TServerSocket(conf->port));
     boost::shared_ptr<TTransportFactory> transportFactory(new TBufferedTransportFactory());
@@ -55,6 +55,7 @@ read_args (int ac, char* av[], int quiet)
 			("connections,c",po::value<uint32_t>()->default_value(20),"server connections provided")
 			("hashdir,d",po::value<string>()->default_value("."),"server hash directory")
 			("sourcedir,s",po::value<string>()->default_value("."),"server sources directory")
+			("load-budget",po::value<uint32_t>()->default_value(1024),"MB of hash files to read at once at startup")
             ;
 
         po::options_description cmdline_options;
@@ -129,6 +130,9 @@ read_args (int ac, char* av[], int quiet)
 				cout << "Server sources directory: " << vm["sourcedir"].as< string >() << "\n";
 			options->sources=new string(vm["sourcedir"].as<string>());
         }
+        if (vm.count("load-budget")) {
+			options->load_budget=(uint64_t)vm["load-budget"].as<uint32_t>()*1024*1024;
+        }
 
     }
     catch(exception& e)
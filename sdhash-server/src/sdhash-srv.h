@@ -52,6 +52,7 @@ typedef struct {
 	string *host;
 	string *home;
 	string *sources;
+	uint64_t load_budget;  // bytes of files to read at once at startup
 } sdbf_parameters_t;
 
 sdbf_parameters_t* read_args (int ac, char* av[], int quiet);
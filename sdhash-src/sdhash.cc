@@ -6,7 +6,19 @@
 #include "../sdbf/sdbf_class.h"
 #include "../sdbf/sdbf_defines.h"
 #include "../sdbf/sdbf_set.h"
+#include "../sdbf/sdbf_archive.h"
+#include "../sdbf/sdbf_catalog.h"
+#include "../sdbf/bit_sliced_index.h"
+#include "../sdbf/index_tree.h"
+#include "../sdbf/set_loader.h"
+#include "../sdbf/counting_bloom_filter.h"
+#include "../sdbf/digest_cache.h"
+#include "../sdbf/sdbf_stats.h"
+#include "../sdbf/sdbf_stream.h"
 #include "sdhash_threads.h"
+#include "sdhash_schedule.h"
+#include "sdhash_walk.h"
+#include "sdhash_memory.h"
 #include "sdhash.h"
 #include "version.h"
 
@@ -14,7 +26,10 @@
 #include "boost/program_options.hpp"
 #include "boost/lexical_cast.hpp"
 
+#include <algorithm>
 #include <fstream>
+#include <iomanip>
+#include <unistd.h>
 
 namespace fs = boost::filesystem;
 namespace po = boost::program_options;
@@ -68,16 +83,321 @@ sdbf_parameters_t sdbf_sys = {
     0,              // sample size off
     0,              // verbose mode off
     128*MB,         // segment size
-    NULL             // optional filename
+    NULL,            // optional filename
+    0,               // output in input order
+    BF_LAYOUT_STANDARD|BF_LAYOUT_HASH64, // index bit layout
+    0,               // shared index, no shards
+    0,               // compressed indexes
+    0.01,            // index false positive rate
+    0,               // no counting indexes
+    5                // index hash functions
 };
 
+// move the filters of one or two sets into a shared table of unique filters
+filter_table *dedup_sets(sdbf_set *set1, sdbf_set *set2)
+{
+    filter_table *filters = new filter_table(sdbf_sys.bf_size);
+    set1->dedup(filters);
+    if (set2 != NULL)
+        set2->dedup(filters);
+    if (sdbf_sys.verbose)
+        cerr << "sdhash: " << filters->refs() << " bloom filters, " << filters->size() << " unique" << endl;
+    return filters;
+}
+
+// bit-sliced form of the reference indexes, read from fname if it still
+// matches them, else built (and written to fname if given)
+bit_sliced_index *load_sliced(std::vector<bloom_filter *> &indexlist, std::vector<sdbf_set *> &setlist, const string &fname)
+{
+    std::vector<std::string> names;
+    for (uint32_t n=0; n < setlist.size(); n++)
+        names.push_back(setlist.at(n)->name());
+    if (!fname.empty() && fs::is_regular_file(fname)) {
+        try {
+            bit_sliced_index *sliced=new bit_sliced_index(fname.c_str());
+            if (sliced->map_slots(names, indexlist))
+                return sliced;
+            delete sliced;
+            if (sdbf_sys.verbose)
+                cerr << "sdhash: " << fname << " is out of date, rebuilding" << endl;
+        } catch (int e) {
+            cerr << "sdhash: WARNING: cannot read bit-sliced index " << fname << endl;
+        }
+    }
+    if (!bit_sliced_index::compatible(indexlist)) {
+        cerr << "sdhash: WARNING: reference indexes differ in shape, not slicing" << endl;
+        return NULL;
+    }
+    bit_sliced_index *sliced=new bit_sliced_index(indexlist, names);
+    if (!fname.empty() && sliced->write_out(fname.c_str()))
+        cerr << "sdhash: WARNING: cannot write bit-sliced index " << fname << endl;
+    return sliced;
+}
+
+// progress of reference set loading, for --verbose
+void report_load(const load_item_t *item, uint32_t done, uint32_t total)
+{
+    cerr << "sdhash: [" << done << "/" << total << "] " << item->index_file << ", " << item->bytes/KB << "KB, ";
+    cerr << fixed << setprecision(2) << item->seconds << "s" << resetiosflags(ios::fixed) << setprecision(6);
+    if (item->error)
+        cerr << ", failed";
+    cerr << endl;
+}
+
+// shape of an index tree, for --verbose
+void report_tree(index_tree *tree)
+{
+    cerr << "sdhash: index tree of " << tree->set_count() << " sets, depth " << tree->depth() << ", ";
+    cerr << tree->filtered_count() << " of " << tree->node_count() << " nodes filtered, " << tree->size()/KB << "KB" << endl;
+}
+
+// tree of union filters over the reference indexes, read from fname if it
+// still matches them, else built in memory
+index_tree *load_tree(std::vector<bloom_filter *> &indexlist, std::vector<sdbf_set *> &setlist, const string &fname, uint32_t fanout)
+{
+    std::vector<std::string> names;
+    for (uint32_t n=0; n < setlist.size(); n++)
+        names.push_back(setlist.at(n)->name());
+    if (!fname.empty() && fs::is_regular_file(fname)) {
+        try {
+            index_tree *tree=new index_tree(fname.c_str());
+            if (tree->map_slots(names, indexlist))
+                return tree;
+            delete tree;
+            cerr << "sdhash: WARNING: " << fname << " is out of date, rebuilding in memory" << endl;
+        } catch (int e) {
+            cerr << "sdhash: WARNING: cannot read index tree " << fname << endl;
+        }
+    }
+    if (!index_tree::compatible(indexlist)) {
+        cerr << "sdhash: WARNING: reference indexes differ in layout, not building tree" << endl;
+        return NULL;
+    }
+    index_tree *tree=new index_tree(indexlist, names, fanout);
+    if (sdbf_sys.verbose)
+        report_tree(tree);
+    return tree;
+}
+
+
+// rewrite a file by way of a temporary copy, so readers never see it half written
+static int replace_file(const string &tmp, const string &fname)
+{
+    if (rename(tmp.c_str(), fname.c_str())) {
+        cerr << "sdhash: ERROR cannot write to file " << fname << endl;
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// --stats report format, text or json
+static string stats_format;
+
+// prints the --stats report, at exit
+static void print_stats()
+{
+    cerr << sdbf_stats::report(stats_format == "json");
+}
+
+// take files out of a counting index, then rewrite the set it belongs to
+// without their digests, the plain index beside it from the counts, and
+// the counting index itself -- in that order, so stopping part way leaves
+// the indexes matching more than the set, never less
+int remove_indexed(const string &cidx_file, const std::vector<string> &files)
+{
+    counting_bloom_filter *counting;
+    try {
+        counting=new counting_bloom_filter(cidx_file);
+    } catch (int e) {
+        cerr << "sdhash: ERROR: Could not read counting index " << cidx_file << endl;
+        return -1;
+    }
+    string set_file=cidx_file;
+    if (set_file.size() > 5 && set_file.compare(set_file.size()-5, 5, ".cidx") == 0)
+        set_file.erase(set_file.size()-5);
+    // the index is replaced by the snapshot, in the format it was written
+    // in, which only makes sense if the counts are of the same shape
+    string index_file=set_file+".idx";
+    bool raw=sdbf_sys.index_raw;
+    if (fs::is_regular_file(index_file)) {
+        bloom_filter *old;
+        try {
+            old=new bloom_filter(index_file);
+        } catch (int e) {
+            cerr << "sdhash: ERROR: Could not read index " << index_file << endl;
+            return -1;
+        }
+        bool same=old->partitions() == 1 && old->size() == counting->size() &&
+            old->hash_functions() == counting->hash_functions() && old->layout() == counting->layout();
+        raw=raw || old->raw();
+        delete old;
+        if (!same) {
+            cerr << "sdhash: ERROR: counting index " << cidx_file << " does not match " << index_file << endl;
+            return -1;
+        }
+    }
+    std::vector<std::string> removed;
+    uint64_t features=remove_index_stringlist(files, counting, &removed);
+    std::sort(removed.begin(), removed.end());
+    if (fs::is_regular_file(set_file)) {
+        sdbf_set *set;
+        try {
+            set=new sdbf_set(set_file.c_str());
+        } catch (int e) {
+            cerr << "sdhash: ERROR: Could not load SDBF file "<< set_file << endl;
+            return -1;
+        }
+        sdbf_set *kept=new sdbf_set();
+        for (uint32_t n=0; n < set->size(); n++) {
+            if (!std::binary_search(removed.begin(), removed.end(), set->at(n)->name()))
+                kept->add(set->at(n));
+        }
+        if (sdbf_sys.verbose)
+            cerr << "sdhash: " << set_file << " " << set->size()-kept->size() << " of " << set->size() << " SDBFs removed" << endl;
+        std::filebuf fb;
+        fb.open((set_file+".tmp").c_str(),ios::out|ios::binary);
+        if (!fb.is_open()) {
+            cerr << "sdhash: ERROR cannot write to file " << set_file << endl;
+            return -1;
+        }
+        std::ostream os(&fb);
+        os << kept;
+        fb.close();
+        if (replace_file(set_file+".tmp", set_file))
+            return -1;
+        delete kept;
+        sdbf_set::destory(set);
+    }
+    bloom_filter *plain=counting->snapshot();
+    if (plain->write_out(index_file+".tmp", raw) || replace_file(index_file+".tmp", index_file)) {
+        cerr << "sdhash: ERROR cannot write to file " << index_file << endl;
+        return -1;
+    }
+    delete plain;
+    if (counting->write_out(cidx_file+".tmp") || replace_file(cidx_file+".tmp", cidx_file)) {
+        cerr << "sdhash: ERROR cannot write to file " << cidx_file << endl;
+        return -1;
+    }
+    if (sdbf_sys.verbose) {
+        cerr << "sdhash: " << cidx_file << " " << features << " features removed, " << counting->elem_count() << " left, ";
+        cerr << counting->saturated() << " counters saturated" << endl;
+    }
+    delete counting;
+    return 0;
+}
+
+// where found_file() sends the files it is given
+typedef struct {
+    hash_scheduler *sched;          // hash them as they come, or
+    std::vector<string> *small;     // list those under 16MB
+    std::vector<string> *large;     // and the others
+    bool large_seen;
+} found_files_t;
+
+/**
+    Block size to hash a file with, from -b: files under 16MB in stream
+    mode unless a block size is given, larger ones in block mode unless
+    -b 0 is.
+    \param size file size
+    \returns block size in bytes, 0 for stream mode
+*/
+static uint32_t
+block_bytes(uint64_t size) {
+    if (size < 16*MB)
+        return sdbf_sys.dd_block_size < 1 ? 0 : sdbf_sys.dd_block_size*KB;
+    if (sdbf_sys.dd_block_size == 0)
+        return 0;
+    return (sdbf_sys.dd_block_size == -1 ? 16 : sdbf_sys.dd_block_size)*KB;
+}
+
+/**
+    Takes a file to be hashed: queues it with the scheduler, or adds it
+    to the small or large list.  Called by the directory walker, one file
+    at a time, and for files named directly.
+    \param path file to hash
+    \param st its stat()
+    \param context found_files_t to add it to
+*/
+static void
+found_file(const std::string &path, const struct stat &st, void *context) {
+    found_files_t *found = (found_files_t*)context;
+    uint64_t size = st.st_size;
+    if (sdbf_sys.verbose)
+        cerr << "sdhash: adding file to hashlist " << path << endl;
+    if (size >= sdbf_sys.segment_size && sdbf_sys.warnings) {
+        cerr << "sdhash: Warning: file " << path << " will be segmented in ";
+        cerr << sdbf_sys.segment_size/MB << "MB chunks prior to hashing." << endl;
+    }
+    if (found->sched) {
+        if (size >= 16*MB && !found->large_seen && sdbf_sys.dd_block_size == -1 && (sdbf_sys.warnings || sdbf_sys.verbose))
+            cerr << "sdhash: Warning: files over 16MB are being hashed in block mode. Use -b 0 to disable." << endl;
+        found->sched->add_file(path, st, block_bytes(size), sdbf_sys.segment_size);
+    } else if (size < 16*MB) {
+        found->small->push_back(path);
+    } else {
+        found->large->push_back(path);
+    }
+    if (size >= 16*MB)
+        found->large_seen = true;
+}
+
+// reads the next batch of a stream, on a thread of its own
+static void read_batch(sdbf_stream *stream, uint64_t batch_bytes, sdbf_set **batch)
+{
+    *batch = stream->next(batch_bytes);
+}
+
+/**
+    Compares a set held in memory to a file of digests read a batch at a
+    time, printing each batch's results as soon as it is done.  The next
+    batch is read while one is compared, so the file is read once, from
+    start to end, and at most two batches of it are held at once.
+    \param query set to compare, held in memory
+    \param target_file sdbf file, archive or catalog to read
+    \param batch_bytes bytes of filters to read at a time
+    \param format result format
+    \returns 0 if successful, -1 if the file cannot be read
+*/
+static int
+compare_stream(sdbf_set *query, const string &target_file, uint64_t batch_bytes, uint32_t format)
+{
+    sdbf_stream stream(target_file.c_str());
+    if (stream.open()) {
+        cerr << "sdhash: ERROR: Could not load SDBF file "<< target_file << ". Exiting"<< endl;
+        return -1;
+    }
+    result_sink sink(format, stdout);
+    sink.query_names(query);
+    sdbf_set *batch=stream.next(batch_bytes);
+    uint32_t batches=0;
+    while (batch != NULL) {
+        sink.target_names(batch);
+        sdbf_set *ahead=NULL;
+        boost::thread reader(read_batch, &stream, batch_bytes, &ahead);
+        query->compare_split(batch, sdbf_sys.output_threshold, sdbf_sys.sample_size, sdbf_sys.thread_cnt, result_sink::emit, &sink);
+        // the batch's sdbfs are about to go
+        sink.flush();
+        reader.join();
+        sdbf_set::destory(batch);
+        batch=ahead;
+        batches++;
+    }
+    if (stream.error()) {
+        cerr << "sdhash: ERROR: Could not parse SDBF file "<< target_file << " after " << stream.count() << " SDBFs" << endl;
+        return -1;
+    }
+    if (sdbf_sys.verbose)
+        cerr << "sdhash: compared " << query->size() << " SDBFs to " << stream.count() << " in " << batches << " batches" << endl;
+    return 0;
+}
 
 /** sdhash program main
 */
 int main( int argc, char **argv) {
     uint32_t  i, j, k, file_cnt;
     int rcf;
-    time_t hash_start;
+    time_t hash_start = time(0);
     time_t hash_end; 
     string config_file;
     string listingfile;
@@ -86,8 +406,25 @@ int main( int argc, char **argv) {
     string segment_size;
     string idx_size;
     string idx_dir; // where to find indexes
+    string sliced_file;
+    string tree_file;
+    string tree_build_file;
+    uint32_t tree_fanout = TREE_FANOUT;
+    uint32_t load_budget = LOADER_BUDGET/MB;
+    uint32_t max_memory = 0;
+    uint32_t compare_batch = STREAM_BATCH/MB;
+    string result_name = "text";
+    uint32_t result_format = RESULT_TEXT;
     uint32_t index_size = 16*MB; // default?
+    uint32_t archive_frame = ARCHIVE_FRAME_DIGESTS;
+    string catalog_name;
+    vector<string> catalog_remove;
+    string counting_file;
+    string cache_file;
     vector<string> inputlist;
+    vector<string> include_list;
+    vector<string> exclude_list;
+    uint32_t walk_threads = 0;
     po::variables_map vm;
     po::options_description config("Configuration");
     try {
@@ -98,25 +435,58 @@ int main( int argc, char **argv) {
                 ("config-file,C", po::value<string>(&config_file)->default_value("sdhash.cfg"), "name of config file")
                 ("hash-list,f",po::value<std::string>(&listingfile),"generate SDBFs from list of filenames")
                 ("deep,r", "generate SDBFs from directories and files")
+                ("include",po::value<vector<std::string> >(&include_list),"with -r, hash only files whose names match this pattern")
+                ("exclude",po::value<vector<std::string> >(&exclude_list),"with -r, skip files and directories whose names match this pattern")
+                ("skip-hardlinks","with -r, hash files with several hard links once")
+                ("walk-threads",po::value<uint32_t>(&walk_threads),"with -r, threads to search directories with (default: -p)")
                 ("gen-compare,g", "generate SDBFs and compare all pairs")
                 ("compare,c","compare all pairs in SDBF file, or compare two SDBF files to each other")
+                ("compare-batch",po::value<uint32_t>(&compare_batch),"with -c and two files, read the second NNN MB of digests at a time, comparing as it is read")
+                ("format",po::value<std::string>(&result_name),"with -c or -g, write results as text, json, or binary (a score file)")
+                ("convert-scores","write binary score files out as text, or as json with --format json")
                 ("benchmark,B","compare two SDBF files to each other, and do a benchmark")
                 ("threshold,t",po::value<int32_t>(&sdbf_sys.output_threshold)->default_value(1),"only show results >=threshold")
                 ("block-size,b",po::value<int32_t>(&sdbf_sys.dd_block_size),"hashes input files in nKB blocks")
                 ("threads,p",po::value<uint32_t>(&sdbf_sys.thread_cnt)->default_value(1),"compute threads to use")
                 ("sample-size,s",po::value<uint32_t>(&sdbf_sys.sample_size)->default_value(0),"sample N filters for comparisons")
                 ("segment-size,z",po::value<std::string>(&segment_size),"break files into segments before hashing")
+                ("max-memory",po::value<uint32_t>(&max_memory),"MB of input and working memory hashing may hold at once (default: no limit)")
                 ("name,n",po::value<std::string>(&input_name),"set SDBF name for stdin mode")
                 ("output,o",po::value<std::string>(&output_name),"set output filename")
+                ("unordered","write digests as they complete, not in input order")
                 ("heat-map,m", "show a heat map of BF matches")
+                ("dedup","store and compare identical bloom filters once")
                 ("validate","parse SDBF file to check if it is valid")
+                ("archive","convert SDBF files to compressed archives (.sdbfz)")
+                ("archive-frame",po::value<uint32_t>(&archive_frame),"number of SDBFs per compressed archive frame")
+                ("catalog",po::value<std::string>(&catalog_name),"append generated SDBFs to a set catalog")
+                ("catalog-remove",po::value<vector<std::string> >(&catalog_remove),"remove SDBFs with this name from a set catalog")
+                ("compact","merge the segments of a set catalog, or drop stale entries from a cache")
+                ("cache",po::value<std::string>(&cache_file),"reuse digests of unchanged files from this cache, adding new ones")
+                ("cache-verify","use cached digests only if a checksum of the file matches too")
                 ("index","generate indexes while hashing")
+                ("index-blocked","generate cache-line blocked indexes (one memory access per lookup)")
+                ("index-shards","build a private index per thread, merged when hashing ends")
+                ("index-raw","write uncompressed indexes, which are mapped rather than read")
+                ("index-fp",po::value<double>(&sdbf_sys.index_fp)->default_value(0.01),"false positive rate to size indexes for")
+                ("index-hashes",po::value<uint16_t>(&sdbf_sys.index_hashes)->default_value(5),"hash functions per index feature")
+                ("index-hash32","generate indexes probed by 32-bit words, as earlier versions (up to 512MB)")
+                ("index-counting","also write counting indexes (.cidx), from which files can be removed")
+                ("index-remove",po::value<std::string>(&counting_file),"remove the input files from a counting index, and its set and index")
+                ("index-convert","convert .idx files to the uncompressed format, in place")
                 ("index-dir",po::value<std::string>(&idx_dir),"compare against reference indexes")
+                ("index-sliced","search reference indexes through one bit-sliced index")
+                ("index-sliced-file",po::value<std::string>(&sliced_file),"bit-sliced index file to reuse, or to create")
+                ("index-tree",po::value<std::string>(&tree_file),"search reference indexes through a tree of union filters, read from file")
+                ("index-tree-build",po::value<std::string>(&tree_build_file),"build a tree of union filters over the reference indexes, write it to file")
+                ("index-tree-fanout",po::value<uint32_t>(&tree_fanout),"sets grouped under each node of an index tree")
+                ("load-budget",po::value<uint32_t>(&load_budget),"MB of reference files to read at once while loading")
                 ("search-all","match at file level, all matching sets")
                 ("search-first","match at file level, first match")
                 ("basename","print set matches with only base filenames")
                 ("warnings,w","turn on warnings")
                 ("verbose","debugging and progress output")
+                ("stats",po::value<std::string>(&stats_format)->implicit_value("text"),"print pipeline counters and stage times on exit, --stats=json for JSON")
                 ("version","show version info")
                 ("help,h","produce help message")
             ;
@@ -167,13 +537,75 @@ int main( int argc, char **argv) {
             sdbf_sys.warnings = 1;
             sdbf_sys.verbose = 1;
         }
+        if (vm.count("stats")) {
+            if (stats_format != "text" && stats_format != "json") {
+                cerr << "sdhash: ERROR: --stats format must be text or json" << endl;
+                return -1;
+            }
+            sdbf_stats::enabled = true;
+            atexit(print_stats);
+        }
+        if (result_name == "json") {
+            result_format = RESULT_JSON;
+        } else if (result_name == "binary") {
+            result_format = RESULT_BINARY;
+        } else if (result_name != "text") {
+            cerr << "sdhash: ERROR: --format must be text, json or binary" << endl;
+            return -1;
+        }
+        if (vm.count("convert-scores") && result_format == RESULT_BINARY) {
+            cerr << "sdhash: ERROR: score files convert to text or json" << endl;
+            return -1;
+        }
+        if (vm.count("index-blocked")) {
+            sdbf_sys.index_layout = BF_LAYOUT_BLOCKED | BF_LAYOUT_HASH64;
+        }
+        if (vm.count("index-hash32")) {
+            sdbf_sys.index_layout &= ~BF_LAYOUT_HASH64;
+        }
+        if (!bloom_filter::valid_shape(64, sdbf_sys.index_hashes, sdbf_sys.index_layout)) {
+            cerr << "sdhash: ERROR: index hash count must be 1 to " << (vm.count("index-hash32") ? BF_MAX_PROBES_32 : BF_MAX_PROBES) << endl;
+            return -1;
+        }
+        if (vm.count("index-shards")) {
+            sdbf_sys.index_shards = 1;
+        }
+        if (vm.count("index-raw")) {
+            sdbf_sys.index_raw = 1;
+        }
+        if (sdbf_sys.index_fp <= 0 || sdbf_sys.index_fp >= 1) {
+            cerr << "sdhash: ERROR: index false positive rate must be between 0 and 1" << endl;
+            return -1;
+        }
+        if (vm.count("unordered")) {
+            sdbf_sys.unordered = 1;
+        }
         if (vm.count("segment-size")) {
             sdbf_sys.segment_size = (boost::lexical_cast<uint64_t>(segment_size)) * MB;
         }
         if (vm.count("name")) {    
             sdbf_sys.filename=(char*)input_name.c_str();
         }
-        if (vm.count("index") && !vm.count("output")) {
+        if ((vm.count("index-tree") || vm.count("index-tree-build")) && !vm.count("index-dir")) {
+            cerr << "sdhash: ERROR: index trees require --index-dir" << endl;
+            return -1;
+        }
+        if (vm.count("index-tree") && (vm.count("index-sliced") || vm.count("index-sliced-file"))) {
+            cerr << "sdhash: ERROR: cannot search both an index tree and a bit-sliced index" << endl;
+            return -1;
+        }
+        if (tree_fanout < 2) {
+            cerr << "sdhash: ERROR: index tree fanout must be at least 2" << endl;
+            return -1;
+        }
+        if (vm.count("index-counting")) {
+            if (!vm.count("index") || vm.count("catalog")) {
+                cerr << "sdhash: ERROR: counting indexes require --index and --output" << endl;
+                return -1;
+            }
+            sdbf_sys.index_counting = 1;
+        }
+        if (vm.count("index") && !vm.count("output") && !vm.count("catalog")) {
             cerr << "sdhash:  ERROR: indexing requires output base filename " << endl;
             return -1;
         }
@@ -189,11 +621,17 @@ int main( int argc, char **argv) {
     // possible two sets to load for comparisons
     sdbf_set *set1 = new sdbf_set();
     sdbf_set *set2 = new sdbf_set();
+    // shared unique filter storage, with --dedup
+    filter_table *filters = NULL;
     // indexing search support
     std::vector<bloom_filter *> indexlist;
     std::vector<sdbf_set *> setlist;
     index_info *info=(index_info*)malloc(sizeof(index_info));
     info->index=NULL;
+    info->sliced=NULL;
+    info->tree=NULL;
+    info->counting=NULL;
+    info->counting_remove=false;
     info->indexlist=&indexlist;
     info->setlist=&setlist;
     info->search_deep=true;
@@ -207,29 +645,77 @@ int main( int argc, char **argv) {
     else 
         info->basename=false;
     if (vm.count("index-dir")) {
-	if (sdbf_sys.verbose)
-	    cerr << "loading indexes ";
+        // sorted, so sets are registered in the same order every run
+        std::vector<std::string> idx_files;
         if (fs::is_directory(idx_dir.c_str())) {
             for (fs::directory_iterator itr(idx_dir.c_str()); itr!=fs::directory_iterator(); ++itr) {
-              if (fs::is_regular_file(itr->status()) && (itr->path().extension().string() == ".idx")) {
-                 bloom_filter *indextest=new bloom_filter(itr->path().string());
-                 if (sdbf_sys.verbose && (indexlist.size() % 5 == 0))
-                     cerr<< "." ;
-                 indexlist.push_back(indextest);
-                 sdbf_set *tmp=new sdbf_set((idx_dir+"/"+itr->path().stem().string()).c_str());
-                 setlist.push_back(tmp);
-		 tmp->index=indextest;
-              }
+              if (fs::is_regular_file(itr->status()) && (itr->path().extension().string() == ".idx"))
+                 idx_files.push_back(itr->path().string());
             }
         }
-	if (sdbf_sys.verbose)
-	    cerr << "done"<< endl;
+        std::sort(idx_files.begin(), idx_files.end());
+        set_loader loader(sdbf_sys.thread_cnt, (uint64_t)load_budget*MB, sdbf_sys.verbose ? report_load : NULL);
+        for (i=0; i < idx_files.size(); i++)
+            loader.add(idx_dir+"/"+fs::path(idx_files[i]).stem().string(), idx_files[i]);
+        time_t load_start=time(0);
+        loader.load();
+        for (i=0; i < loader.size(); i++) {
+            load_item_t &item=loader.at(i);
+            if (item.error) {
+                cerr << "sdhash: WARNING: cannot load index " << item.index_file << endl;
+                continue;
+            }
+            indexlist.push_back(item.index);
+            setlist.push_back(item.set);
+        }
+        if (sdbf_sys.verbose)
+            cerr << "sdhash: loaded " << setlist.size() << " sets in " << time(0)-load_start << "s, " << (uint64_t)loader.busy_seconds() << "s of loading" << endl;
+        if ((vm.count("index-sliced") || vm.count("index-sliced-file")) && indexlist.size() > 0)
+            info->sliced=load_sliced(indexlist, setlist, sliced_file);
+        if (vm.count("index-tree") && indexlist.size() > 0)
+            info->tree=load_tree(indexlist, setlist, tree_file, tree_fanout);
+    }
+    // build and save an index tree, and stop
+    if (vm.count("index-tree-build")) {
+        if (indexlist.empty() || !index_tree::compatible(indexlist)) {
+            cerr << "sdhash: ERROR: no reference indexes of one layout in " << idx_dir << endl;
+            return -1;
+        }
+        std::vector<std::string> names;
+        for (uint32_t n=0; n < setlist.size(); n++)
+            names.push_back(setlist.at(n)->name());
+        index_tree *tree=new index_tree(indexlist, names, tree_fanout);
+        if (sdbf_sys.verbose)
+            report_tree(tree);
+        int status=tree->write_out(tree_build_file.c_str());
+        delete tree;
+        if (status) {
+            cerr << "sdhash: ERROR cannot write to file " << tree_build_file << endl;
+            return -1;
+        }
+        return 0;
     }
 
+    // score files back to text
+    if (vm.count("convert-scores")) {
+        for (i=0; i < inputlist.size(); i++) {
+            int status=result_sink::convert(inputlist[i].c_str(), stdout, result_format);
+            if (status == -1) {
+                cerr << "sdhash: ERROR: " << inputlist[i] << " is not a score file" << endl;
+                return -1;
+            } else if (status == -2) {
+                cerr << "sdhash: ERROR: score file " << inputlist[i] << " is damaged" << endl;
+                return -1;
+            } else if (status) {
+                cerr << "sdhash: ERROR: cannot write results" << endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
     // Perform all-pairs comparison
     if (vm.count("compare")) {
         if (inputlist.size()==1) {
-            std::string resultlist;
             // load first set
             try {
                 set1=new sdbf_set(inputlist[0].c_str());
@@ -237,8 +723,25 @@ int main( int argc, char **argv) {
                 cerr << "sdhash: ERROR: Could not load SDBF file "<< inputlist[0] << ". Exiting"<< endl;
                 return -1;
             }
-            resultlist=set1->compare_all(sdbf_sys.output_threshold);
-            cout << resultlist;
+            if (vm.count("dedup")) 
+                filters=dedup_sets(set1, NULL);
+            result_sink sink(result_format, stdout);
+            sink.query_names(set1);
+            set1->compare_all(sdbf_sys.output_threshold, result_sink::emit, &sink);
+        } else if (inputlist.size()==2 && vm.count("compare-batch")) {
+            // the second file may not fit in memory: stream it past the first
+            try {
+                set1=new sdbf_set(inputlist[0].c_str());
+            } catch (int e) {
+                cerr << "sdhash: ERROR: Could not load SDBF file "<< inputlist[0] << ". Exiting"<< endl;
+                return -1;
+            }
+            if (vm.count("dedup") && sdbf_sys.warnings)
+                cerr << "sdhash: Warning: --dedup is not used with --compare-batch" << endl;
+            if (compare_stream(set1, inputlist[1], (uint64_t)compare_batch*MB, result_format)) {
+                sdbf_set::destory(set1);
+                return -1;
+            }
         } else if (inputlist.size()==2) {
             try {
                 set1=new sdbf_set(inputlist[0].c_str());
@@ -253,9 +756,12 @@ int main( int argc, char **argv) {
                 cerr << "sdhash: ERROR: Could not load SDBF file "<< inputlist[1] << ". Exiting"<< endl;
                 return -1;
             }
-            std::string resultlist;
-            resultlist=set1->compare_to(set2,sdbf_sys.output_threshold, sdbf_sys.sample_size);
-            cout << resultlist;
+            if (vm.count("dedup")) 
+                filters=dedup_sets(set1, set2);
+            result_sink sink(result_format, stdout);
+            sink.query_names(set1);
+            sink.target_names(set2);
+            set1->compare_to(set2,sdbf_sys.output_threshold, sdbf_sys.sample_size, result_sink::emit, &sink);
         } else  {
             cerr << "sdhash: ERROR: Comparison requires 1 or 2 arguments." << endl;
             delete set1;
@@ -273,6 +779,7 @@ int main( int argc, char **argv) {
                 delete set2->at(n);
             delete set2;
         }
+        delete filters;
         return 0;
     }
     // Perform tow comparison
@@ -347,8 +854,111 @@ int main( int argc, char **argv) {
         }
         return 0;
     }
+    // convert text sdbf files to archives
+    if (vm.count("archive")) {
+        int status = 0;
+        for (i=0; i< inputlist.size(); i++) { 
+            string archive_name;
+            if (vm.count("output") && inputlist.size() == 1)
+                archive_name = output_name + ".sdbfz";
+            else
+                archive_name = inputlist[i] + "z";
+            int res = sdbf_archive::convert(inputlist[i].c_str(), archive_name.c_str(), archive_frame);
+            if (res == -3) {
+                cerr << "sdhash: ERROR: Could not load file of SDBFs, "<< inputlist[i] << " is empty or invalid."<< endl;
+                status = -1;
+            } else if (res) {
+                cerr << "sdhash: ERROR cannot write to file " << archive_name << endl;
+                status = -1;
+            }
+        }
+        return status;
+    }
+    if (vm.count("index-convert")) {
+        int status = 0;
+        for (i=0; i< inputlist.size(); i++) { 
+            string tmpname = inputlist[i] + ".tmp";
+            try {
+                bloom_filter *index = new bloom_filter(inputlist[i]);
+                int res = index->write_out(tmpname, true);
+                delete index;
+                if (res || rename(tmpname.c_str(), inputlist[i].c_str())) {
+                    cerr << "sdhash: ERROR cannot write to file " << inputlist[i] << endl;
+                    unlink(tmpname.c_str());
+                    status = -1;
+                }
+            } catch (int e) {
+                cerr << "sdhash: ERROR: Could not read index " << inputlist[i] << endl;
+                status = -1;
+            }
+        }
+        return status;
+    }
+    // catalog maintenance
+    if (vm.count("catalog") && (vm.count("catalog-remove") || vm.count("compact"))) {
+        sdbf_catalog cat(catalog_name.c_str());
+        if (cat.open(false)) {
+            cerr << "sdhash: ERROR: Could not read catalog "<< catalog_name << endl;
+            return -1;
+        }
+        for (i=0; i< catalog_remove.size(); i++) {
+            if (cat.remove(catalog_remove[i])) {
+                cerr << "sdhash: ERROR cannot write to file " << catalog_name << endl;
+                return -1;
+            }
+        }
+        if (vm.count("compact")) {
+            if (cat.compact(sdbf_sys.index_fp)) {
+                cerr << "sdhash: ERROR: could not compact catalog " << catalog_name << endl;
+                return -1;
+            }
+            if (sdbf_sys.verbose)
+                cerr << "sdhash: catalog " << catalog_name << " compacted, " << cat.digest_count() << " SDBFs" << endl;
+        }
+        if (!vm.count("input-files") && !vm.count("hash-list"))
+            return 0;
+    }
+    // digests of unchanged files from earlier runs
+    digest_cache *cache = NULL;
+    if (vm.count("cache")) {
+        cache = new digest_cache(cache_file.c_str());
+        if (cache->open()) {
+            cerr << "sdhash: ERROR: Could not read cache "<< cache_file << endl;
+            return -1;
+        }
+        if (vm.count("compact")) {
+            if (cache->compact()) {
+                cerr << "sdhash: ERROR: could not compact cache " << cache_file << endl;
+                return -1;
+            }
+            if (sdbf_sys.verbose)
+                cerr << "sdhash: cache " << cache_file << " compacted, " << cache->record_count() << " entries" << endl;
+        }
+        if (!vm.count("input-files") && !vm.count("hash-list")) {
+            delete cache;
+            return 0;
+        }
+        // digests made while indexing or searching indexes do more than hash
+        if (vm.count("index") || vm.count("index-dir")) {
+            if (sdbf_sys.warnings)
+                cerr << "sdhash: Warning: the cache is not used when indexing or searching indexes" << endl;
+            delete cache;
+            cache = NULL;
+        }
+    }
+    // input buffers and working arrays of files being hashed
+    memory_budget *budget = NULL;
+    if (max_memory)
+        budget = new memory_budget((uint64_t)max_memory*MB);
     std::vector<string> small;
     std::vector<string> large;
+    found_files_t found;
+    found.sched = NULL;
+    found.small = &small;
+    found.large = &large;
+    found.large_seen = false;
+    // keep generated sdbfs in set1 rather than printing them as they go
+    bool keep_set = vm.count("gen-compare") || vm.count("output") || vm.count("index-dir") || vm.count("catalog");
     // Otherwise we are hashing. Make sure we have files.
     if (vm.count("input-files")) {
         // process stdin -- look for - arg
@@ -364,47 +974,40 @@ int main( int argc, char **argv) {
                 sdbf_sys.dd_block_size = 16;
                 set1=sdbf_hash_stdin(info);
             }
+        } else if (vm.count("deep")) {
+            // search directories in parallel; unless building indexes, which
+            // are sized for the whole list, hash files as they are found
+            dir_walker walker(walk_threads ? walk_threads : sdbf_sys.thread_cnt, found_file, &found);
+            for (i=0; i < include_list.size(); i++)
+                walker.include(include_list[i]);
+            for (i=0; i < exclude_list.size(); i++)
+                walker.exclude(exclude_list[i]);
+            walker.skip_hardlinks(vm.count("skip-hardlinks") > 0);
+            if (!vm.count("index") && !vm.count("index-remove")) {
+                found.sched = new hash_scheduler(sdbf_sys.thread_cnt, keep_set ? set1 : NULL, info);
+                if (cache)
+                    found.sched->use_cache(cache, vm.count("cache-verify") > 0);
+                if (budget)
+                    found.sched->limit_memory(budget);
+                hash_start=time(0);
+                found.sched->start();
+            }
+            if (sdbf_sys.verbose) 
+                cerr << "sdhash: Searching directories for files to be hashed" << endl;
+            walker.walk(inputlist);
+            if (sdbf_sys.verbose) {
+                cerr << "sdhash: found " << walker.files() << " files in " << walker.directories() << " directories";
+                if (walker.errors())
+                    cerr << ", " << walker.errors() << " unreadable";
+                cerr << endl;
+            }
         } else {
-            // input list iterator
             if (sdbf_sys.verbose) 
                 cerr << "sdhash: Building list of files to be hashed" << endl;
-            vector<string>::iterator inp;
-            for (inp=inputlist.begin(); inp < inputlist.end(); inp++) {
-                // if recursive mode, then check directories as well
-                if ( vm.count("deep") )  {
-                    try {
-                        if (fs::is_directory(*inp)) 
-                            for ( fs::recursive_directory_iterator end, it(*inp); it!= end; ++it ) 
-                                if (boost::filesystem::is_regular_file(*it)) {
-                                    if (sdbf_sys.verbose) 
-                                        cerr << "sdhash: adding file to hashlist "<< it->path().string() << endl;
-                                    if (fs::file_size(*it) < 16*MB)
-                                        small.push_back(it->path().string());
-                                    else
-                                        large.push_back(it->path().string());
-                                    if ((fs::file_size(it->path()) >= sdbf_sys.segment_size) && sdbf_sys.warnings )  {
-                                        cerr << "Warning: file " << it->path().string() << " will be segmented in ";
-                                        cerr << sdbf_sys.segment_size/MB << "MB chunks prior to hashing."<< endl; 
-                                    }
-                                }
-                    } catch (fs::filesystem_error err) {
-                        cerr << "sdhash: ERROR: Filesystem problem in recursive searching " ;
-                        cerr << err.what() << endl;
-                        continue;
-                    }
-                } // always check if regular file. 
-                if (fs::is_regular_file(*inp)) {    
-                    if (sdbf_sys.verbose) 
-                        cerr << "sdhash: adding file to hashlist "<< *inp << endl;
-                    if (fs::file_size(*inp) < 16*MB) 
-                        small.push_back(*inp);
-                    else 
-                        large.push_back(*inp);
-                    if ((fs::file_size(*inp) >= sdbf_sys.segment_size) && sdbf_sys.warnings )  {
-                        cerr << "sdhash: Warning: file " << *inp << " will be segmented in ";
-                        cerr << sdbf_sys.segment_size/MB << "MB chunks prior to hashing."<< endl; 
-                    }
-                }
+            for (i=0; i < inputlist.size(); i++) {
+                struct stat st;
+                if (!stat(inputlist[i].c_str(), &st) && S_ISREG(st.st_mode))
+                    found_file(inputlist[i], st, &found);
             }
         }
     } else if (vm.count("hash-list")) {
@@ -423,17 +1026,9 @@ int main( int argc, char **argv) {
         std::istringstream fromfile((char*)mlist->buffer);
         std::string fname;
         while (std::getline(fromfile,fname)) {
-            if (fs::is_regular_file(fname)) {
-                if (fs::file_size(fname) < 16*MB) {
-                    small.push_back(fname);
-                } else {
-                    large.push_back(fname);
-                }    
-                if ((fs::file_size(fname) >= sdbf_sys.segment_size) && sdbf_sys.warnings )  {
-                    cerr << "sdhash: Warning: file " << fname << " will be segmented in ";
-                    cerr << sdbf_sys.segment_size/MB << "MB chunks prior to hashing."<< endl; 
-                }
-            }
+            struct stat st;
+            if (!stat(fname.c_str(), &st) && S_ISREG(st.st_mode))
+                found_file(fname, st, &found);
         }
     } else {
          cout << VERSION_INFO << ", rev " << REVISION << endl;
@@ -442,75 +1037,90 @@ int main( int argc, char **argv) {
          cout << config << endl;
          return 0;
     }
+    if (vm.count("index-remove")) {
+        small.insert(small.end(), large.begin(), large.end());
+        return remove_indexed(counting_file, small);
+    }
     // Having built our lists of small/large files, hash them.
     int smallct=small.size();
     int largect=large.size();
+    // appending to a catalog indexes the new segment as a whole
+    if (vm.count("index") && vm.count("catalog")) {
+        uint64_t capacity=0;
+        for (i=0; i < smallct; i++)
+            capacity+=index_capacity(fs::file_size(small[i]), sdbf_sys.dd_block_size > 0 ? sdbf_sys.dd_block_size*KB : 0);
+        for (i=0; i < largect; i++)
+            capacity+=index_capacity(fs::file_size(large[i]), sdbf_sys.dd_block_size != 0 ? (sdbf_sys.dd_block_size > 0 ? sdbf_sys.dd_block_size : 16)*KB : 0);
+        info->index = new bloom_filter(capacity,sdbf_sys.index_fp,sdbf_sys.index_layout,sdbf_sys.index_hashes);
+        set1->index = info->index;
+    }
     // from here, if we are indexing on creation, build things differently.
-    if (vm.count("index")) {
+    if (vm.count("index") && !vm.count("catalog")) {
         delete set1;
 	int status = hash_index_stringlist(small,output_name);
 	int status2 = hash_index_stringlist(large,output_name);
 	return 0;
     } else {
-        hash_start=time(0);         
-        if (smallct > 0) {
-            if (sdbf_sys.verbose)
-                cerr << "sdhash: hashing small files"<< endl;
-            char **smalllist=(char **)alloc_check(ALLOC_ONLY,smallct*sizeof(char*),"main", "filename list", ERROR_EXIT);
-            for (i=0; i < smallct ; i++) {
-                smalllist[i]=(char*)alloc_check(ALLOC_ONLY,small[i].length()+1, "main", "filename", ERROR_EXIT);
-                strncpy(smalllist[i],small[i].c_str(),small[i].length()+1);
+        hash_scheduler *sched=found.sched;
+        if (sched) {
+            // a directory walk has been hashing files as it found them
+            sched->finish();
+        } else {
+            hash_start=time(0);
+            // small and large files share one pool, largest pieces first
+            sched = new hash_scheduler(sdbf_sys.thread_cnt, keep_set ? set1 : NULL, info);
+            if (cache)
+                sched->use_cache(cache, vm.count("cache-verify") > 0);
+            if (budget)
+                sched->limit_memory(budget);
+            for (i=0; i < smallct; i++) {
+                struct stat st;
+                if (!stat(small[i].c_str(), &st))
+                    sched->add_file(small[i], st, block_bytes(st.st_size), sdbf_sys.segment_size);
             }
-            if (sdbf_sys.dd_block_size < 1 )  {
-                if (vm.count("gen-compare") || vm.count("output")||vm.count("index-dir")) // if we need to save this set for comparison
-                    sdbf_hash_files( smalllist, smallct, sdbf_sys.thread_cnt,set1, info);
-                else 
-                    sdbf_hash_files( smalllist, smallct, sdbf_sys.thread_cnt,NULL, info);
-            } else {
-                if (vm.count("gen-compare") || vm.count("output")||vm.count("index-dir"))
-                    sdbf_hash_files_dd( smalllist, smallct, sdbf_sys.dd_block_size*KB,sdbf_sys.segment_size, set1, info);
-		else 
-                    sdbf_hash_files_dd( smalllist, smallct, sdbf_sys.dd_block_size*KB,sdbf_sys.segment_size, NULL, info);
+            if (largect > 0 && sdbf_sys.dd_block_size == -1 && (sdbf_sys.warnings || sdbf_sys.verbose))
+                cerr << "sdhash: Warning: files over 16MB are being hashed in block mode. Use -b 0 to disable." << endl;
+            for (i=0; i < largect; i++) {
+                struct stat st;
+                if (!stat(large[i].c_str(), &st))
+                    sched->add_file(large[i], st, block_bytes(st.st_size), sdbf_sys.segment_size);
             }
+            sched->run();
+        }
+        if (sdbf_sys.verbose) {
+            cerr << "sdhash: hashed " << sched->size() << " items, " << sched->total_bytes()/MB << "MB" << endl;
+            cerr << "sdhash: resident " << memory_budget::current_rss()/MB << "MB, peak " << memory_budget::peak_rss()/MB << "MB" << endl;
+            if (budget)
+                cerr << "sdhash: " << sched->windowed() << " items hashed a window at a time, " << budget->peak()/MB << "MB of " << max_memory << "MB budget used" << endl;
         }
-        if (largect > 0) {
+        if (cache) {
             if (sdbf_sys.verbose)
-                cerr << "sdhash: hashing large files"<< endl;
-            char **largelist=(char **)alloc_check(ALLOC_ONLY,largect*sizeof(char*),"main", "filename list", ERROR_EXIT);
-            for (i=0; i < largect ; i++) {
-                largelist[i]=(char*)alloc_check(ALLOC_ONLY,large[i].length()+1, "main", "filename", ERROR_EXIT);
-                strncpy(largelist[i],large[i].c_str(),large[i].length()+1);
-            }
-            if (sdbf_sys.dd_block_size == 0 ) {
-                if (vm.count("gen-compare")) // if we need to save this set for comparison
-                    sdbf_hash_files( largelist, largect, sdbf_sys.thread_cnt,set1, info);
-                else
-                    sdbf_hash_files( largelist, largect, sdbf_sys.thread_cnt,NULL, info);
-            } else {
-                if (sdbf_sys.dd_block_size == -1) { 
-                    if (sdbf_sys.warnings || sdbf_sys.verbose) 
-                       cerr << "sdhash: Warning: files over 16MB are being hashed in block mode. Use -b 0 to disable." << endl;
-                    if (vm.count("gen-compare")|| vm.count("output") ||vm.count("index-dir")) // if we need to save this set for comparison
-                        sdbf_hash_files_dd( largelist, largect, 16*KB,sdbf_sys.segment_size, set1, info);
-                    else
-                        sdbf_hash_files_dd( largelist, largect, 16*KB,sdbf_sys.segment_size, NULL, info);
-                } else {
-                    if (vm.count("gen-compare")||vm.count("output") ||vm.count("index-dir")) // if we need to save this set for comparison
-                        sdbf_hash_files_dd( largelist, largect, sdbf_sys.dd_block_size*KB,sdbf_sys.segment_size, set1, info);
-                    else 
-                        sdbf_hash_files_dd( largelist, largect, sdbf_sys.dd_block_size*KB,sdbf_sys.segment_size, NULL, info);
-                }
-            }
-        } // if large files exist
+                cerr << "sdhash: " << sched->cache_hits() << " of " << sched->size() << " items from cache" << endl;
+            if (cache->flush())
+                cerr << "sdhash: ERROR cannot write to cache " << cache_file << endl;
+            delete cache;
+        }
+        delete sched;
+        delete budget;
         hash_end=time(0);
         if (sdbf_sys.verbose)
             cerr << hash_end - hash_start << " seconds hash time" << endl;
     } // if not indexing
     // print it out if we've been asked to
-    if (vm.count("gen-compare")) {
-        string resultlist;
-        resultlist=set1->compare_all(sdbf_sys.output_threshold);
-        cout << resultlist;
+    if (vm.count("catalog")) {
+        sdbf_catalog cat(catalog_name.c_str());
+        if (cat.append(set1, set1->index)) {
+            cerr << "sdhash: ERROR cannot write to catalog " << catalog_name << endl;
+            return -1;
+        }
+        delete set1->index;
+        set1->index = NULL;
+    } else if (vm.count("gen-compare")) {
+        if (vm.count("dedup")) 
+            filters=dedup_sets(set1, NULL);
+        result_sink sink(result_format, stdout);
+        sink.query_names(set1);
+        set1->compare_all(sdbf_sys.output_threshold, result_sink::emit, &sink);
     } else {
         if (vm.count("output")) {
             if (vm.count("index-dir")) {
@@ -564,7 +1174,11 @@ int main( int argc, char **argv) {
             delete set2->at(n);
         delete set2;
     }
-    if (info)
+    delete filters;
+    if (info) {
+        delete info->sliced;
+        delete info->tree;
 	free(info);
+    }
     return 0;
 }
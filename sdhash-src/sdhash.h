@@ -41,5 +41,12 @@ typedef struct {
 	uint32_t  verbose;
 	uint64_t  segment_size;
 	char *filename;
+	uint32_t  unordered;
+	uint32_t  index_layout;
+	uint32_t  index_shards;  // per-thread indexes merged after hashing
+	uint32_t  index_raw;     // write uncompressed, mappable indexes
+	double    index_fp;      // false positive rate indexes are sized for
+	uint32_t  index_counting; // also write counting indexes, for removal
+	uint16_t  index_hashes;  // hash functions per index feature
 } sdbf_parameters_t;
 
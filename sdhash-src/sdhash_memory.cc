@@ -0,0 +1,106 @@
+// sdhash_memory.cc
+// a memory budget shared by hashing threads
+
+#include "sdhash_memory.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/**
+    Creates a budget with nothing reserved.
+    \param limit bytes that may be reserved at once
+*/
+memory_budget::memory_budget(uint64_t limit) {
+    budget = limit;
+    in_use = 0;
+    most = 0;
+}
+
+/**
+   \internal
+   Whether bytes more fit; the caller holds the lock.
+*/
+bool
+memory_budget::fits(uint64_t bytes) const {
+    return in_use == 0 || in_use + bytes <= budget;
+}
+
+/**
+    Reserves memory, waiting for other threads to release enough.
+    \param bytes bytes to reserve
+*/
+void
+memory_budget::reserve(uint64_t bytes) {
+    boost::mutex::scoped_lock guard(lock);
+    while (!fits(bytes))
+        released.wait(guard);
+    in_use += bytes;
+    if (in_use > most)
+        most = in_use;
+}
+
+/**
+    Reserves memory if that can be done without waiting.
+    \param bytes bytes to reserve
+    \returns true if reserved
+*/
+bool
+memory_budget::try_reserve(uint64_t bytes) {
+    boost::mutex::scoped_lock guard(lock);
+    if (!fits(bytes))
+        return false;
+    in_use += bytes;
+    if (in_use > most)
+        most = in_use;
+    return true;
+}
+
+/**
+    Gives back memory reserved, waking threads waiting for it.
+    \param bytes bytes reserved
+*/
+void
+memory_budget::release(uint64_t bytes) {
+    {
+        boost::mutex::scoped_lock guard(lock);
+        in_use -= bytes;
+    }
+    released.notify_all();
+}
+
+uint64_t
+memory_budget::limit() const {
+    return budget;
+}
+
+uint64_t
+memory_budget::peak() const {
+    return most;
+}
+
+/**
+    Reads the resident set size from /proc/self/statm.
+    \returns bytes resident, 0 if not known
+*/
+uint64_t
+memory_budget::current_rss() {
+    FILE *in = fopen("/proc/self/statm", "r");
+    if (in == NULL)
+        return 0;
+    unsigned long long size, resident;
+    int got = fscanf(in, "%llu %llu", &size, &resident);
+    fclose(in);
+    if (got != 2)
+        return 0;
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+uint64_t
+memory_budget::peak_rss() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+    // kilobytes, on Linux
+    return (uint64_t)usage.ru_maxrss * 1024;
+}
@@ -0,0 +1,55 @@
+/**
+ * sdhash_memory.h: a memory budget shared by hashing threads
+ */
+#ifndef __SDHASH_MEMORY_H
+#define __SDHASH_MEMORY_H
+
+#include <stdint.h>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+    memory_budget: bytes of input buffers and working arrays that hashing
+    threads may hold at once.  A thread reserves what an item needs before
+    reading it, and gives it back when the digest is made; a thread whose
+    item does not fit waits for others to finish, or, with try_reserve(),
+    can hash the item some other way that needs less.  An item larger
+    than the whole budget is let through once nothing else is reserved,
+    so it runs alone rather than never.
+*/
+/// memory_budget class
+class memory_budget {
+
+public:
+    /// budget of limit bytes
+    memory_budget(uint64_t limit);
+
+    /// reserve bytes, waiting until they fit
+    void reserve(uint64_t bytes);
+    /// reserve bytes if they fit now
+    bool try_reserve(uint64_t bytes);
+    /// give back bytes reserved
+    void release(uint64_t bytes);
+
+    /// the budget
+    uint64_t limit() const;
+    /// most reserved at once
+    uint64_t peak() const;
+
+    /// resident set size of this process, in bytes
+    static uint64_t current_rss();
+    /// largest resident set size of this process so far, in bytes
+    static uint64_t peak_rss();
+
+private:
+    bool fits(uint64_t bytes) const;
+
+    uint64_t budget;
+    boost::mutex lock;
+    boost::condition_variable released;
+    uint64_t in_use;
+    uint64_t most;
+};
+
+#endif
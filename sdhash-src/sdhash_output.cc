@@ -0,0 +1,165 @@
+// sdhash_output.cc
+// author: candice quates
+// single-writer output stage for generated digests
+
+#include "sdhash_output.h"
+#include "../sdbf/sdbf_stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+    Creates writer and starts its thread.
+    \param fd open file descriptor to write to
+    \param ordered emit items in sequence order (otherwise as completed)
+    \param window number of items allowed to run ahead of the next one
+                  to be written in ordered mode. 0 is unbounded.
+*/
+output_writer::output_writer(int fd, bool ordered, uint32_t window) {
+    this->fd = fd;
+    this->in_order = ordered;
+    this->window = window;
+    this->next_seq = 0;
+    this->done = false;
+    writer = new boost::thread(&output_writer::run, this);
+}
+
+/**
+    Writes anything outstanding and stops the writer thread.
+*/
+output_writer::~output_writer() {
+    finish();
+}
+
+/**
+    Hands an encoded buffer to the writer.  In ordered mode it is written
+    once all items before seq have been written, and submit blocks if seq
+    is too far ahead.  The contents of data are taken over.
+    \param seq sequence number of item (input order)
+    \param data encoded digests, emptied on return
+*/
+void
+output_writer::submit(uint64_t seq, std::string &data) {
+    boost::unique_lock<boost::mutex> guard(lock);
+    if (in_order) {
+        while (window && seq >= next_seq + window && !done)
+            space.wait(guard);
+        pending[seq].swap(data);
+    } else {
+        while (completed.size() >= 4*OUTPUT_WRITE_SIZE && !done)
+            space.wait(guard);
+        completed.append(data);
+    }
+    data.clear();
+    ready.notify_one();
+}
+
+/**
+    Marks item seq as having no output, so later items are not held up.
+    \param seq sequence number of item
+*/
+void
+output_writer::skip(uint64_t seq) {
+    std::string empty;
+    submit(seq, empty);
+}
+
+/**
+    Waits until everything submitted is written.  Called by the destructor.
+*/
+void
+output_writer::finish() {
+    if (!writer)
+        return;
+    {
+        boost::lock_guard<boost::mutex> guard(lock);
+        done = true;
+    }
+    ready.notify_one();
+    space.notify_all();
+    writer->join();
+    delete writer;
+    writer = NULL;
+}
+
+bool
+output_writer::ordered() const {
+    return in_order;
+}
+
+/**
+   \internal
+   Moves whatever is ready to be written into out.  Caller holds lock.
+*/
+void
+output_writer::collect(std::string &out) {
+    if (in_order) {
+        std::map<uint64_t,std::string>::iterator it = pending.begin();
+        // once finished, nothing else is coming: write leftovers in order
+        while (it != pending.end() && (it->first == next_seq || done)) {
+            out.append(it->second);
+            next_seq = it->first + 1;
+            pending.erase(it++);
+        }
+    } else {
+        if (out.empty())
+            out.swap(completed);
+        else {
+            out.append(completed);
+            completed.clear();
+        }
+    }
+    space.notify_all();
+}
+
+/**
+   \internal
+   Writer thread.  Batches ready output into large writes.
+*/
+void
+output_writer::run() {
+    std::string out;
+    bool finished = false;
+    while (!finished) {
+        {
+            boost::unique_lock<boost::mutex> guard(lock);
+            collect(out);
+            while (!done && out.size() < OUTPUT_WRITE_SIZE) {
+                bool woken = ready.timed_wait(guard, boost::posix_time::milliseconds(OUTPUT_FLUSH_MS));
+                collect(out);
+                if (!woken && !out.empty())
+                    break;
+            }
+            collect(out);
+            finished = done && pending.empty() && completed.empty();
+        }
+        write_all(out);
+        out.clear();
+    }
+}
+
+/**
+   \internal
+   write() the whole buffer, coping with short writes.
+*/
+void
+output_writer::write_all(const std::string &data) {
+    const char *pos = data.data();
+    size_t left = data.size();
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = stats ? sdbf_stats::now() : 0;
+    while (left > 0) {
+        ssize_t res = ::write(fd, pos, left);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "sdhash: ERROR: output write failed: %s\n", strerror(errno));
+            break;
+        }
+        pos += res;
+        left -= res;
+    }
+    stats_lap(stats, STAT_OUTPUT, &since);
+}
@@ -0,0 +1,65 @@
+/**
+ * sdhash_output.h: ordered output stage for digest generation
+ * author: candice quates
+ */
+#ifndef __SDHASH_OUTPUT_H
+#define __SDHASH_OUTPUT_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "../sdbf/util.h"
+
+// hand a worker's buffer to the writer once it grows past this (unordered mode)
+#define OUTPUT_BATCH_SIZE   (1*MB)
+// writer issues one write() once this much output is ready
+#define OUTPUT_WRITE_SIZE   (4*MB)
+// or once output has been waiting this long
+#define OUTPUT_FLUSH_MS     200
+
+/**
+    Single writer thread for encoded digests.  Workers encode into their
+    own buffers and hand them over with submit(); the writer emits them
+    with large write() calls, either in sequence order or as completed.
+*/
+class output_writer {
+
+public:
+    /// starts writer thread on file descriptor fd
+    output_writer(int fd, bool ordered, uint32_t window);
+    /// flushes remaining output and stops the writer
+    ~output_writer();
+
+    /// hand over encoded output for item seq. data is left empty.
+    void submit(uint64_t seq, std::string &data);
+    /// mark item seq as producing no output
+    void skip(uint64_t seq);
+    /// wait for all submitted output to be written
+    void finish();
+    /// true if output is emitted in sequence order
+    bool ordered() const;
+
+private:
+    void run();
+    void collect(std::string &out);
+    void write_all(const std::string &data);
+
+    int fd;
+    bool in_order;
+    bool done;
+    uint32_t window;            // max items ahead of next_seq (ordered mode)
+    uint64_t next_seq;          // next item to be emitted (ordered mode)
+    std::map<uint64_t,std::string> pending;  // finished items waiting their turn
+    std::string completed;      // items in completion order (unordered mode)
+    boost::mutex lock;
+    boost::condition_variable ready;
+    boost::condition_variable space;
+    boost::thread *writer;
+};
+
+#endif
@@ -0,0 +1,502 @@
+// sdhash_schedule.cc
+// size-aware scheduling of files to be hashed
+
+#include "../sdbf/sdbf_class.h"
+#include "../sdbf/sdbf_defines.h"
+#include "sdhash.h"
+#include "sdhash_schedule.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+extern sdbf_parameters_t sdbf_sys;
+
+// orders item positions for the waiting heap: largest on top, then earliest
+struct smaller_item {
+    const std::vector<hash_item_t> *items;
+    bool operator()(uint32_t a, uint32_t b) const {
+        if ((*items)[a].length != (*items)[b].length)
+            return (*items)[a].length < (*items)[b].length;
+        return a > b;
+    }
+};
+
+/**
+    Creates a scheduler with nothing queued.
+    \param thread_cnt threads to hash with
+    \param addto set to add digests to, or NULL to write them to stdout
+    \param info index information passed to each digest
+*/
+hash_scheduler::hash_scheduler(uint32_t thread_cnt, sdbf_set *addto, index_info *info) {
+    if (thread_cnt < 1)
+        thread_cnt = 1;
+    if (thread_cnt > MAX_THREADS)
+        thread_cnt = MAX_THREADS;
+    this->thread_cnt = thread_cnt;
+    this->addto = addto;
+    this->info = info;
+    writer = NULL;
+    cache = NULL;
+    verify = false;
+    budget = NULL;
+    hits = 0;
+    windows = 0;
+    pool = NULL;
+    remaining = 0;
+    closed = false;
+    frontier = 0;
+    held = 0;
+}
+
+/**
+    Queues a file.  In block mode a file over segment_size is split into
+    segments, named and sized as sdbf_hash_files_dd() does, each hashed as
+    a separate item.  Safe to call while hashing runs.
+    \param fname file to hash
+    \param st its stat()
+    \param block_size block size in bytes, 0 for stream mode
+    \param segment_size segment size in bytes, 0 for none
+*/
+void
+hash_scheduler::add_file(const std::string &fname, const struct stat &st, uint32_t block_size, uint64_t segment_size) {
+    uint64_t filesize = st.st_size;
+    std::vector<hash_item_t> pieces;
+    hash_item_t item;
+    item.file = fname;
+    item.name = fname;
+    item.offset = 0;
+    item.length = filesize;
+    item.block_size = block_size;
+    item.first = true;
+    item.st = st;
+    if (!block_size || segment_size == 0 || filesize <= segment_size) {
+        pieces.push_back(item);
+    } else {
+        int64_t chunks = filesize / segment_size;
+        bool tailflag = false;
+        // adjusting for too small of a last fragment
+        if (filesize - segment_size <= 512)
+            chunks = 0;
+        if (filesize - chunks*segment_size <= 512) {
+            chunks--;
+            tailflag = true;
+        }
+        for (int64_t j = 0; j <= chunks; j++) {
+            std::stringstream namestr;
+            namestr << fname;
+            if (j > 0 || chunks > 0) {
+                namestr.fill('0');
+                namestr << "." << setw(4) << j*segment_size/MB << "M";
+            }
+            item.name = namestr.str();
+            item.offset = j*segment_size;
+            item.first = (j == 0);
+            if (j == chunks) {
+                // the last segment takes in a tail too small to stand alone
+                item.length = filesize - chunks*segment_size;
+                if (tailflag)
+                    item.length += filesize - (chunks+1)*segment_size;
+            } else {
+                item.length = segment_size;
+            }
+            pieces.push_back(item);
+        }
+    }
+    {
+        boost::mutex::scoped_lock guard(lock);
+        smaller_item cmp;
+        cmp.items = &items;
+        for (uint32_t p = 0; p < pieces.size(); p++) {
+            items.push_back(pieces[p]);
+            if (addto)
+                results.push_back((class sdbf *)NULL);
+            waiting.push_back(items.size() - 1);
+            std::push_heap(waiting.begin(), waiting.end(), cmp);
+            remaining += pieces[p].length;
+        }
+    }
+    added.notify_all();
+}
+
+/**
+    Takes digests from a cache where it has them for the file as it is,
+    and adds the digests made to it.  Call before start().
+    \param cache cache, already open
+    \param verify read items the cache has, and use the cached digest
+           only if the checksum of the bytes matches too
+*/
+void
+hash_scheduler::use_cache(digest_cache *cache, bool verify) {
+    this->cache = cache;
+    this->verify = verify;
+}
+
+/**
+    Keeps the memory held by items being hashed within a budget.  Call
+    before start().
+    \param budget budget, shared with anything else that reserves from it
+*/
+void
+hash_scheduler::limit_memory(memory_budget *budget) {
+    this->budget = budget;
+}
+
+/**
+    Hashes everything queued, returning when all are done.
+*/
+void
+hash_scheduler::run() {
+    closed = true;
+    start();
+    finish();
+}
+
+/**
+    Starts the hashing threads.  Without run(), they wait for files
+    until finish() is called.
+*/
+void
+hash_scheduler::start() {
+    if (!addto) {
+        cout.flush();
+        // items finish out of order, so the writer's window cannot be
+        // bounded; thread_hash() bounds the output held instead
+        writer = new output_writer(STDOUT_FILENO, !sdbf_sys.unordered, 0);
+    }
+    // when every item is known, no more threads than items
+    uint32_t threads = closed ? std::min((uint32_t)items.size(), thread_cnt) : thread_cnt;
+    // with shards, each thread inserts into its own copy of the index
+    if (sdbf_sys.index_shards && info && info->index && threads > 1) {
+        shard_info.assign(threads, *info);
+        for (uint32_t t = 0; t < threads; t++)
+            shard_info[t].index = new bloom_filter(info->index->size(), info->index->hash_functions(), 0, 0.01, info->index->layout());
+    }
+    // a single thread for a known list is the caller's, in finish()
+    if (closed && threads <= 1)
+        return;
+    pool = new boost::thread_group;
+    for (uint32_t t = 0; t < threads; t++)
+        pool->create_thread(boost::bind(&hash_scheduler::thread_hash, this, shard_info.empty() ? info : &shard_info[t]));
+}
+
+/**
+    Marks the end of the files, waits for the threads to hash the rest,
+    then writes or collects the digests.
+*/
+void
+hash_scheduler::finish() {
+    {
+        boost::mutex::scoped_lock guard(lock);
+        closed = true;
+    }
+    added.notify_all();
+    if (pool) {
+        pool->join_all();
+        delete pool;
+        pool = NULL;
+    } else {
+        thread_hash(this, info);
+    }
+    for (uint32_t t = 0; t < shard_info.size(); t++) {
+        info->index->add(shard_info[t].index);
+        delete shard_info[t].index;
+    }
+    // features seen by several threads were counted by each
+    if (!shard_info.empty())
+        info->index->recount();
+    shard_info.clear();
+    if (writer) {
+        delete writer;
+        writer = NULL;
+    } else {
+        for (uint32_t n = 0; n < results.size(); n++) {
+            if (results[n])
+                addto->add(results[n]);
+        }
+        results.clear();
+    }
+}
+
+/**
+    Hashing thread: takes the largest item not yet started until none are
+    left, or the earliest unfinished item while too much ordered output
+    is held.  Once all files are added, a block-mode item gets block
+    threads in proportion to its share of the bytes not yet started, so
+    items well under their share run on one thread, and a last large
+    item on all of them; while files are still coming each runs on one.
+*/
+void
+hash_scheduler::thread_hash(hash_scheduler *sched, index_info *info) {
+    std::string encoded; // this thread's output buffer
+    uint32_t n = 0;
+    smaller_item cmp;
+    cmp.items = &sched->items;
+    for (;;) {
+        uint32_t threads = 1;
+        hash_item_t item;
+        {
+            boost::mutex::scoped_lock guard(sched->lock);
+            std::vector<uint32_t>::iterator earliest;
+            for (;;) {
+                while (sched->waiting.empty() && !sched->closed)
+                    sched->added.wait(guard);
+                if (sched->waiting.empty() || sched->held < HELD_OUTPUT_MAX)
+                    break;
+                // only the earliest unfinished item frees held output
+                earliest = std::find(sched->waiting.begin(), sched->waiting.end(), sched->frontier);
+                if (earliest != sched->waiting.end())
+                    break;
+                sched->added.wait(guard);
+            }
+            if (sched->waiting.empty())
+                break;
+            if (sched->held < HELD_OUTPUT_MAX) {
+                std::pop_heap(sched->waiting.begin(), sched->waiting.end(), cmp);
+                n = sched->waiting.back();
+                sched->waiting.pop_back();
+            } else {
+                n = *earliest;
+                sched->waiting.erase(earliest);
+                std::make_heap(sched->waiting.begin(), sched->waiting.end(), cmp);
+            }
+            // copied, as items may grow meanwhile
+            item = sched->items[n];
+            if (item.block_size && sched->closed && sched->remaining)
+                threads = (uint32_t)((double)sched->thread_cnt*item.length/sched->remaining + 0.5);
+            sched->remaining -= item.length;
+        }
+        threads = std::max(1U, std::min(threads, sched->thread_cnt));
+        sched->hash_item(n, item, info, threads, encoded);
+    }
+    if (sched->writer && !encoded.empty())
+        sched->writer->submit(n, encoded);
+}
+
+/**
+    Hashes one item, encoding its digest into encoded, or keeping it for
+    the set.
+    \param n item position
+    \param item the item
+    \param info index information for the digest
+    \param threads block threads, in block mode
+    \param encoded this thread's output buffer
+*/
+void
+hash_scheduler::hash_item(uint32_t n, const hash_item_t &item, index_info *info, uint32_t threads, std::string &encoded) {
+    cache_record_t rec;
+    if (cache && cached_item(n, item, rec, encoded)) {
+        if (writer && (writer->ordered() || encoded.size() >= OUTPUT_BATCH_SIZE))
+            submit(n, encoded);
+        return;
+    }
+    ifstream is(item.file.c_str(), ios::binary);
+    uint64_t window = 0, reserved = 0;
+    if (is.is_open() && budget) {
+        reserved = item_memory(item, threads, 0);
+        // windows are taken over waiting, and over holding all of an item
+        // larger than the budget
+        if (reserved > budget->limit() || !budget->try_reserve(reserved)) {
+            if (item.block_size) {
+                // fewer blocks a thread, then fewer threads, until the
+                // window fits the budget, down to one block on one thread
+                uint32_t blocks = WINDOW_BLOCKS;
+                for (;;) {
+                    window = (uint64_t)threads*item.block_size*blocks;
+                    reserved = item_memory(item, threads, window);
+                    if (reserved <= budget->limit() || (blocks == 1 && threads == 1))
+                        break;
+                    if (blocks > 1)
+                        blocks /= 2;
+                    else
+                        threads--;
+                }
+                __sync_fetch_and_add(&windows, 1);
+                if (sdbf_sys.verbose)
+                    cerr << "sdhash: memory budget reached, hashing " << item.name << " " << window/KB << "KB at a time on " << threads << " threads, resident " << memory_budget::current_rss()/MB << "MB" << endl;
+            }
+            budget->reserve(reserved);
+        }
+    }
+    if (is.is_open()) {
+        if (item.offset)
+            is.seekg(item.offset);
+        if (sdbf_sys.verbose && item.first)
+            cerr << "sdhash: digesting file " << item.file << endl;
+        // digests keep a pointer to their name
+        char *name = (char*)alloc_check(ALLOC_ONLY, item.name.length()+1, "hash_item", "name", ERROR_EXIT);
+        strncpy(name, item.name.c_str(), item.name.length()+1);
+        try {
+            class sdbf *sdbfm = new sdbf(name, &is, item.block_size, item.length, info, threads, window);
+            if (cache) {
+                std::string digest;
+                sdbfm->encode(digest);
+                cache->add(rec, digest);
+                if (writer)
+                    encoded += digest;
+            } else if (writer) {
+                sdbfm->encode(encoded);
+            }
+            if (writer) {
+                delete sdbfm;
+            } else {
+                boost::mutex::scoped_lock guard(lock);
+                results[n] = sdbfm;
+            }
+        } catch (int e) {
+            free(name);
+            if (e == -2)
+                exit(-2);
+            if (e == -3 && cache)
+                cache->add(rec, std::string());
+            if (e == -3 && sdbf_sys.warnings)
+                cerr << "Input file too small for processing: " << item.name << endl;
+        }
+    }
+    if (reserved)
+        budget->release(reserved);
+    if (writer && (writer->ordered() || encoded.size() >= OUTPUT_BATCH_SIZE))
+        submit(n, encoded);
+}
+
+/**
+    Hands an item's output to the writer.  In order, the output is held
+    until the items before it are written, which is accounted here.
+    \param n item position
+    \param encoded output, left empty
+*/
+void
+hash_scheduler::submit(uint32_t n, std::string &encoded) {
+    if (writer->ordered()) {
+        boost::mutex::scoped_lock guard(lock);
+        if (n == frontier) {
+            frontier++;
+            std::map<uint32_t,uint64_t>::iterator it;
+            while ((it = held_items.find(frontier)) != held_items.end()) {
+                held -= it->second;
+                held_items.erase(it);
+                frontier++;
+            }
+            added.notify_all();
+        } else {
+            held_items[n] = encoded.size();
+            held += encoded.size();
+        }
+    }
+    writer->submit(n, encoded);
+}
+
+/**
+    Estimates the memory an item holds while it is hashed: its input,
+    whole or a window at a time, the rank and score arrays (4 bytes a
+    byte) of each thread hashing it, and its digest.
+    \param item the item
+    \param threads block threads, in block mode
+    \param window bytes of input held at once, 0 for all
+    \returns bytes
+*/
+uint64_t
+hash_scheduler::item_memory(const hash_item_t &item, uint32_t threads, uint64_t window) {
+    uint64_t held = (window && window < item.length) ? window : item.length;
+    // stream mode: arrays cover the item, up to a 32MB chunk; filters 1 byte in 8
+    if (!item.block_size)
+        return held + 4*std::min(item.length, (uint64_t)32*MB) + item.length/8;
+    return held + (uint64_t)threads*4*item.block_size + (item.length/item.block_size + 1)*(BF_SIZE + 2);
+}
+
+/**
+    Looks an item up in the cache, and uses the digest found: encoded
+    into encoded, or kept for the set.
+    \param n item position
+    \param item the item
+    \param rec set to the item's cache record, to add if it is not found
+    \param encoded this thread's output buffer
+    \returns true if the cached digest was used
+*/
+bool
+hash_scheduler::cached_item(uint32_t n, const hash_item_t &item, cache_record_t &rec, std::string &encoded) {
+    rec.file = item.file;
+    rec.name = item.name;
+    rec.dev = item.st.st_dev;
+    rec.ino = item.st.st_ino;
+    rec.size = item.st.st_size;
+    rec.mtime_sec = item.st.st_mtim.tv_sec;
+    rec.mtime_nsec = item.st.st_mtim.tv_nsec;
+    rec.offset = item.offset;
+    rec.length = item.length;
+    rec.block_size = item.block_size;
+    rec.has_checksum = false;
+    rec.checksum = 0;
+    if (verify) {
+        int fd = ::open(item.file.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        rec.has_checksum = !digest_cache::checksum(fd, item.offset, item.length, &rec.checksum);
+        close(fd);
+        if (!rec.has_checksum)
+            return false;
+    }
+    cache_record_t found;
+    std::string digest;
+    if (!cache->lookup(rec, &found) || cache->read_digest(found, digest))
+        return false;
+    if (!digest.empty()) {
+        if (writer) {
+            encoded += digest;
+        } else {
+            // read as from a set file; a digest that does not parse is made again
+            FILE *in = fmemopen(&digest[0], digest.size(), "r");
+            if (in == NULL)
+                return false;
+            class sdbf *sdbfm = NULL;
+            try {
+                sdbfm = new sdbf(in);
+            } catch (int e) {
+                sdbfm = NULL;
+            }
+            fclose(in);
+            if (sdbfm == NULL)
+                return false;
+            boost::mutex::scoped_lock guard(lock);
+            results[n] = sdbfm;
+        }
+    }
+    if (sdbf_sys.verbose && item.first)
+        cerr << "sdhash: digest of " << item.file << " from cache" << endl;
+    __sync_fetch_and_add(&hits, 1);
+    return true;
+}
+
+uint32_t
+hash_scheduler::size() const {
+    return items.size();
+}
+
+uint64_t
+hash_scheduler::total_bytes() const {
+    uint64_t total = 0;
+    for (uint32_t n = 0; n < items.size(); n++)
+        total += items[n].length;
+    return total;
+}
+
+uint64_t
+hash_scheduler::cache_hits() const {
+    return hits;
+}
+
+uint64_t
+hash_scheduler::windowed() const {
+    return windows;
+}
@@ -0,0 +1,128 @@
+/**
+ * sdhash_schedule.h: size-aware scheduling of files to be hashed
+ */
+#ifndef __SDHASH_SCHEDULE_H
+#define __SDHASH_SCHEDULE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "../sdbf/sdbf_class.h"
+#include "../sdbf/sdbf_set.h"
+#include "../sdbf/digest_cache.h"
+#include "sdhash_output.h"
+#include "sdhash_memory.h"
+
+// blocks per block thread held at once, for items hashed a window at a time
+#define WINDOW_BLOCKS 64
+// ordered output held for items finished ahead of an earlier one, past
+// which only that earlier item is started
+#define HELD_OUTPUT_MAX (64*MB)
+
+// One digest to generate: a whole file, or one segment of it
+typedef struct {
+    std::string file;        // file to read
+    std::string name;        // digest name: file, or file.NNNNM for a segment
+    uint64_t    offset;      // where the data starts in file
+    uint64_t    length;      // bytes to hash
+    uint32_t    block_size;  // block size, 0 for stream mode
+    bool        first;       // first item of its file
+    struct stat st;          // state of file when added, for the cache
+} hash_item_t;
+
+/**
+    hash_scheduler: hashes a list of files on one pool of threads.  Files
+    hashed in block mode are split into their segments, each its own work
+    item, so one large file no longer runs on its own after the rest.
+    Items are started largest first, which keeps every thread busy until
+    close to the end; block-mode items larger than their share of the
+    work left are hashed with several block threads, so a single large
+    item at the end is spread across the pool too.
+    Digests come out in the order the files were added: written to
+    stdout in that order (or as completed with --unordered), or added to
+    a set in that order once all are done.  Output of items finished
+    ahead of an earlier one is held until that one is written; once
+    HELD_OUTPUT_MAX is held, threads start nothing but the earliest item
+    not yet finished, and wait while it is being hashed.
+    Files can also be added while hashing runs, between start() and
+    finish(), as a directory walk finds them; threads then take the
+    largest item waiting, and wait for more when there is none.
+    With a digest cache, items whose file is unchanged since a cached
+    digest was made are not read: the cached digest is used instead, and
+    digests that are made are added to the cache.
+    With a memory budget, each item reserves its input buffer and the
+    rank and score arrays of its threads before it is read.  A block-mode
+    item that does not fit is read and hashed a window of blocks at a
+    time instead, which makes the same digest in a fraction of the
+    memory; a stream-mode item waits for others to finish.
+*/
+/// hash_scheduler class
+class hash_scheduler {
+
+public:
+    /// scheduler for thread_cnt threads, adding digests to addto, or writing them if NULL
+    hash_scheduler(uint32_t thread_cnt, sdbf_set *addto, index_info *info);
+
+    /// queue a file with stat() st, in block mode with block_size (0 for stream mode), segmented
+    void add_file(const std::string &fname, const struct stat &st, uint32_t block_size, uint64_t segment_size);
+    /// take digests of unchanged files from cache, confirmed by checksum if verify
+    void use_cache(digest_cache *cache, bool verify);
+    /// keep input and working memory within budget
+    void limit_memory(memory_budget *budget);
+    /// hash everything queued
+    void run();
+    /// start hashing, taking files as they are added
+    void start();
+    /// hash what is left once all files are added, then stop
+    void finish();
+
+    /// number of work items
+    uint32_t size() const;
+    /// bytes queued
+    uint64_t total_bytes() const;
+    /// items taken from the cache
+    uint64_t cache_hits() const;
+    /// items hashed a window at a time, to keep within the memory budget
+    uint64_t windowed() const;
+
+private:
+    static void thread_hash(hash_scheduler *sched, index_info *info);
+    void hash_item(uint32_t n, const hash_item_t &item, index_info *info, uint32_t threads, std::string &encoded);
+    bool cached_item(uint32_t n, const hash_item_t &item, cache_record_t &rec, std::string &encoded);
+    static uint64_t item_memory(const hash_item_t &item, uint32_t threads, uint64_t window);
+    void submit(uint32_t n, std::string &encoded);
+
+    uint32_t thread_cnt;
+    sdbf_set *addto;
+    index_info *info;
+    output_writer *writer;
+    digest_cache *cache;
+    bool verify;
+    memory_budget *budget;
+    boost::thread_group *pool;
+    std::vector<index_info> shard_info;
+    // shared by hashing threads and whoever adds files
+    boost::mutex lock;
+    boost::condition_variable added;  // signalled as items are added, or adding ends
+    std::vector<hash_item_t> items;   // in output order
+    std::vector<uint32_t> waiting;    // items not yet started, a heap with the largest on top
+    std::vector<class sdbf*> results; // digests of items, when adding to a set
+    uint64_t remaining;               // bytes of items not yet started
+    bool closed;                      // no more items will be added
+    uint64_t hits;                    // items taken from the cache
+    uint64_t windows;                 // items hashed a window at a time
+    // ordered output: items before frontier are finished; held is the
+    // output of those after it that are, by item
+    uint32_t frontier;
+    std::map<uint32_t,uint64_t> held_items;
+    uint64_t held;
+};
+
+#endif
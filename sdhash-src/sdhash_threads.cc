@@ -5,12 +5,15 @@
 
 #include "../sdbf/sdbf_class.h"
 #include "../sdbf/sdbf_defines.h"
+#include "../sdbf/counting_bloom_filter.h"
 #include "sdhash.h"
 
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <fstream>
+#include <unistd.h>
+#include <assert.h>
 
 #include <boost/thread/thread.hpp>
 #include <boost/filesystem.hpp>
@@ -24,6 +27,43 @@ namespace fs = boost::filesystem;
 extern sdbf_parameters_t sdbf_sys;
 
 
+/**
+    Estimates how many features an index needs room for, from the amount
+    of input.  Stream mode keeps at most about one feature per 32 bytes;
+    block mode at most max_elem_dd per block.  Indexes grow past this if
+    the estimate is short, at some cost in lookups.
+    \param bytes input size
+    \param block_size block size in block mode, 0 in stream mode
+    \returns expected number of features
+*/
+uint64_t
+index_capacity(uint64_t bytes, uint64_t block_size) {
+    if (block_size)
+        return (bytes/block_size + 1)*_MAX_ELEM_COUNT_DD;
+    return bytes/32 + 1;
+}
+
+/**
+    Reports the size, fill and estimated false positive rate of each
+    partition of an index, and warns if the index as a whole is over the
+    requested rate.
+*/
+void
+report_index(const string &name, bloom_filter *index) {
+    if (sdbf_sys.verbose) {
+        for (uint32_t i=0; i < index->partitions(); i++) {
+            // elem_count() counts from a partition onwards
+            bloom_filter *part=index->partition(i), *rest=index->partition(i+1);
+            cerr << "sdhash: " << name << " partition " << i << ": " << part->size()/KB << "KB, ";
+            cerr << part->elem_count() - (rest ? rest->elem_count() : 0);
+            cerr << " elements, " << (int)(100*part->fill() + 0.5) << "% full" << endl;
+        }
+        cerr << "sdhash: " << name << " " << index->elem_count() << " elements, est. FP rate " << index->est_fp_rate() << endl;
+    }
+    if (sdbf_sys.warnings && index->est_fp_rate() > sdbf_sys.index_fp)
+        cerr << "sdhash: Warning: " << name << " est. FP rate " << index->est_fp_rate() << " is over " << sdbf_sys.index_fp << endl;
+}
+
 // NOT in sdbf class
 /** 
     the actual processing task for the file-list hashing without block mode
@@ -32,7 +72,6 @@ void
 *thread_sdbf_hashfile( void *task_param) {
     filehash_task_t *task = (filehash_task_t *)task_param;
     struct stat file_stat;
-    int32_t chunks = 0,csize = 0;
     ifstream *is = new ifstream();
 
     int i;
@@ -43,15 +82,8 @@ void
         try {
          if (sdbf_sys.verbose) 
             cerr << "sdhash: digesting file " << task->filenames[i] << endl;
-            if (!task->addset) {
-                class sdbf *sdbfm = new sdbf(task->filenames[i],is,0,file_stat.st_size,task->info);
-                cout << sdbfm;
-                delete sdbfm;            
-            } else  {
-                class sdbf *sdbfm = new sdbf(task->filenames[i],is,0,file_stat.st_size,task->info);
-                task->addset->add(sdbfm);
-            }
-            
+            class sdbf *sdbfm = new sdbf(task->filenames[i],is,0,file_stat.st_size,task->info);
+            task->addset->add(sdbfm);
         } catch (int e) {
             if (e==-2)
                exit(-2);
@@ -60,69 +92,135 @@ void
             }
        }
        is->close();
+       is->clear();
     }
     delete is;
+    return NULL;
 }
 
+// segments of stdin held at once: one being read while the others are hashed
+#define STDIN_BUFFERS 2
+
+// ring of segment buffers between the stdin reader thread and the hasher
+typedef struct {
+    char     *buffers[STDIN_BUFFERS];
+    size_t    sizes[STDIN_BUFFERS];
+    uint64_t  filled;       // segments read
+    uint64_t  consumed;     // segments hashed, whose buffers are free again
+    bool      eof;
+    boost::mutex lock;
+    boost::condition_variable changed;
+} stdin_ring_t;
+
+/**
+    Reader thread for sdbf_hash_stdin: reads stdin a segment at a time
+    into the next free buffer of the ring, until end of input.
+*/
+static void
+read_stdin(stdin_ring_t *ring) {
+    sdbf_stats_t *stats = sdbf_stats::local();
+    uint64_t since = 0;
+    for (uint64_t j = 0; ; j++) {
+        {
+            boost::mutex::scoped_lock guard(ring->lock);
+            while (j - ring->consumed >= STDIN_BUFFERS)
+                ring->changed.wait(guard);
+        }
+        // the hasher does not touch this buffer until filled passes j
+        if (stats)
+            since = sdbf_stats::now();
+        size_t sz = fread(ring->buffers[j % STDIN_BUFFERS], 1, sdbf_sys.segment_size, stdin);
+        stats_lap(stats, STAT_READ, &since);
+        {
+            boost::mutex::scoped_lock guard(ring->lock);
+            ring->sizes[j % STDIN_BUFFERS] = sz;
+            ring->filled++;
+            if (sz != sdbf_sys.segment_size)
+                ring->eof = true;
+        }
+        ring->changed.notify_all();
+        if (sz != sdbf_sys.segment_size)
+            return;
+    }
+}
+
+/**
+    Hashes stdin in segments of sdbf_sys.segment_size, in block mode.  A
+    reader thread fills a ring of segment buffers while earlier segments
+    are hashed, so reading a pipe or device overlaps with hashing.
+    Segments are hashed, and added to the set, in order.
+    \param info index information for the digests
+    \returns set of segment digests
+*/
 sdbf_set
 *sdbf_hash_stdin(index_info *info) {
     sdbf_set *myset = new sdbf_set();
     const char *default_name= "stdin";
     char *stream;
-    int32_t j = 0;
     if (sdbf_sys.filename == NULL) {
         stream = (char*)default_name;
     } else {
         stream = sdbf_sys.filename;
     }
-    
-    char *readbuf = (char *)alloc_check(ALLOC_ONLY,sizeof(char)*sdbf_sys.segment_size, "sdbf_hash_stdin","read buffer",ERROR_EXIT);
-    if (readbuf!=NULL) {
-        int done = 0;
-        while (!done) {
-            std::stringstream namestr;
-            namestr << stream;
-            memset(readbuf,0,sdbf_sys.segment_size);
-            size_t sz = fread(readbuf,1,sdbf_sys.segment_size,stdin);
-            if (sz != sdbf_sys.segment_size) 
-                done = 1;
-            //if (j >0) { // always start at 0M
-                namestr.fill('0');
-                namestr << "." << setw(4) << j*sdbf_sys.segment_size/MB << "M" ;
-         //}
-            string myname = namestr.str();
-            char *fname = (char*)alloc_check(ALLOC_ONLY,myname.length()+1, "sdbf_hash_stdin", "generated filename",ERROR_EXIT);
-            strncpy(fname,myname.c_str(),myname.length()+1);
-            if (sdbf_sys.verbose) 
+    stdin_ring_t ring;
+    for (uint32_t b = 0; b < STDIN_BUFFERS; b++)
+        ring.buffers[b] = (char *)alloc_check(ALLOC_ONLY,sizeof(char)*sdbf_sys.segment_size, "sdbf_hash_stdin","read buffer",ERROR_EXIT);
+    ring.filled = ring.consumed = 0;
+    ring.eof = false;
+    boost::thread reader(read_stdin, &ring);
+    for (uint64_t j = 0; ; j++) {
+        size_t sz;
+        {
+            boost::mutex::scoped_lock guard(ring.lock);
+            while (ring.filled <= j && !ring.eof)
+                ring.changed.wait(guard);
+            if (ring.filled <= j)
+                break;
+            sz = ring.sizes[j % STDIN_BUFFERS];
+        }
+        std::stringstream namestr;
+        namestr << stream;
+        // always start at 0M
+        namestr.fill('0');
+        namestr << "." << setw(4) << j*sdbf_sys.segment_size/MB << "M" ;
+        string myname = namestr.str();
+        char *fname = (char*)alloc_check(ALLOC_ONLY,myname.length()+1, "sdbf_hash_stdin", "generated filename",ERROR_EXIT);
+        strncpy(fname,myname.c_str(),myname.length()+1);
+        if (sdbf_sys.verbose) 
             cerr << "sdhash: "<< stream << " segment begin "<< j*sdbf_sys.segment_size/MB << "M" << endl;
-            try {
-                class sdbf *sdbfm = new sdbf(fname,readbuf,sdbf_sys.dd_block_size*KB,sz, info);
-                //myset->insert(sdbfm);
-                myset->add(sdbfm);
-            } catch (int e) {
-                if (e==-2)
-                   exit(-2);
-            } 
-            j++;
+        try {
+            class sdbf *sdbfm = new sdbf(fname,ring.buffers[j % STDIN_BUFFERS],sdbf_sys.dd_block_size*KB,sz, info);
+            myset->add(sdbfm);
+        } catch (int e) {
+            if (e==-2)
+               exit(-2);
+            free(fname);
+        } 
+        {
+            boost::mutex::scoped_lock guard(ring.lock);
+            ring.consumed++;
         }
+        ring.changed.notify_all();
     }
+    reader.join();
+    for (uint32_t b = 0; b < STDIN_BUFFERS; b++)
+        free(ring.buffers[b]);
     if (sdbf_sys.verbose) 
       cerr << "sdhash: finished hashing stdin." << endl;
     return myset;
 }
 
 /**
- * Compute SD for a list of files & add them to a new set.
- * Not block-wise.
- \returns sdbf_set with the hashes in it
+ * Compute SD for a list of files & add them to a set.
+ * Not block-wise.  Digests written straight out go through hash_scheduler.
+ \param addto set to add to, not NULL
  */
 void
 sdbf_hash_files( char **filenames, uint32_t file_count, int32_t thread_cnt,sdbf_set *addto, index_info *info ) {
-    int32_t i, t, j;
-    //sdbf_set *myset = new sdbf_set();
+    int32_t i, t;
     struct stat file_stat;
-    int32_t chunks = 0,csize = 0;
     ifstream *is = new ifstream();
+    assert(addto != NULL);
 
     // Sequential implementation
     if( thread_cnt == 1) {
@@ -133,14 +231,8 @@ sdbf_hash_files( char **filenames, uint32_t file_count, int32_t thread_cnt,sdbf_
             try {
             if (sdbf_sys.verbose) 
                cerr << "sdhash: digesting file " << filenames[i] << endl;
-                if (!addto) {
-                    class sdbf *sdbfm = new sdbf(filenames[i],is,0,file_stat.st_size,info);
-                    cout << sdbfm ;
-                    delete sdbfm;
-                } else  {
-                    class sdbf *sdbfm = new sdbf(filenames[i],is,0,file_stat.st_size,info);
-                    addto->add(sdbfm);
-                }
+                class sdbf *sdbfm = new sdbf(filenames[i],is,0,file_stat.st_size,info);
+                addto->add(sdbfm);
             } catch (int e) {
                 if (e==-2)
                    exit(-2);
@@ -149,18 +241,29 @@ sdbf_hash_files( char **filenames, uint32_t file_count, int32_t thread_cnt,sdbf_
                 }
             }
             is->close();
+            is->clear();
         }
     // Threaded implementation
     } else {
       boost::thread *thread_pooll[MAX_THREADS];
         filehash_task_t *tasks = (filehash_task_t *) alloc_check( ALLOC_ZERO, thread_cnt*sizeof( filehash_task_t), "sdbf_hash_files", "tasks", ERROR_EXIT);
+        // with shards, each thread inserts into its own copy of the index
+        bool shards = sdbf_sys.index_shards && info && info->index;
+        index_info *shard_info = NULL;
+        if (shards) {
+            shard_info = (index_info *) alloc_check( ALLOC_ONLY, thread_cnt*sizeof( index_info), "sdbf_hash_files", "shard info", ERROR_EXIT);
+            for( t=0; t<thread_cnt; t++) {
+                shard_info[t] = *info;
+                shard_info[t].index = new bloom_filter(info->index->size(), info->index->hash_functions(), 0, 0.01, info->index->layout());
+            }
+        }
         for( t=0; t<thread_cnt; t++) {
             tasks[t].tid = t;
             tasks[t].tcount = thread_cnt;
             tasks[t].filenames = filenames;
             tasks[t].file_count = file_count;
             tasks[t].addset = addto;
-            tasks[t].info = info;
+            tasks[t].info = shards ? shard_info+t : info;
          thread_pooll[t] = new boost::thread(thread_sdbf_hashfile,tasks+t);
         }
         for( t=0; t<thread_cnt; t++) {
@@ -169,6 +272,15 @@ sdbf_hash_files( char **filenames, uint32_t file_count, int32_t thread_cnt,sdbf_
         for( t=0; t<thread_cnt; t++) {
             delete thread_pooll[t];
         }
+        if (shards) {
+            for( t=0; t<thread_cnt; t++) {
+                info->index->add(shard_info[t].index);
+                delete shard_info[t].index;
+            }
+            // features seen by several threads were counted by each
+            info->index->recount();
+            free(shard_info);
+        }
       free(tasks);
     // End threading
     }
@@ -183,15 +295,10 @@ sdbf_hash_files_dd( char **filenames, uint32_t file_count, uint32_t dd_block_siz
     ifstream *is = new ifstream();
    int tailflag = 0;
    uint64_t filesize;
+    assert(addto != NULL);
     for( i=0; i<file_count; i++) {
       tailflag=0;
        filesize=fs::file_size(filenames[i]);
-       // if (filesize=fs::file_size(filenames[i])) {
-   //      if (sdbf_sys.warnings) 
-   //         cerr<< "sdhash: cannot access " << filenames[i] << endl;
-			//cerr << strerror(errno) << endl;
-   //         continue; // try the next one if cannot access
-   //     }
       if (sdbf_sys.verbose) 
          cerr << "sdhash: digesting file " << filenames[i] << endl;
         is->open(filenames[i], ios::binary);
@@ -225,14 +332,8 @@ sdbf_hash_files_dd( char **filenames, uint32_t file_count, uint32_t dd_block_siz
                     csize=chunk_size;
             }
                 try {
-                    if (addto!=NULL) {
-                        class sdbf *sdbfm = new sdbf(fname,is,dd_block_size,csize,info);
-                        addto->add(sdbfm);
-                    } else {
-                        class sdbf *sdbfm = new sdbf(fname,is,dd_block_size,csize,info);
-                        std::cout <<sdbfm;
-		delete sdbfm;
-                    }
+                    class sdbf *sdbfm = new sdbf(fname,is,dd_block_size,csize,info);
+                    addto->add(sdbfm);
                 } catch (int e) {
                     if (e==-2)
                        exit(-2);
@@ -240,14 +341,8 @@ sdbf_hash_files_dd( char **filenames, uint32_t file_count, uint32_t dd_block_siz
             }
         } else {
             try {
-                if (addto!=NULL) {
                 class sdbf *sdbfm = new sdbf(filenames[i],is,dd_block_size,filesize,info);
-                    addto->add(sdbfm);
-                } else {
-                class sdbf *sdbfm = new sdbf(filenames[i],is,dd_block_size,filesize,info);
-                    std::cout <<sdbfm;
-                    delete sdbfm;
-                }
+                addto->add(sdbfm);
             } catch (int e) {
                 if (e==-2)
                    exit(-2);
@@ -258,6 +353,46 @@ sdbf_hash_files_dd( char **filenames, uint32_t file_count, uint32_t dd_block_siz
     delete is;
 }
 
+/**
+    Creates the counting index kept beside an index, with --index-counting.
+    It takes the shape of the index's first partition, so that its
+    snapshot() is that partition bit for bit.
+    \param index new, empty index
+    \returns new counting index, or NULL if not wanted
+*/
+static counting_bloom_filter *
+new_counting(bloom_filter *index) {
+    if (!sdbf_sys.index_counting)
+        return NULL;
+    return new counting_bloom_filter(index->size(), index->hash_functions(), index->layout());
+}
+
+/**
+    Writes the counting index for a set, next to its plain index.
+    Counting filters cannot grow, so if the index grew partitions while
+    hashing, the counting index no longer matches it and is not written.
+    \param output_nm set file name
+    \param counting counting index
+    \param index plain index it was built beside
+    \returns 0 if successful, -1 if cannot write or the index grew
+*/
+static int32_t
+write_counting(const string &output_nm, counting_bloom_filter *counting, bloom_filter *index) {
+    if (index->partitions() > 1) {
+        cerr << "sdhash: ERROR: index " << output_nm << ".idx outgrew its size estimate and counting indexes cannot grow; no counting index written" << endl;
+        return -1;
+    }
+    counting->set_name(output_nm);
+    string output_counting = output_nm + ".cidx";
+    if (counting->write_out(output_counting)) {
+        cerr << "sdhash: ERROR cannot write to file " << output_counting << endl;
+        return -1;
+    }
+    if (sdbf_sys.verbose)
+        cerr << "sdhash: counting index " << output_counting << " " << counting->elem_count() << " elements, " << counting->size()*4/KB << "KB" << endl;
+    return 0;
+}
+
 int32_t 
 hash_index_stringlist(const std::vector<std::string> & filenames, string output_name) {
     std::vector<string> small;
@@ -279,6 +414,10 @@ hash_index_stringlist(const std::vector<std::string> & filenames, string output_
     index_info *info=(index_info*)malloc(sizeof(index_info));
     info->setlist=NULL;
     info->indexlist=NULL;
+    info->sliced=NULL;
+    info->tree=NULL;
+    info->counting=NULL;
+    info->counting_remove=false;
     info->search_deep=false;
     info->search_first=false;
     if (smallct > 0) {
@@ -295,8 +434,9 @@ hash_index_stringlist(const std::vector<std::string> & filenames, string output_
                //if (sdbf_sys.verbose)
                     //cerr << "hash "<<hashfilecount<< " numf "<<filect<< endl;
                // set up new index, set, hash them..
-               bloom_filter *index1=new bloom_filter(4*MB,5,0,0.01);
+               bloom_filter *index1=new bloom_filter(index_capacity(sizetotal, 0),sdbf_sys.index_fp,sdbf_sys.index_layout,sdbf_sys.index_hashes);
                info->index=index1;
+               info->counting=new_counting(index1);
                set1=new sdbf_set(index1);
                sdbf_hash_files( smalllist, filect, sdbf_sys.thread_cnt,set1, info);
                string output_nm= output_name+boost::lexical_cast<string>(hashfilecount)+".sdbf";
@@ -315,13 +455,17 @@ hash_index_stringlist(const std::vector<std::string> & filenames, string output_
                }
                set1->index->set_name(output_nm);
                string output_index = output_nm + ".idx";
-               int output_result = set1->index->write_out(output_index);
+               int output_result = set1->index->write_out(output_index, sdbf_sys.index_raw);
                if (output_result == -2) {
                    cerr << "sdhash: ERROR cannot write to file " << output_index<< endl;
                    return -1;
                }
+               report_index(output_index, index1);
+               if (info->counting && write_counting(output_nm, info->counting, index1))
+                   return -1;
 	       delete set1;
                delete index1;
+               delete info->counting;
                // make hashsetID
                // add set to list
             }
@@ -336,9 +480,10 @@ hash_index_stringlist(const std::vector<std::string> & filenames, string output_
         for (i=0; i < largect ; i++) {
            largelist[0]=(char*)alloc_check(ALLOC_ONLY,large[i].length()+1, "main", "filename", ERROR_EXIT);
            strncpy(largelist[0],large[i].c_str(),large[i].length()+1);
-           // making larger for larger files doesn't seem to help.
-           bloom_filter *index1=new bloom_filter(4*MB,5,0,0.01);
+           uint64_t block_size = (sdbf_sys.dd_block_size == 0) ? 0 : (sdbf_sys.dd_block_size == -1) ? 16*KB : sdbf_sys.dd_block_size*KB;
+           bloom_filter *index1=new bloom_filter(index_capacity(fs::file_size(large[i]), block_size),sdbf_sys.index_fp,sdbf_sys.index_layout,sdbf_sys.index_hashes);
            info->index=index1;
+           info->counting=new_counting(index1);
            set1=new sdbf_set(index1);
            // hash it
            if (sdbf_sys.dd_block_size == 0 ) {  // if forcing file mode with -b 0
@@ -366,14 +511,75 @@ hash_index_stringlist(const std::vector<std::string> & filenames, string output_
            }
            set1->index->set_name(output_nm);
            string output_index = output_nm + ".idx";
-           int output_result = set1->index->write_out(output_index);
+           int output_result = set1->index->write_out(output_index, sdbf_sys.index_raw);
            if (output_result == -2) {
                cerr << "sdhash: ERROR cannot write to file " << output_index<< endl;
                return -1;
            }
+           report_index(output_index, index1);
+           if (info->counting && write_counting(output_nm, info->counting, index1))
+               return -1;
            delete set1;
            delete index1;
+           delete info->counting;
         }
     }
     return 0;
 }
+
+/**
+    Takes the features of files out of a counting index.  Files are hashed
+    as hash_index_stringlist() hashed them, so the same features come out:
+    small files whole, large ones in blocks unless -b 0.
+    \param filenames files to remove
+    \param counting counting index they were added to
+    \param removed names of the digests generated, as they appear in sets
+    \returns number of features removed
+*/
+uint64_t
+remove_index_stringlist(const std::vector<std::string> & filenames, counting_bloom_filter *counting, std::vector<std::string> *removed) {
+    std::vector<string> small;
+    std::vector<string> large;
+    for (vector<string>::const_iterator it=filenames.begin(); it < filenames.end(); it++) {
+        if (fs::is_regular_file(*it)) {
+            if (fs::file_size(*it) < 16*MB)
+                small.push_back(*it);
+            else
+                large.push_back(*it);
+        }
+    }
+    index_info *info=(index_info*)malloc(sizeof(index_info));
+    info->index=NULL;
+    info->setlist=NULL;
+    info->indexlist=NULL;
+    info->sliced=NULL;
+    info->tree=NULL;
+    info->counting=counting;
+    info->counting_remove=true;
+    info->search_deep=false;
+    info->search_first=false;
+    info->basename=false;
+    uint64_t before=counting->elem_count();
+    sdbf_set *set1=new sdbf_set();
+    if (small.size() > 0) {
+        char **smalllist=(char **)alloc_check(ALLOC_ONLY,small.size()*sizeof(char*),"main", "filename list", ERROR_EXIT);
+        for (uint32_t i=0; i < small.size(); i++) {
+            smalllist[i]=(char*)alloc_check(ALLOC_ONLY,small[i].length()+1, "main", "filename", ERROR_EXIT);
+            strncpy(smalllist[i],small[i].c_str(),small[i].length()+1);
+        }
+        sdbf_hash_files( smalllist, small.size(), sdbf_sys.thread_cnt,set1, info);
+    }
+    for (uint32_t i=0; i < large.size(); i++) {
+        char *largelist[1];
+        largelist[0]=(char*)large[i].c_str();
+        if (sdbf_sys.dd_block_size == 0)
+            sdbf_hash_files( largelist, 1, sdbf_sys.thread_cnt,set1, info);
+        else
+            sdbf_hash_files_dd( largelist, 1, (sdbf_sys.dd_block_size == -1) ? 16*KB : sdbf_sys.dd_block_size*KB,sdbf_sys.segment_size, set1, info);
+    }
+    for (uint32_t i=0; i < set1->size(); i++)
+        removed->push_back(set1->at(i)->name());
+    delete set1;
+    free(info);
+    return before-counting->elem_count();
+}
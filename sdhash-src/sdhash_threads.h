@@ -7,5 +7,8 @@ void sdbf_hash_files( char **filenames, uint32_t file_count, int32_t thread_cnt,
 sdbf_set *sdbf_hash_stdin(index_info *info);
 void sdbf_hash_files_dd( char **filenames, uint32_t file_count, uint32_t dd_block_size, uint64_t chunk_size, sdbf_set *addto, index_info *info);
 
+uint64_t index_capacity(uint64_t bytes, uint64_t block_size);
+void report_index(const string &name, bloom_filter *index);
 int32_t hash_index_stringlist(const std::vector<std::string> & filenames, string output_name);
+uint64_t remove_index_stringlist(const std::vector<std::string> & filenames, counting_bloom_filter *counting, std::vector<std::string> *removed);
 #endif
@@ -0,0 +1,211 @@
+// sdhash_walk.cc
+// parallel discovery of files under directories
+
+#include "sdhash_walk.h"
+#include "../sdbf/sdbf_defines.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+using namespace std;
+
+/**
+    Creates a walker with no patterns, reporting every file.
+    \param thread_cnt threads to walk with
+    \param found called for each file found
+    \param context passed to found
+*/
+dir_walker::dir_walker(uint32_t thread_cnt, found_fn found, void *context) {
+    if (thread_cnt < 1)
+        thread_cnt = 1;
+    if (thread_cnt > MAX_THREADS)
+        thread_cnt = MAX_THREADS;
+    this->thread_cnt = thread_cnt;
+    this->found = found;
+    this->context = context;
+    hardlinks = false;
+    busy = 0;
+    file_ct = dir_ct = error_ct = 0;
+}
+
+void
+dir_walker::include(const std::string &pattern) {
+    includes.push_back(pattern);
+}
+
+void
+dir_walker::exclude(const std::string &pattern) {
+    excludes.push_back(pattern);
+}
+
+void
+dir_walker::skip_hardlinks(bool skip) {
+    hardlinks = skip;
+}
+
+/**
+    Walks everything under the directories given, returning when all
+    have been read and their files reported.  Regular files given in
+    roots are reported without checking the patterns; anything else that
+    is not a directory is ignored.
+    \param roots directories and files to walk
+*/
+void
+dir_walker::walk(const std::vector<std::string> &roots) {
+    for (uint32_t n = 0; n < roots.size(); n++) {
+        struct stat st;
+        if (stat(roots[n].c_str(), &st))
+            continue;
+        if (S_ISDIR(st.st_mode))
+            dirs.push_back(roots[n]);
+        else if (S_ISREG(st.st_mode))
+            report(roots[n], st);
+    }
+    if (thread_cnt <= 1) {
+        thread_walk(this);
+    } else {
+        boost::thread_group pool;
+        for (uint32_t t = 0; t < thread_cnt; t++)
+            pool.create_thread(boost::bind(&dir_walker::thread_walk, this));
+        pool.join_all();
+    }
+}
+
+/**
+    Walking thread: reads queued directories until the queue is empty
+    and no other thread is reading one that might add to it.
+*/
+void
+dir_walker::thread_walk(dir_walker *walker) {
+    for (;;) {
+        std::string dir;
+        {
+            boost::mutex::scoped_lock guard(walker->lock);
+            while (walker->dirs.empty() && walker->busy > 0)
+                walker->queued.wait(guard);
+            if (walker->dirs.empty())
+                return;
+            dir = walker->dirs.front();
+            walker->dirs.pop_front();
+            walker->busy++;
+        }
+        walker->read_dir(dir);
+        {
+            boost::mutex::scoped_lock guard(walker->lock);
+            walker->busy--;
+        }
+        walker->queued.notify_all();
+    }
+}
+
+/**
+    Reads one directory: queues the directories in it and reports the
+    files.  The file type from readdir() saves a stat() for directories
+    on most file systems; files are stat()ed relative to the directory.
+    \param dir directory to read
+*/
+void
+dir_walker::read_dir(const std::string &dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    DIR *d = (fd < 0) ? NULL : fdopendir(fd);
+    if (d == NULL) {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        boost::mutex::scoped_lock guard(found_lock);
+        error_ct++;
+        cerr << "sdhash: ERROR: Filesystem problem in recursive searching " << dir << ": " << strerror(err) << endl;
+        return;
+    }
+    std::string prefix = dir;
+    if (prefix.empty() || prefix[prefix.length()-1] != '/')
+        prefix += '/';
+    std::vector<std::string> subdirs;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char *name = ent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+        if (matches(excludes, name))
+            continue;
+        struct stat st;
+        unsigned char type = ent->d_type;
+        if (type == DT_DIR) {
+            subdirs.push_back(prefix + name);
+            continue;
+        }
+        if (type == DT_UNKNOWN) {
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+                continue;
+            if (S_ISDIR(st.st_mode)) {
+                subdirs.push_back(prefix + name);
+                continue;
+            }
+            type = S_ISLNK(st.st_mode) ? DT_LNK : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+            if (type == DT_UNKNOWN)
+                continue;
+        } else if (type != DT_REG && type != DT_LNK) {
+            continue;
+        }
+        if (!includes.empty() && !matches(includes, name))
+            continue;
+        // the type above came from readdir or an lstat: size it, following links
+        if (fstatat(fd, name, &st, 0) || !S_ISREG(st.st_mode))
+            continue;
+        report(prefix + name, st);
+    }
+    closedir(d);
+    {
+        boost::mutex::scoped_lock guard(lock);
+        dirs.insert(dirs.end(), subdirs.begin(), subdirs.end());
+        dir_ct++;
+    }
+}
+
+/**
+    Reports a file, unless it is a hard link to one already reported
+    and those are being skipped.
+*/
+void
+dir_walker::report(const std::string &path, const struct stat &st) {
+    boost::mutex::scoped_lock guard(found_lock);
+    if (hardlinks && st.st_nlink > 1 && !seen.insert(std::make_pair(st.st_dev, st.st_ino)).second)
+        return;
+    file_ct++;
+    found(path, st, context);
+}
+
+bool
+dir_walker::matches(const std::vector<std::string> &patterns, const char *name) const {
+    for (uint32_t n = 0; n < patterns.size(); n++) {
+        if (fnmatch(patterns[n].c_str(), name, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+uint64_t
+dir_walker::files() const {
+    return file_ct;
+}
+
+uint64_t
+dir_walker::directories() const {
+    return dir_ct;
+}
+
+uint64_t
+dir_walker::errors() const {
+    return error_ct;
+}
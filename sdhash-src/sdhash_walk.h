@@ -0,0 +1,84 @@
+/**
+ * sdhash_walk.h: parallel discovery of files under directories
+ */
+#ifndef __SDHASH_WALK_H
+#define __SDHASH_WALK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <deque>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+    dir_walker: finds the regular files under a list of directories with
+    a pool of threads.  Threads share a queue of directories; each reads
+    one directory, queues the directories in it and reports the files,
+    with a single stat() per file and none for directories the file
+    system types for us.  Files are reported as they are found, so the
+    caller can start on them before the walk is over; the order depends
+    on timing, so differs from run to run when more than one thread walks.
+    Symbolic links to files are followed, links to directories are not.
+    Include and exclude patterns are shell wildcards (fnmatch) on the
+    name of the entry: a file is reported if it matches an include
+    pattern, or there are none, and no exclude pattern; directories
+    matching an exclude pattern are not entered.
+*/
+/// dir_walker class
+class dir_walker {
+
+public:
+    /// called for each file found, one file at a time: path, its stat(), context
+    typedef void (*found_fn)(const std::string &path, const struct stat &st, void *context);
+
+    /// walker using thread_cnt threads, reporting files to found
+    dir_walker(uint32_t thread_cnt, found_fn found, void *context);
+
+    /// report files matching pattern only
+    void include(const std::string &pattern);
+    /// skip files and directories matching pattern
+    void exclude(const std::string &pattern);
+    /// report a file with several hard links once only
+    void skip_hardlinks(bool skip);
+
+    /// walk the directories in roots; other regular files in it are reported as they are
+    void walk(const std::vector<std::string> &roots);
+
+    /// files reported
+    uint64_t files() const;
+    /// directories read
+    uint64_t directories() const;
+    /// directories that could not be read
+    uint64_t errors() const;
+
+private:
+    static void thread_walk(dir_walker *walker);
+    void read_dir(const std::string &dir);
+    void report(const std::string &path, const struct stat &st);
+    bool matches(const std::vector<std::string> &patterns, const char *name) const;
+
+    uint32_t thread_cnt;
+    found_fn found;
+    void *context;
+    std::vector<std::string> includes;
+    std::vector<std::string> excludes;
+    bool hardlinks;
+    // shared by walking threads
+    boost::mutex lock;
+    boost::condition_variable queued;    // signalled as directories are queued or finished
+    std::deque<std::string> dirs;        // directories waiting to be read
+    uint32_t busy;                       // threads reading a directory
+    boost::mutex found_lock;             // held while reporting a file
+    std::set<std::pair<dev_t,ino_t> > seen;   // hard-linked files reported
+    uint64_t file_ct;
+    uint64_t dir_ct;
+    uint64_t error_ct;
+};
+
+#endif